@@ -0,0 +1,82 @@
+#include "admission.h"
+
+#include <stdio.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+#define SHED_RESPONSE_BUFSIZE 128
+#define DRAIN_BUFSIZE 1024
+
+static int max_queue_depth = 0;
+static long long target_wait_ns = 0;
+static char shed_response[SHED_RESPONSE_BUFSIZE];
+static int shed_response_len = 0;
+
+// CoDel state: when queue waits first went above target, or 0 while they are below it, and
+// whether they have stayed above it for a whole interval since
+static long long first_above_ns = 0;
+static int overloaded = 0;
+
+void admission_configure(int queue_depth, int target_wait_ms, int retry_after) {
+    max_queue_depth = queue_depth;
+    target_wait_ns = target_wait_ms * 1000000LL;
+    // Rendered once so shedding costs a single send() however overloaded the server is
+    shed_response_len = snprintf(shed_response, sizeof(shed_response),
+                                 "HTTP/1.1 503 Service Unavailable\r\n"
+                                 "Retry-After: %d\r\n"
+                                 "Content-Length: 0\r\n"
+                                 "Connection: close\r\n"
+                                 "\r\n",
+                                 retry_after);
+}
+
+void admission_observe_wait(long long wait_ns) {
+    if (target_wait_ns == 0) {
+        return;
+    }
+    if (wait_ns < target_wait_ns) {
+        // One short wait means the queue drained at some point, so it is not standing
+        __atomic_store_n(&first_above_ns, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&overloaded, 0, __ATOMIC_RELAXED);
+        return;
+    }
+    long long now_ns = metrics_now_ns();
+    long long first_ns = __atomic_load_n(&first_above_ns, __ATOMIC_RELAXED);
+    if (first_ns == 0) {
+        __atomic_compare_exchange_n(&first_above_ns, &first_ns, now_ns, 0, __ATOMIC_RELAXED,
+                                    __ATOMIC_RELAXED);
+    } else if (now_ns - first_ns >= CODEL_INTERVAL_MS * 1000000LL) {
+        __atomic_store_n(&overloaded, 1, __ATOMIC_RELAXED);
+    }
+}
+
+int admission_enabled(void) {
+    return max_queue_depth > 0 || target_wait_ns > 0;
+}
+
+admission_decision_t admission_check(long queue_depth) {
+    if (max_queue_depth > 0 && queue_depth >= max_queue_depth) {
+        return SHED_QUEUE_DEPTH;
+    }
+    // An empty queue has no standing delay, and only dequeues could clear the flag otherwise
+    if (queue_depth > 0 && __atomic_load_n(&overloaded, __ATOMIC_RELAXED)) {
+        return SHED_QUEUE_WAIT;
+    }
+    return ADMIT;
+}
+
+void admission_shed(int client_fd, admission_decision_t reason) {
+    metrics_add(reason == SHED_QUEUE_WAIT ? COUNTER_SHED_QUEUE_WAIT : COUNTER_SHED_QUEUE_DEPTH,
+                1);
+    // Failures are ignored: a client that is gone or not reading just misses the 503
+    send(client_fd, shed_response, shed_response_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    // Consume a request that already arrived, so closing does not reset the connection and
+    // discard the 503 before the client reads it
+    char drain[DRAIN_BUFSIZE];
+    recv(client_fd, drain, sizeof(drain), MSG_DONTWAIT);
+    if (close(client_fd) == -1) {
+        perror("close");
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#define DEFAULT_RETRY_AFTER 1    // seconds clients are asked to wait after a 503
+#define CODEL_INTERVAL_MS 100    // how long queue waits must stay above target before shedding
+
+// What the acceptor should do with a freshly accepted connection
+typedef enum {
+    ADMIT,
+    SHED_QUEUE_DEPTH,    // the queue is full or longer than the configured depth
+    SHED_QUEUE_WAIT,     // connections have waited longer than the target for a whole interval
+} admission_decision_t;
+
+/*
+ * Configure when accepted connections are turned away instead of queued for a worker
+ * Shedding is opt-in: with both limits 0, acceptors wait for room in a full queue instead.
+ * max_queue_depth: Shed once this many connections are waiting (or the queue is full), or 0 to
+ *                  ignore queue depth
+ * target_wait_ms: Shed while every connection dequeued for CODEL_INTERVAL_MS waited at least
+ *                 this long, or 0 to ignore queue waits
+ * retry_after: The Retry-After value, in seconds, of the 503 sent to shed connections
+ */
+void admission_configure(int max_queue_depth, int target_wait_ms, int retry_after);
+
+/*
+ * Check whether connections may be shed at all
+ * Returns 1 if a queue depth or wait target is configured, or 0 otherwise
+ */
+int admission_enabled(void);
+
+/*
+ * Record how long a connection waited in the queue before a worker took it
+ * Called by every worker; the shared state is only updated with relaxed atomics.
+ * wait_ns: The connection's queue wait in nanoseconds
+ */
+void admission_observe_wait(long long wait_ns);
+
+/*
+ * Decide whether to queue a connection
+ * queue_depth: The number of connections already waiting for a worker
+ * Returns ADMIT, or why the connection should be shed
+ */
+admission_decision_t admission_check(long queue_depth);
+
+/*
+ * Turn a connection away with 503 Service Unavailable and close it, counting it as shed
+ * Never blocks: the response is small enough for an empty socket buffer, and is dropped if not.
+ * client_fd: The accepted socket, which is closed
+ * reason: Why the connection is shed
+ */
+void admission_shed(int client_fd, admission_decision_t reason);
+
+#endif    // ADMISSION_H
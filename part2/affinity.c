@@ -0,0 +1,139 @@
+#define _GNU_SOURCE
+
+#include "affinity.h"
+
+#include <errno.h>
+#include <linux/filter.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+static int enabled = 0;
+static cpu_set_t allowed;        // the CPUs the process may run on
+static int cpus[CPU_SETSIZE];    // the allowed CPUs in ascending order
+static int n_cpus = 0;
+static int cpu_index[CPU_SETSIZE];    // position of each CPU in cpus, or -1
+
+int affinity_configure(int pin) {
+    enabled = 0;
+    if (!pin) {
+        return 0;
+    }
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+        perror("sched_getaffinity");
+        return -1;
+    }
+    n_cpus = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        cpu_index[cpu] = CPU_ISSET(cpu, &allowed) ? n_cpus : -1;
+        if (CPU_ISSET(cpu, &allowed)) {
+            cpus[n_cpus++] = cpu;
+        }
+    }
+    enabled = n_cpus > 0;
+    return 0;
+}
+
+int affinity_thread_create(pthread_t *thread, int index, void *(*start)(void *), void *arg) {
+    if (!enabled) {
+        return pthread_create(thread, NULL, start, arg);
+    }
+    pthread_attr_t attr;
+    int ret_val = pthread_attr_init(&attr);
+    if (ret_val != 0) {
+        return ret_val;
+    }
+    cpu_set_t cpu;
+    CPU_ZERO(&cpu);
+    CPU_SET(cpus[index % n_cpus], &cpu);
+    ret_val = pthread_attr_setaffinity_np(&attr, sizeof(cpu), &cpu);
+    if (ret_val == 0) {
+        ret_val = pthread_create(thread, &attr, start, arg);
+    }
+    pthread_attr_destroy(&attr);
+    return ret_val;
+}
+
+/*
+ * Restrict the calling thread to a set of CPUs
+ * set: The CPUs to run on
+ * Returns 0 on success or -1 on error
+ */
+static int set_affinity(const cpu_set_t *set) {
+    int ret_val = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), set);
+    if (ret_val != 0) {
+        fprintf(stderr, "pthread_setaffinity_np failed: %s\n", strerror(ret_val));
+        return -1;
+    }
+    return 0;
+}
+
+int affinity_pin(int index) {
+    if (!enabled) {
+        return 0;
+    }
+    cpu_set_t cpu;
+    CPU_ZERO(&cpu);
+    CPU_SET(cpus[index % n_cpus], &cpu);
+    return set_affinity(&cpu);
+}
+
+int affinity_unpin(void) {
+    if (!enabled) {
+        return 0;
+    }
+    return set_affinity(&allowed);
+}
+
+int affinity_incoming_index(int client_fd) {
+    if (!enabled) {
+        return -1;
+    }
+    int cpu;
+    socklen_t len = sizeof(cpu);
+    if (getsockopt(client_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == -1 || cpu < 0 ||
+        cpu >= CPU_SETSIZE) {
+        return -1;
+    }
+    return cpu_index[cpu];
+}
+
+int affinity_steer_listeners(const int *listen_fds, int n_listeners) {
+    if (n_listeners < 2) {
+        return 0;
+    }
+    // Attaching to or detaching from any socket of the group applies to all of them. A socket
+    // without a CPU of its own would get no connections, so fewer CPUs than sockets keep the hash.
+    if (!enabled || n_cpus < n_listeners) {
+        int zero = 0;
+        if (setsockopt(listen_fds[0], SOL_SOCKET, SO_DETACH_REUSEPORT_BPF, &zero,
+                       sizeof(zero)) == -1 &&
+            errno != ENOENT) {
+            perror("setsockopt");
+            return -1;
+        }
+        return 0;
+    }
+
+    // Load the receiving CPU, compare it with each allowed CPU in turn and return that CPU's
+    // socket; a CPU the process may not use falls back to a modulus
+    struct sock_filter code[2 * CPU_SETSIZE + 3];
+    int n_code = 0;
+    code[n_code++] =
+        (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+    for (int k = 0; k < n_cpus; k++) {
+        code[n_code++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, cpus[k], 0, 1);
+        code[n_code++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, k % n_listeners);
+    }
+    code[n_code++] = (struct sock_filter) BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, n_listeners);
+    code[n_code++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_A, 0);
+
+    struct sock_fprog program = {.len = n_code, .filter = code};
+    if (setsockopt(listen_fds[0], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program,
+                   sizeof(program)) == -1) {
+        perror("setsockopt");
+        return -1;
+    }
+    return 0;
+}
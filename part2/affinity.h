@@ -0,0 +1,61 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <pthread.h>
+
+// With pinning enabled, the thread with index i (worker, event loop, io_uring loop or acceptor i)
+// runs on the i-th CPU the process may use, wrapping around. Threads start out on their CPU, so
+// the memory they touch first (stacks, per-thread pools, connection state) is allocated on its
+// NUMA node. Connections are steered the same way: one whose packets arrived on the k-th CPU goes
+// to listening socket k % n_listeners, and to worker k when the scheduler allows it.
+
+/*
+ * Enable or disable pinning threads to CPUs for every engine started from now on
+ * Must be called while no thread is pinned; the CPUs used are those the caller may run on.
+ * pin: 1 to pin threads, or 0 to leave them to the scheduler
+ * Returns 0 on success or -1 on error
+ */
+int affinity_configure(int pin);
+
+/*
+ * Create a thread, pinned to its CPU if pinning is enabled
+ * thread: Set to the new thread's ID
+ * index: The index of the thread among the workers, loops or acceptors
+ * start: The thread function
+ * arg: The argument passed to the thread function
+ * Returns 0 on success or an error number, like pthread_create()
+ */
+int affinity_thread_create(pthread_t *thread, int index, void *(*start)(void *), void *arg);
+
+/*
+ * Pin the calling thread to the CPU of an index, if pinning is enabled
+ * index: The index whose CPU to run on
+ * Returns 0 on success or -1 on error
+ */
+int affinity_pin(int index);
+
+/*
+ * Let the calling thread run on every CPU again after affinity_pin(), if pinning is enabled
+ * Returns 0 on success or -1 on error
+ */
+int affinity_unpin(void);
+
+/*
+ * Get the index of the thread pinned to the CPU an accepted connection's packets arrive on
+ * client_fd: The accepted socket
+ * Returns the index, or -1 if pinning is disabled or the CPU is not one threads are pinned to
+ */
+int affinity_incoming_index(int client_fd);
+
+/*
+ * Make the kernel hand each new connection to the listening socket whose threads are pinned to
+ * the CPU that received it, with a classic BPF program attached to the SO_REUSEPORT group
+ * With pinning disabled, or fewer CPUs than sockets, a program attached earlier is detached and
+ * the kernel's hash is used.
+ * listen_fds: The listening sockets, in the order they were bound
+ * n_listeners: The number of listening sockets; with only one there is nothing to steer
+ * Returns 0 on success or -1 on error
+ */
+int affinity_steer_listeners(const int *listen_fds, int n_listeners);
+
+#endif    // AFFINITY_H
@@ -0,0 +1,153 @@
+#include "arena.h"
+
+#include <pthread.h>
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define ARENA_ALIGN alignof(max_align_t)
+#define ROUND_UP(n) (((n) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+#define BLOCK_HEADER_SIZE ROUND_UP(sizeof(arena_block_t))
+
+// A free buffer in a thread's pool; the link lives in the buffer itself
+typedef struct pooled_buffer {
+    struct pooled_buffer *next;
+    size_t size;
+} pooled_buffer_t;
+
+// The free buffers one thread keeps, most recently released (and so cache-warm) first
+typedef struct {
+    pooled_buffer_t *free;
+    int n_free;
+    int registered;    // whether the thread-exit destructor knows about this pool
+} buffer_pool_t;
+
+static pthread_once_t pool_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t pool_key;
+static __thread buffer_pool_t pool = {NULL, 0, 0};
+
+/*
+ * Free every buffer in an exiting thread's pool
+ * arg: The thread's buffer_pool_t
+ */
+static void destroy_pool(void *arg) {
+    buffer_pool_t *thread_pool = arg;
+    while (thread_pool->free != NULL) {
+        pooled_buffer_t *buffer = thread_pool->free;
+        thread_pool->free = buffer->next;
+        free(buffer);
+    }
+    thread_pool->n_free = 0;
+}
+
+static void create_pool_key(void) {
+    if (pthread_key_create(&pool_key, destroy_pool)) {
+        perror("pthread_key_create");
+    }
+}
+
+void *buffer_pool_acquire(size_t size) {
+    for (pooled_buffer_t **link = &pool.free; *link != NULL; link = &(*link)->next) {
+        if ((*link)->size == size) {
+            pooled_buffer_t *buffer = *link;
+            *link = buffer->next;
+            pool.n_free--;
+            return buffer;
+        }
+    }
+    void *buffer = malloc(size);
+    if (buffer == NULL) {
+        perror("malloc");
+    }
+    return buffer;
+}
+
+void buffer_pool_release(void *buffer, size_t size) {
+    if (!pool.registered) {
+        // Buffers still pooled when the thread exits are freed by destroy_pool()
+        pthread_once(&pool_key_once, create_pool_key);
+        pool.registered = pthread_setspecific(pool_key, &pool) == 0;
+    }
+    if (pool.n_free == BUFFER_POOL_MAX || !pool.registered) {
+        free(buffer);
+        return;
+    }
+    pooled_buffer_t *pooled = buffer;
+    pooled->size = size;
+    pooled->next = pool.free;
+    pool.free = pooled;
+    pool.n_free++;
+}
+
+/*
+ * Return a block to the pool if it is a standard one, or free it if it was sized for one large
+ * allocation
+ * block: The block to release
+ */
+static void release_block(arena_block_t *block) {
+    if (block->cap == ARENA_BLOCK_SIZE - BLOCK_HEADER_SIZE) {
+        buffer_pool_release(block, ARENA_BLOCK_SIZE);
+    } else {
+        free(block);
+    }
+}
+
+void arena_init(arena_t *arena) {
+    arena->blocks = NULL;
+}
+
+void *arena_alloc(arena_t *arena, size_t size) {
+    size = ROUND_UP(size);
+    arena_block_t *block = arena->blocks;
+    if (block == NULL || block->cap - block->used < size) {
+        if (size > ARENA_BLOCK_SIZE - BLOCK_HEADER_SIZE) {
+            block = malloc(BLOCK_HEADER_SIZE + size);
+            if (block == NULL) {
+                perror("malloc");
+                return NULL;
+            }
+            block->cap = size;
+        } else {
+            block = buffer_pool_acquire(ARENA_BLOCK_SIZE);
+            if (block == NULL) {
+                // error message printed in buffer_pool_acquire()
+                return NULL;
+            }
+            block->cap = ARENA_BLOCK_SIZE - BLOCK_HEADER_SIZE;
+        }
+        block->used = 0;
+        block->next = arena->blocks;
+        arena->blocks = block;
+    }
+
+    void *allocation = (char *) block + BLOCK_HEADER_SIZE + block->used;
+    block->used += size;
+    return allocation;
+}
+
+void arena_reset(arena_t *arena) {
+    arena_block_t *kept = NULL;
+    while (arena->blocks != NULL) {
+        arena_block_t *block = arena->blocks;
+        arena->blocks = block->next;
+        if (kept == NULL && block->cap == ARENA_BLOCK_SIZE - BLOCK_HEADER_SIZE) {
+            kept = block;
+        } else {
+            release_block(block);
+        }
+    }
+    if (kept != NULL) {
+        kept->next = NULL;
+        kept->used = 0;
+    }
+    arena->blocks = kept;
+}
+
+void arena_free(arena_t *arena) {
+    while (arena->blocks != NULL) {
+        arena_block_t *block = arena->blocks;
+        arena->blocks = block->next;
+        release_block(block);
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_BLOCK_SIZE 4096    // bytes per pooled block, header included
+#define BUFFER_POOL_MAX 16       // free buffers each thread keeps for reuse
+
+// A chunk of memory an arena hands out allocations from; the allocations follow the header
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t cap;     // bytes available after the header
+    size_t used;    // bytes already handed out
+} arena_block_t;
+
+// Struct representing a bump allocator for state that lives only as long as one request
+// Allocations are never freed one at a time; resetting the arena frees them all at once.
+// Blocks come from the calling thread's buffer pool, so an arena must only be used by one thread
+// at a time and is only malloc-free once that thread's pool is warm.
+typedef struct {
+    arena_block_t *blocks;    // newest first, or NULL before the first allocation
+} arena_t;
+
+/*
+ * Initialize a new, empty arena without allocating anything
+ * arena: Pointer to arena_t to be initialized
+ */
+void arena_init(arena_t *arena);
+
+/*
+ * Allocate memory that stays valid until the arena is reset or freed
+ * arena: The arena to allocate from
+ * size: The number of bytes, which may exceed a block
+ * Returns memory aligned for any type, or NULL on error
+ */
+void *arena_alloc(arena_t *arena, size_t size);
+
+/*
+ * Free everything allocated from an arena, keeping one block for the next request
+ * arena: The arena to reset
+ */
+void arena_reset(arena_t *arena);
+
+/*
+ * Free everything allocated from an arena and return all of its blocks to the thread's pool
+ * The arena may be used again afterwards, as if newly initialized.
+ * arena: The arena to free
+ */
+void arena_free(arena_t *arena);
+
+/*
+ * Get a buffer from the calling thread's pool, allocating one if none of that size is free
+ * size: The buffer's size in bytes, at least sizeof(void *) * 2
+ * Returns the buffer, which must be passed to buffer_pool_release, or NULL on error
+ */
+void *buffer_pool_acquire(size_t size);
+
+/*
+ * Return a buffer to the calling thread's pool, or free it if the pool is full
+ * buffer: A buffer from buffer_pool_acquire
+ * size: The size it was acquired with
+ */
+void buffer_pool_release(void *buffer, size_t size);
+
+#endif    // ARENA_H
@@ -0,0 +1,256 @@
+#include "config.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "admission.h"
+#include "connection_queue.h"
+#include "fd_cache.h"
+#include "file_cache.h"
+#include "http.h"
+#include "http_connection.h"
+
+/*
+ * Parse a whole string as a decimal integer within a range
+ * value: The string to parse
+ * min: The smallest accepted value
+ * max: The largest accepted value
+ * result: Set to the parsed value on success
+ * Returns 0 on success or -1 if value is not an integer in [min, max]
+ */
+static int parse_long(const char *value, long min, long max, long *result) {
+    char *end;
+    errno = 0;
+    long parsed = strtol(value, &end, 10);
+    if (errno != 0 || end == value || *end != '\0' || parsed < min || parsed > max) {
+        return -1;
+    }
+    *result = parsed;
+    return 0;
+}
+
+/*
+ * Add a Cache-Control max-age rule, or replace the rule for the same MIME pattern
+ * config: The configuration to change
+ * value: "<MIME pattern> <seconds>", such as "text/html 60"
+ * Returns 0 on success or -1 if value is invalid or there are too many rules
+ */
+static int add_max_age_rule(server_config_t *config, const char *value) {
+    const char *space = strpbrk(value, " \t");
+    if (space == NULL || space == value || space - value >= MIME_PATTERN_BUFSIZE) {
+        return -1;
+    }
+    size_t pattern_len = space - value;
+    long max_age;
+    if (parse_long(space + strspn(space, " \t"), 0, INT_MAX, &max_age)) {
+        return -1;
+    }
+
+    int i = 0;
+    while (i < config->n_max_age_rules &&
+           (strlen(config->max_age_rules[i].pattern) != pattern_len ||
+            strncasecmp(config->max_age_rules[i].pattern, value, pattern_len) != 0)) {
+        i++;
+    }
+    if (i == MAX_AGE_RULES) {
+        return -1;
+    } else if (i == config->n_max_age_rules) {
+        config->n_max_age_rules++;
+    }
+    memcpy(config->max_age_rules[i].pattern, value, pattern_len);
+    config->max_age_rules[i].pattern[pattern_len] = '\0';
+    config->max_age_rules[i].max_age = max_age;
+    return 0;
+}
+
+/*
+ * Get the number of CPUs currently online
+ * Returns the count, or 1 if it cannot be determined
+ */
+static int online_cpus(void) {
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_cpus < 1) {
+        return 1;
+    }
+    return n_cpus < INT_MAX ? n_cpus : INT_MAX;
+}
+
+void config_init(server_config_t *config) {
+    config->engine = ENGINE_THREADS;
+    config->scheduler = SCHEDULER_SHARED;
+    config->n_workers = DEFAULT_WORKERS;
+    config->n_acceptors = 1;
+    config->pin_cpus = 0;
+    config->backlog = LISTEN_QUEUE_LEN;
+    config->queue_capacity = CAPACITY;
+    config->shed_queue_depth = 0;
+    config->shed_wait_ms = 0;
+    config->retry_after = DEFAULT_RETRY_AFTER;
+    config->transmit = TRANSMIT_AUTO;
+    config->mmap_threshold = DEFAULT_MMAP_THRESHOLD;
+    config->io_chunk_size = DEFAULT_IO_CHUNK_SIZE;
+    config->cache_bytes = DEFAULT_FILE_CACHE_BYTES;
+    config->gzip_cache_bytes = DEFAULT_GZIP_CACHE_BYTES;
+    config->fd_cache_entries = DEFAULT_FD_CACHE_ENTRIES;
+    config->idle_timeout_ms = DEFAULT_IDLE_TIMEOUT_MS;
+    config->header_timeout_ms = DEFAULT_HEADER_TIMEOUT_MS;
+    config->send_timeout_ms = DEFAULT_SEND_TIMEOUT_MS;
+    config->max_requests = DEFAULT_MAX_REQUESTS;
+    config->n_max_age_rules = 0;
+    config->mime_types[0] = '\0';
+    config->serve_dir[0] = '\0';
+}
+
+int config_set(server_config_t *config, const char *key, const char *value) {
+    long number;
+    if (strcmp(key, "engine") == 0 && strcmp(value, "threads") == 0) {
+        config->engine = ENGINE_THREADS;
+    } else if (strcmp(key, "engine") == 0 && strcmp(value, "epoll") == 0) {
+        config->engine = ENGINE_EPOLL;
+    } else if (strcmp(key, "engine") == 0 && strcmp(value, "uring") == 0) {
+        config->engine = ENGINE_URING;
+    } else if (strcmp(key, "scheduler") == 0 && strcmp(value, "shared") == 0) {
+        config->scheduler = SCHEDULER_SHARED;
+    } else if (strcmp(key, "scheduler") == 0 && strcmp(value, "steal") == 0) {
+        config->scheduler = SCHEDULER_STEAL;
+    } else if (strcmp(key, "workers") == 0 && strcmp(value, "auto") == 0) {
+        config->n_workers = online_cpus();
+    } else if (strcmp(key, "workers") == 0 && parse_long(value, 1, 4096, &number) == 0) {
+        config->n_workers = number;
+    } else if (strcmp(key, "acceptors") == 0 && parse_long(value, 1, 4096, &number) == 0) {
+        config->n_acceptors = number;
+    } else if (strcmp(key, "pin_cpus") == 0 && parse_long(value, 0, 1, &number) == 0) {
+        config->pin_cpus = number;
+    } else if (strcmp(key, "backlog") == 0 && parse_long(value, 1, INT_MAX, &number) == 0) {
+        config->backlog = number;
+    } else if (strcmp(key, "queue_capacity") == 0 &&
+               parse_long(value, 1, 1 << 30, &number) == 0) {
+        config->queue_capacity = number;
+    } else if (strcmp(key, "shed_queue_depth") == 0 &&
+               parse_long(value, 0, 1 << 30, &number) == 0) {
+        config->shed_queue_depth = number;
+    } else if (strcmp(key, "shed_wait_ms") == 0 && parse_long(value, 0, INT_MAX, &number) == 0) {
+        config->shed_wait_ms = number;
+    } else if (strcmp(key, "retry_after") == 0 && parse_long(value, 0, INT_MAX, &number) == 0) {
+        config->retry_after = number;
+    } else if (strcmp(key, "transmit") == 0 && strcmp(value, "buffered") == 0) {
+        config->transmit = TRANSMIT_BUFFERED;
+    } else if (strcmp(key, "transmit") == 0 && strcmp(value, "zero_copy") == 0) {
+        config->transmit = TRANSMIT_ZERO_COPY;
+    } else if (strcmp(key, "transmit") == 0 && strcmp(value, "mmap") == 0) {
+        config->transmit = TRANSMIT_MMAP;
+    } else if (strcmp(key, "transmit") == 0 && strcmp(value, "auto") == 0) {
+        config->transmit = TRANSMIT_AUTO;
+    } else if (strcmp(key, "mmap_threshold") == 0 &&
+               parse_long(value, 0, LONG_MAX, &number) == 0) {
+        config->mmap_threshold = number;
+    } else if (strcmp(key, "io_chunk_size") == 0 &&
+               parse_long(value, 1, MAX_IO_CHUNK_SIZE, &number) == 0) {
+        config->io_chunk_size = number;
+    } else if (strcmp(key, "cache_bytes") == 0 && parse_long(value, 0, LONG_MAX, &number) == 0) {
+        config->cache_bytes = number;
+    } else if (strcmp(key, "gzip_cache_bytes") == 0 &&
+               parse_long(value, 0, LONG_MAX, &number) == 0) {
+        config->gzip_cache_bytes = number;
+    } else if (strcmp(key, "fd_cache_entries") == 0 &&
+               parse_long(value, 0, 1 << 20, &number) == 0) {
+        config->fd_cache_entries = number;
+    } else if (strcmp(key, "idle_timeout_ms") == 0 &&
+               parse_long(value, 0, INT_MAX, &number) == 0) {
+        config->idle_timeout_ms = number;
+    } else if (strcmp(key, "header_timeout_ms") == 0 &&
+               parse_long(value, 0, INT_MAX, &number) == 0) {
+        config->header_timeout_ms = number;
+    } else if (strcmp(key, "send_timeout_ms") == 0 &&
+               parse_long(value, 0, INT_MAX, &number) == 0) {
+        config->send_timeout_ms = number;
+    } else if (strcmp(key, "max_requests") == 0 && parse_long(value, 1, INT_MAX, &number) == 0) {
+        config->max_requests = number;
+    } else if (strcmp(key, "max_age") == 0 && add_max_age_rule(config, value) == 0) {
+    } else if (strcmp(key, "mime_types") == 0 && strlen(value) < sizeof(config->mime_types)) {
+        strcpy(config->mime_types, value);
+    } else if (strcmp(key, "serve_dir") == 0 && strlen(value) < sizeof(config->serve_dir)) {
+        strcpy(config->serve_dir, value);
+    } else {
+        fprintf(stderr, "invalid setting %s = %s\n", key, value);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Strip leading and trailing whitespace from a string in place
+ * Returns a pointer to the first non-space character
+ */
+static char *trim(char *str) {
+    while (isspace((unsigned char) *str)) {
+        str++;
+    }
+    char *end = str + strlen(str);
+    while (end > str && isspace((unsigned char) end[-1])) {
+        end--;
+    }
+    *end = '\0';
+    return str;
+}
+
+int config_load_file(server_config_t *config, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror("fopen");
+        return -1;
+    }
+
+    char line[CONFIG_LINE_BUFSIZE];
+    int line_number = 0;
+    int result = 0;
+    while (result == 0 && fgets(line, sizeof(line), file) != NULL) {
+        line_number++;
+        if (strchr(line, '\n') == NULL && !feof(file)) {
+            fprintf(stderr, "%s:%d: line too long\n", path, line_number);
+            result = -1;
+            break;
+        }
+
+        char *key = trim(line);
+        if (*key == '\0' || *key == '#') {
+            continue;
+        }
+        char *equals = strchr(key, '=');
+        if (equals == NULL) {
+            fprintf(stderr, "%s:%d: expected key = value\n", path, line_number);
+            result = -1;
+            break;
+        }
+        *equals = '\0';
+        if (config_set(config, trim(key), trim(equals + 1))) {
+            fprintf(stderr, "%s:%d: could not apply setting\n", path, line_number);
+            result = -1;
+        }
+    }
+
+    if (result == 0 && ferror(file)) {
+        perror("fgets");
+        result = -1;
+    }
+    if (fclose(file)) {
+        perror("fclose");
+        result = -1;
+    }
+    return result;
+}
+
+int config_validate(const server_config_t *config) {
+    if (config->n_acceptors > config->n_workers) {
+        fprintf(stderr, "acceptors (%d) cannot exceed workers (%d)\n", config->n_acceptors,
+                config->n_workers);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,86 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stddef.h>
+
+#include "http.h"
+
+#define DEFAULT_WORKERS 5
+#define LISTEN_QUEUE_LEN 5    // default listen() backlog of each listening socket
+#define CONFIG_LINE_BUFSIZE 256
+
+// Ways of scheduling client connections onto threads
+typedef enum {
+    ENGINE_THREADS,    // blocking workers fed by a dispatcher_t
+    ENGINE_EPOLL,      // non-blocking event loops, each multiplexing many connections
+    ENGINE_URING,      // completion-driven io_uring loops; epoll where io_uring is unavailable
+} engine_t;
+
+// Ways of handing accepted connections to thread-pool workers
+typedef enum {
+    SCHEDULER_SHARED,    // one connection_queue_t that every worker dequeues from
+    SCHEDULER_STEAL,     // per-worker deques filled round-robin; idle workers steal
+} scheduler_t;
+
+// Settings chosen at startup, from a config file and/or the command line
+// Each field is named by a key usable in both: see config_set()
+typedef struct {
+    engine_t engine;             // "engine": threads, epoll or uring
+    scheduler_t scheduler;       // "scheduler": shared or steal
+    int n_workers;               // "workers": worker threads or event loops, or "auto"
+    int n_acceptors;             // "acceptors": SO_REUSEPORT listening sockets
+    int pin_cpus;                // "pin_cpus": 1 to pin threads to CPUs and steer by CPU, or 0
+    int backlog;                 // "backlog": listen() backlog of each listening socket
+    int queue_capacity;          // "queue_capacity": connections waiting for a worker
+    int shed_queue_depth;        // "shed_queue_depth": waiting connections that trigger 503s
+    int shed_wait_ms;            // "shed_wait_ms": queue wait target that triggers 503s, or 0
+    int retry_after;             // "retry_after": seconds clients are told to wait after a 503
+    transmit_mode_t transmit;    // "transmit": buffered, zero_copy, mmap or auto
+    long mmap_threshold;         // "mmap_threshold": body size from which auto mode uses sendfile
+    size_t io_chunk_size;        // "io_chunk_size": bytes per read when copying a body
+    long cache_bytes;            // "cache_bytes": file cache size, 0 to disable
+    long gzip_cache_bytes;       // "gzip_cache_bytes": compressed variant cache size, 0 to disable
+    int fd_cache_entries;        // "fd_cache_entries": files kept open, 0 to disable
+    int idle_timeout_ms;         // "idle_timeout_ms": keep-alive idle timeout, 0 to disable
+    int header_timeout_ms;       // "header_timeout_ms": time for a request to arrive, 0 for none
+    int send_timeout_ms;         // "send_timeout_ms": time a response may stall, 0 for none
+    int max_requests;            // "max_requests": requests served per connection
+    max_age_rule_t max_age_rules[MAX_AGE_RULES];    // "max_age": "<MIME pattern> <seconds>"
+    int n_max_age_rules;
+    char mime_types[CONFIG_LINE_BUFSIZE];    // "mime_types": mime.types file, "" for built-ins
+    char serve_dir[CONFIG_LINE_BUFSIZE];     // "serve_dir": served directory, "" for the operand
+} server_config_t;
+
+/*
+ * Fill in the default value of every setting
+ * config: Pointer to server_config_t to be initialized
+ */
+void config_init(server_config_t *config);
+
+/*
+ * Set one setting from its textual value
+ * config: The configuration to change
+ * key: The name of the setting
+ * value: The new value; "workers" also accepts "auto", meaning the number of online CPUs, and each
+ *        "max_age" adds a rule, replacing any earlier one for the same pattern
+ * Returns 0 on success or -1 if the key is unknown or the value is invalid
+ */
+int config_set(server_config_t *config, const char *key, const char *value);
+
+/*
+ * Apply every setting in a config file
+ * Each line is "key = value"; blank lines and lines starting with '#' are ignored.
+ * config: The configuration to change
+ * path: The path of the config file
+ * Returns 0 on success or -1 on error, after which config may be partially updated
+ */
+int config_load_file(server_config_t *config, const char *path);
+
+/*
+ * Check the settings against each other once all of them have been applied
+ * config: The configuration to check
+ * Returns 0 if the configuration is usable or -1 if not
+ */
+int config_validate(const server_config_t *config);
+
+#endif    // CONFIG_H
@@ -1,135 +1,209 @@
 #include "connection_queue.h"
 
+#include <limits.h>
 #include <stdio.h>
-#include <string.h>
+#include <stdlib.h>
+
+#include "admission.h"
+#include "futex.h"
+#include "metrics.h"
+
+/*
+ * Bump a futex word and wake one sleeper, if there are any
+ * A failed wake is only reported: the element has already been handed over at this point
+ * word: The futex word
+ * waiters: The number of threads parked, or about to park, on word
+ */
+static void signal_waiter(unsigned *word, int *waiters) {
+    __atomic_add_fetch(word, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiters, __ATOMIC_SEQ_CST) > 0) {
+        futex_wake(word, 1);
+    }
+}
 
-int connection_queue_init(connection_queue_t *queue) {
-    // TODO: Check if malloc needed here
-    queue->read_idx = 0;
-    queue->write_idx = 0;
-    queue->length = 0;
-    queue->shutdown = 0;
+/*
+ * Try to claim a free slot and store a file descriptor in it without blocking
+ * Returns 0 on success or -1 if the queue is full
+ */
+static int try_enqueue(connection_queue_t *queue, int connection_fd) {
+    unsigned long pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+    while (1) {
+        connection_slot_t *slot = &queue->slots[pos & queue->mask];
+        unsigned long sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        long diff = (long) sequence - (long) pos;
+        if (diff == 0) {
+            // Slot is free for this position; claim it by advancing the enqueue position
+            if (__atomic_compare_exchange_n(&queue->enqueue_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                slot->client_fd = connection_fd;
+                slot->enqueued_ns = metrics_now_ns();
+                __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+                return 0;
+            }
+        } else if (diff < 0) {    // slot still holds an fd from one lap ago
+            return -1;
+        } else {    // another producer claimed this position first
+            pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+}
 
-    for (int i = 0; i < CAPACITY; ++i)
-        queue->client_fds[i] = -1;
+/*
+ * Try to claim a filled slot and take the file descriptor out of it without blocking
+ * Returns the file descriptor or -1 if the queue is empty
+ */
+static int try_dequeue(connection_queue_t *queue) {
+    unsigned long pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+    while (1) {
+        connection_slot_t *slot = &queue->slots[pos & queue->mask];
+        unsigned long sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        long diff = (long) sequence - (long) (pos + 1);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&queue->dequeue_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                int connection_fd = slot->client_fd;
+                long long enqueued_ns = slot->enqueued_ns;
+                // Hand the slot back to producers for the next lap around the ring
+                __atomic_store_n(&slot->sequence, pos + queue->mask + 1, __ATOMIC_RELEASE);
+                long long wait_ns = metrics_now_ns() - enqueued_ns;
+                metrics_record(STAGE_QUEUE_WAIT, wait_ns);
+                admission_observe_wait(wait_ns);
+                return connection_fd;
+            }
+        } else if (diff < 0) {    // slot not yet filled for this position
+            return -1;
+        } else {
+            pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+int connection_queue_init(connection_queue_t *queue) {
+    return connection_queue_init_capacity(queue, CAPACITY);
+}
 
-    if (pthread_mutex_init(&queue->lock, NULL)) {
-        perror("pthread_mutex_init");
+int connection_queue_init_capacity(connection_queue_t *queue, int capacity) {
+    if (capacity < 1 || capacity > (1 << 30)) {
+        fprintf(stderr, "invalid connection queue capacity %d\n", capacity);
         return -1;
     }
-    if (pthread_cond_init(&queue->queue_not_full, NULL)) {
-        perror("pthread_cond_init");
-        pthread_mutex_destroy(&queue->lock);
-        return -1;
+    // A one-slot ring cannot tell "filled on this lap" from "free on the next", so use two
+    unsigned long size = 2;
+    while (size < (unsigned long) capacity) {
+        size <<= 1;
     }
-    if (pthread_cond_init(&queue->queue_not_empty, NULL)) {
-        perror("ptread_cond_init");
-        pthread_mutex_destroy(&queue->lock);
-        pthread_cond_destroy(&queue->queue_not_full);
+
+    queue->slots = malloc(size * sizeof(connection_slot_t));
+    if (queue->slots == NULL) {
+        perror("malloc");
         return -1;
     }
+    for (unsigned long i = 0; i < size; ++i) {
+        queue->slots[i].sequence = i;
+        queue->slots[i].client_fd = -1;
+    }
+    queue->mask = size - 1;
+    queue->enqueue_pos = 0;
+    queue->dequeue_pos = 0;
+    queue->not_empty = 0;
+    queue->empty_waiters = 0;
+    queue->not_full = 0;
+    queue->full_waiters = 0;
+    queue->shutdown = 0;
 
     return 0;
 }
 
 int connection_queue_enqueue(connection_queue_t *queue, int connection_fd) {
-    // TODO Implement Shutdown
-    if (pthread_mutex_lock(&queue->lock)) {
-        perror("pthread_mutex_lock");
-        return -1;
-    }
-
-    while (queue->length == CAPACITY && !queue->shutdown) {
-        if (pthread_cond_wait(&queue->queue_not_full, &queue->lock)) {
-            perror("pthread_cond_wait");
-            pthread_mutex_unlock(&queue->lock);
+    while (1) {
+        if (__atomic_load_n(&queue->shutdown, __ATOMIC_ACQUIRE)) {
             return -1;
         }
-    }
+        if (try_enqueue(queue, connection_fd) == 0) {
+            signal_waiter(&queue->not_empty, &queue->empty_waiters);
+            return 0;
+        }
 
-    if (queue->shutdown) {
-        if (pthread_mutex_unlock(&queue->lock)) {
-            perror("pthread_mutex_unlock");
+        // Queue is full: register as a waiter, then re-check before parking so a dequeue that
+        // happened in between cannot be missed
+        unsigned seen = __atomic_load_n(&queue->not_full, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&queue->full_waiters, 1, __ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&queue->shutdown, __ATOMIC_SEQ_CST) &&
+            try_enqueue(queue, connection_fd) == 0) {
+            __atomic_sub_fetch(&queue->full_waiters, 1, __ATOMIC_SEQ_CST);
+            signal_waiter(&queue->not_empty, &queue->empty_waiters);
+            return 0;
+        }
+        int result = 0;
+        if (!__atomic_load_n(&queue->shutdown, __ATOMIC_SEQ_CST)) {
+            result = futex_wait(&queue->not_full, seen);
+        }
+        __atomic_sub_fetch(&queue->full_waiters, 1, __ATOMIC_SEQ_CST);
+        if (result) {
+            return -1;
         }
-        return -1;
     }
+}
 
-    queue->client_fds[queue->write_idx] = connection_fd;
-    queue->write_idx = (queue->write_idx + 1) % CAPACITY;
-    queue->length++;
-
-    if (pthread_cond_signal(&queue->queue_not_empty)) {
-        perror("pthread_cond_signal");
-        pthread_mutex_unlock(&queue->lock);
+int connection_queue_try_enqueue(connection_queue_t *queue, int connection_fd) {
+    if (__atomic_load_n(&queue->shutdown, __ATOMIC_ACQUIRE)) {
         return -1;
     }
-    if (pthread_mutex_unlock(&queue->lock)) {
-        perror("pthread_mutex_unlock");
-        return -1;
+    if (try_enqueue(queue, connection_fd)) {
+        return 1;
     }
-
+    signal_waiter(&queue->not_empty, &queue->empty_waiters);
     return 0;
 }
 
 int connection_queue_dequeue(connection_queue_t *queue) {
-    // TODO: Implement shutdown
-    if (pthread_mutex_lock(&queue->lock)) {
-        perror("pthread_mutex_lock");
-        return -1;
-    }
-
-    while (queue->length == 0 && !queue->shutdown) {
-        if (pthread_cond_wait(&queue->queue_not_empty, &queue->lock)) {
-            perror("pthread_cond_wait");
-            pthread_mutex_unlock(&queue->lock);
+    while (1) {
+        if (__atomic_load_n(&queue->shutdown, __ATOMIC_ACQUIRE)) {
             return -1;
         }
-    }
-
-    if (queue->shutdown) {
-        if (pthread_mutex_unlock(&queue->lock)) {
-            perror("pthread_mutex_unlock");
+        int connection_fd = try_dequeue(queue);
+        if (connection_fd != -1) {
+            signal_waiter(&queue->not_full, &queue->full_waiters);
+            return connection_fd;
         }
-        return -1;
-    }
 
-    int retval = queue->client_fds[queue->read_idx];
-    queue->length--;
-    queue->read_idx = (queue->read_idx + 1) % CAPACITY;
-
-    if (pthread_cond_signal(&queue->queue_not_full)) {
-        perror("pthread_cond_signal");
-        pthread_mutex_unlock(&queue->lock);
-        return -1;
-    }
-    if (pthread_mutex_unlock(&queue->lock)) {
-        perror("pthread_mutex_unlock");
-        return -1;
+        // Queue is empty: same register, re-check, park sequence as enqueue
+        unsigned seen = __atomic_load_n(&queue->not_empty, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&queue->empty_waiters, 1, __ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&queue->shutdown, __ATOMIC_SEQ_CST) &&
+            (connection_fd = try_dequeue(queue)) != -1) {
+            __atomic_sub_fetch(&queue->empty_waiters, 1, __ATOMIC_SEQ_CST);
+            signal_waiter(&queue->not_full, &queue->full_waiters);
+            return connection_fd;
+        }
+        int result = 0;
+        if (!__atomic_load_n(&queue->shutdown, __ATOMIC_SEQ_CST)) {
+            result = futex_wait(&queue->not_empty, seen);
+        }
+        __atomic_sub_fetch(&queue->empty_waiters, 1, __ATOMIC_SEQ_CST);
+        if (result) {
+            return -1;
+        }
     }
+}
 
-    return retval;
+long connection_queue_depth(connection_queue_t *queue) {
+    unsigned long dequeue_pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+    unsigned long enqueue_pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+    // The positions are read at different moments, so the difference can briefly be negative
+    long depth = (long) (enqueue_pos - dequeue_pos);
+    return depth > 0 ? depth : 0;
 }
 
 int connection_queue_shutdown(connection_queue_t *queue) {
-    // TODO Not yet implemented
-    if (pthread_mutex_lock(&queue->lock)) {
-        perror("pthread_mutex_lock");
-        return -1;
-    }
-    queue->shutdown = 1;
-    // send both signals to wake up all blocked threads
-    if (pthread_cond_broadcast(&queue->queue_not_full)) {
-        perror("pthread_cond_broadcast");
-        pthread_mutex_unlock(&queue->lock);
-        return -1;
-    }
-    if (pthread_cond_broadcast(&queue->queue_not_empty)) {
-        perror("pthread_cond_broadcast");
-        pthread_mutex_unlock(&queue->lock);
+    __atomic_store_n(&queue->shutdown, 1, __ATOMIC_SEQ_CST);
+    // bump both futex words and wake everyone so all blocked threads see the shutdown
+    __atomic_add_fetch(&queue->not_full, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&queue->not_empty, 1, __ATOMIC_SEQ_CST);
+    if (futex_wake(&queue->not_full, INT_MAX)) {
         return -1;
     }
-    if (pthread_mutex_unlock(&queue->lock)) {
-        perror("pthread_mutex_unlock");
+    if (futex_wake(&queue->not_empty, INT_MAX)) {
         return -1;
     }
 
@@ -137,22 +211,8 @@ int connection_queue_shutdown(connection_queue_t *queue) {
 }
 
 int connection_queue_free(connection_queue_t *queue) {
-    // TODO Not yet implemented
-    if (pthread_mutex_destroy(&queue->lock)) {
-        perror("pthread_mutex_destroy");
-        pthread_cond_destroy(&queue->queue_not_empty);
-        pthread_cond_destroy(&queue->queue_not_full);
-        return -1;
-    }
-    if (pthread_cond_destroy(&queue->queue_not_empty)) {
-        perror("pthread_cond_destroy");
-        pthread_cond_destroy(&queue->queue_not_full);
-        return -1;
-    }
-    if (pthread_cond_destroy(&queue->queue_not_full)) {
-        perror("pthread_mutex_destroy");
-        return -1;
-    }
+    free(queue->slots);
+    queue->slots = NULL;
 
     return 0;
 }
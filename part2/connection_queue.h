@@ -1,24 +1,35 @@
 #ifndef CONNECTION_QUEUE_H
 #define CONNECTION_QUEUE_H
 
-#include <pthread.h>
+#define CAPACITY 8    // default; capacities are always rounded up to a power of two
 
-#define CAPACITY 5
+#define CACHE_LINE_SIZE 64
+
+// One cell of the ring; its sequence number says whether it is ready to be written or read
+typedef struct {
+    unsigned long sequence;
+    int client_fd;
+    long long enqueued_ns;    // when client_fd was added, to measure its wait for a worker
+} connection_slot_t;
 
 // Struct representing a thread-safe queue data structure
 // The queue stores file descriptors of active client TCP sockets
+// It is a lock-free bounded MPMC ring: producers and consumers claim slots by advancing their
+// position with compare-and-swap, and only park on a futex when the ring is full or empty
 typedef struct {
-    int client_fds[CAPACITY];
-    int length;
-    int read_idx;
-    int write_idx;
-    int shutdown;
-    // TODO Add necessary thread synchronization primitives to this struct
+    connection_slot_t *slots;
+    unsigned long mask;    // capacity - 1
 
-    pthread_mutex_t lock;
-    pthread_cond_t queue_not_full;
-    pthread_cond_t queue_not_empty;
-    pthread_cond_t queue_shutdown;
+    // Producer and consumer positions live on separate cache lines to avoid false sharing
+    unsigned long enqueue_pos __attribute__((aligned(CACHE_LINE_SIZE)));
+    unsigned long dequeue_pos __attribute__((aligned(CACHE_LINE_SIZE)));
+
+    // Futex words, bumped on every enqueue/dequeue, that parked threads sleep on
+    unsigned not_empty __attribute__((aligned(CACHE_LINE_SIZE)));
+    int empty_waiters;
+    unsigned not_full;
+    int full_waiters;
+    int shutdown;
 } connection_queue_t;
 
 /*
@@ -29,6 +40,14 @@ typedef struct {
  */
 int connection_queue_init(connection_queue_t *queue);
 
+/*
+ * Initialize a new connection queue with a given capacity.
+ * queue: Pointer to connection_queue_t to be initialized
+ * capacity: The number of elements the queue can store, rounded up to a power of two
+ * Returns 0 on success or -1 on error
+ */
+int connection_queue_init_capacity(connection_queue_t *queue, int capacity);
+
 /*
  * Add a new file descriptor to a connection queue. If the queue is full, then
  * this function blocks until space becomes available. If the queue is shut
@@ -39,6 +58,14 @@ int connection_queue_init(connection_queue_t *queue);
  */
 int connection_queue_enqueue(connection_queue_t *queue, int connection_fd);
 
+/*
+ * Add a new file descriptor to a connection queue without blocking
+ * queue: A pointer to the connection_queue_t to add to
+ * connection_fd: The socket file descriptor to add to the queue
+ * Returns 0 on success, 1 if the queue is full, or -1 if it is shut down
+ */
+int connection_queue_try_enqueue(connection_queue_t *queue, int connection_fd);
+
 /*
  * Remove a file descriptor from the connection queue. If the queue is empty,
  * then this function blocks until an item becomes available. If the queue is
@@ -49,6 +76,14 @@ int connection_queue_enqueue(connection_queue_t *queue, int connection_fd);
  */
 int connection_queue_dequeue(connection_queue_t *queue);
 
+/*
+ * Get the number of file descriptors currently waiting in the queue
+ * The value is a snapshot that may already be out of date when it is returned.
+ * queue: A pointer to the connection_queue_t to inspect
+ * Returns the number of queued file descriptors
+ */
+long connection_queue_depth(connection_queue_t *queue);
+
 /*
  * Cleanly shuts down the connection queue. All threads currently blocked on an
  * enqueue or dequeue operation are unblocked and an error is returned to them.
@@ -0,0 +1,390 @@
+#define _GNU_SOURCE
+
+#include "event_engine.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "affinity.h"
+#include "http_connection.h"
+#include "metrics.h"
+#include "timer_wheel.h"
+
+#define MAX_EVENTS 64
+
+// A connection owned by one event loop, linked into that loop's list of live connections
+typedef struct loop_connection {
+    http_connection_t conn;
+    wheel_timer_t timer;    // fires at conn.deadline
+    struct loop_connection *prev;
+    struct loop_connection *next;
+} loop_connection_t;
+
+// State private to a single event loop thread
+typedef struct {
+    event_engine_t *engine;
+    int listen_fd;    // this loop's listening socket
+    int epoll_fd;
+    loop_connection_t *connections;
+    timer_wheel_t wheel;    // deadlines of the connections
+    int draining;           // whether the loop has stopped accepting to let connections finish
+} event_loop_t;
+
+/*
+ * Read the monotonic clock
+ * Returns the current time in milliseconds
+ */
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Unlink a connection from its loop, close it and free it
+ * loop: The event loop that owns the connection
+ * lc: The connection to destroy
+ */
+static void destroy_connection(event_loop_t *loop, loop_connection_t *lc) {
+    if (lc->prev != NULL) {
+        lc->prev->next = lc->next;
+    } else {
+        loop->connections = lc->next;
+    }
+    if (lc->next != NULL) {
+        lc->next->prev = lc->prev;
+    }
+    timer_wheel_cancel(&loop->wheel, &lc->timer);
+    // Closing the socket also removes it from the epoll set
+    http_connection_close(&lc->conn);
+    free(lc);
+}
+
+/*
+ * Advance a connection and update its epoll registration and timer to match what it is waiting
+ * on
+ * loop: The event loop that owns the connection
+ * lc: The connection to advance
+ */
+static void service_connection(event_loop_t *loop, loop_connection_t *lc) {
+    conn_status_t status = http_connection_advance(&lc->conn);
+    if (status == CONN_DONE || status == CONN_ERROR) {
+        destroy_connection(loop, lc);
+        return;
+    }
+
+    struct epoll_event event;
+    event.events = status == CONN_WANT_READ ? EPOLLIN : EPOLLOUT;
+    event.data.ptr = lc;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, lc->conn.fd, &event) == -1) {
+        perror("epoll_ctl");
+        destroy_connection(loop, lc);
+        return;
+    }
+
+    if (lc->conn.deadline.phase == TIMEOUT_NONE) {
+        timer_wheel_cancel(&loop->wheel, &lc->timer);
+    } else {
+        // Rounded up to whole milliseconds, so the timer never fires before the deadline
+        timer_wheel_schedule(&loop->wheel, &lc->timer,
+                             (lc->conn.deadline.deadline_ns + 999999) / 1000000);
+    }
+}
+
+/*
+ * Accept every pending client on the listening socket and register it with this loop
+ * loop: The event loop that will own the new connections
+ */
+static void accept_connections(event_loop_t *loop) {
+    while (1) {
+        int client_fd =
+            accept4(loop->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept");
+            }
+            return;
+        }
+
+        metrics_add(COUNTER_ACCEPTED, 1);
+
+        loop_connection_t *lc = malloc(sizeof(loop_connection_t));
+        if (lc == NULL) {
+            perror("malloc");
+            close(client_fd);
+            continue;
+        }
+        http_connection_init(&lc->conn, client_fd, loop->engine->paths,
+                             &loop->engine->draining);
+        wheel_timer_init(&lc->timer);
+        lc->prev = NULL;
+        lc->next = loop->connections;
+        if (loop->connections != NULL) {
+            loop->connections->prev = lc;
+        }
+        loop->connections = lc;
+
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = lc;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client_fd, &event) == -1) {
+            perror("epoll_ctl");
+            destroy_connection(loop, lc);
+            continue;
+        }
+
+        // The request has usually arrived along with the handshake, so try serving it now
+        service_connection(loop, lc);
+    }
+}
+
+/*
+ * Close every connection whose deadline has passed
+ * Costs nothing for connections that are not due, however many the loop owns.
+ * loop: The event loop whose timers should be advanced
+ */
+static void expire_connections(event_loop_t *loop) {
+    wheel_timer_t *timer = timer_wheel_advance(&loop->wheel, now_ms());
+    while (timer != NULL) {
+        wheel_timer_t *next = timer->next;
+        loop_connection_t *lc =
+            (loop_connection_t *) ((char *) timer - offsetof(loop_connection_t, timer));
+        http_connection_count_timeout(&lc->conn.deadline);
+        destroy_connection(loop, lc);
+        timer = next;
+    }
+}
+
+/*
+ * Stop accepting and close the connections waiting for another request, leaving the loop to
+ * exit once the rest have finished
+ * loop: The event loop to drain
+ */
+static void start_drain(event_loop_t *loop) {
+    loop->draining = 1;
+    // The wake eventfd stays readable, so it has to leave the epoll set along with the socket
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, loop->listen_fd, NULL) == -1 ||
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, loop->engine->wake_fd, NULL) == -1) {
+        perror("epoll_ctl");
+    }
+    loop_connection_t *lc = loop->connections;
+    while (lc != NULL) {
+        loop_connection_t *next = lc->next;
+        if (lc->conn.deadline.phase == TIMEOUT_IDLE) {
+            destroy_connection(loop, lc);
+        }
+        lc = next;
+    }
+}
+
+/*
+ * @brief Event loop thread function
+ *
+ * @details Waits on its own epoll set for the listening socket, its connections and the
+ * engine's wake eventfd, advancing each ready connection until the engine is stopped, or until
+ * the last connection finishes if it is draining. Sleeps no longer than the timer wheel allows,
+ * so connections are closed when their deadline passes.
+ *
+ * @param arg should be an event_loop_t pointer owned by this thread
+ */
+static void *event_loop_thread(void *arg) {
+    event_loop_t *loop = (event_loop_t *) arg;
+    struct epoll_event events[MAX_EVENTS];
+    int keep_going = 1;
+    int drain = 0;
+    timer_wheel_init(&loop->wheel, now_ms());
+
+    while (keep_going && !(loop->draining && loop->connections == NULL)) {
+        int n_events =
+            epoll_wait(loop->epoll_fd, events, MAX_EVENTS, timer_wheel_timeout(&loop->wheel));
+        if (n_events == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+        // Without timers the wheel may have slept for ages; catch it up (which is O(1) while it
+        // is empty) before scheduling anything on it
+        if (loop->wheel.n_timers == 0) {
+            timer_wheel_advance(&loop->wheel, now_ms());
+        }
+
+        for (int i = 0; i < n_events; i++) {
+            if (events[i].data.ptr == &loop->listen_fd) {
+                accept_connections(loop);
+            } else if (events[i].data.ptr == &loop->engine->wake_fd) {
+                if (__atomic_load_n(&loop->engine->draining, __ATOMIC_RELAXED)) {
+                    drain = 1;
+                } else {
+                    keep_going = 0;
+                }
+            } else {
+                service_connection(loop, events[i].data.ptr);
+            }
+        }
+
+        // Drained and expired only now, since a connection closed earlier could still have an
+        // event above
+        if (drain) {
+            start_drain(loop);
+            drain = 0;
+        }
+        expire_connections(loop);
+    }
+
+    while (loop->connections != NULL) {
+        destroy_connection(loop, loop->connections);
+    }
+    close(loop->epoll_fd);
+    free(loop);
+    return NULL;
+}
+
+/*
+ * Create the epoll set for one event loop and register its listening socket and the wake eventfd
+ * engine: The engine the loop belongs to
+ * listen_fd: The listening socket the loop accepts from
+ * Returns a new event_loop_t on success or NULL on error
+ */
+static event_loop_t *create_event_loop(event_engine_t *engine, int listen_fd) {
+    event_loop_t *loop = malloc(sizeof(event_loop_t));
+    if (loop == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    loop->engine = engine;
+    loop->listen_fd = listen_fd;
+    loop->connections = NULL;
+    loop->draining = 0;
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd == -1) {
+        perror("epoll_create1");
+        free(loop);
+        return NULL;
+    }
+
+    // EPOLLEXCLUSIVE keeps a single new client from waking every loop sharing the socket
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    event.data.ptr = &loop->listen_fd;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) == -1) {
+        perror("epoll_ctl");
+        close(loop->epoll_fd);
+        free(loop);
+        return NULL;
+    }
+    // The wake eventfd is never read, so once written it wakes every loop
+    event.events = EPOLLIN;
+    event.data.ptr = &engine->wake_fd;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, engine->wake_fd, &event) == -1) {
+        perror("epoll_ctl");
+        close(loop->epoll_fd);
+        free(loop);
+        return NULL;
+    }
+
+    return loop;
+}
+
+/*
+ * Wake every event loop thread and join the first n of them
+ * engine: The engine whose threads should exit
+ * n: The number of threads that were successfully created
+ * Returns 0 on success or -1 on error
+ */
+static int join_event_loops(event_engine_t *engine, int n) {
+    int result = 0;
+    uint64_t one = 1;
+    if (write(engine->wake_fd, &one, sizeof(one)) == -1) {
+        perror("write");
+        result = -1;
+    }
+    for (int i = 0; i < n; i++) {
+        int ret_val = pthread_join(engine->threads[i], NULL);
+        if (ret_val != 0) {
+            fprintf(stderr, "pthread_join failed: %s\n", strerror(ret_val));
+            result = -1;
+        }
+    }
+    return result;
+}
+
+int event_engine_start(event_engine_t *engine, const int *listen_fds, int n_listeners,
+                       path_cache_t *paths, int n_loops) {
+    if (n_listeners < 1 || n_listeners > n_loops) {
+        fprintf(stderr, "invalid number of listening sockets %d\n", n_listeners);
+        return -1;
+    }
+    engine->listen_fds = listen_fds;
+    engine->n_listeners = n_listeners;
+    engine->paths = paths;
+    engine->n_loops = n_loops;
+    engine->draining = 0;
+
+    for (int i = 0; i < n_listeners; i++) {
+        int flags = fcntl(listen_fds[i], F_GETFL);
+        if (flags == -1 || fcntl(listen_fds[i], F_SETFL, flags | O_NONBLOCK) == -1) {
+            perror("fcntl");
+            return -1;
+        }
+    }
+
+    engine->wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (engine->wake_fd == -1) {
+        perror("eventfd");
+        return -1;
+    }
+    engine->threads = malloc(n_loops * sizeof(pthread_t));
+    if (engine->threads == NULL) {
+        perror("malloc");
+        close(engine->wake_fd);
+        return -1;
+    }
+
+    for (int i = 0; i < n_loops; i++) {
+        event_loop_t *loop = create_event_loop(engine, listen_fds[i % n_listeners]);
+        if (loop == NULL) {
+            join_event_loops(engine, i);
+            free(engine->threads);
+            close(engine->wake_fd);
+            return -1;
+        }
+        int ret_val = affinity_thread_create(&engine->threads[i], i, event_loop_thread, loop);
+        if (ret_val != 0) {
+            fprintf(stderr, "error creating event loop number %d: %s\n", i, strerror(ret_val));
+            close(loop->epoll_fd);
+            free(loop);
+            join_event_loops(engine, i);
+            free(engine->threads);
+            close(engine->wake_fd);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int event_engine_stop(event_engine_t *engine, int drain) {
+    // Connections read the flag as they finish requests, so it is set before the loops wake
+    __atomic_store_n(&engine->draining, drain, __ATOMIC_RELAXED);
+    int result = join_event_loops(engine, engine->n_loops);
+    free(engine->threads);
+    if (close(engine->wake_fd) == -1) {
+        perror("close");
+        result = -1;
+    }
+    return result;
+}
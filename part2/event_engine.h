@@ -0,0 +1,44 @@
+#ifndef EVENT_ENGINE_H
+#define EVENT_ENGINE_H
+
+#include <pthread.h>
+
+#include "path_cache.h"
+
+// Struct representing a set of threads that each multiplex many connections with epoll
+// Loops accept from the non-blocking listening sockets themselves; loop i uses socket
+// i % n_listeners, so with one SO_REUSEPORT socket per loop no two loops share an accept queue
+typedef struct {
+    const int *listen_fds;
+    int n_listeners;
+    int wake_fd;     // eventfd that becomes readable when the engine is stopping
+    int draining;    // whether stopping loops let their connections finish first
+    path_cache_t *paths;
+    int n_loops;
+    pthread_t *threads;
+} event_engine_t;
+
+/*
+ * Start the event loop threads of an engine
+ * The listening sockets are switched to non-blocking mode.
+ * engine: Pointer to event_engine_t to be started
+ * listen_fds: The listening TCP sockets to accept clients from; must outlive the engine
+ * n_listeners: The number of listening sockets, at most n_loops
+ * paths: The cache of paths resolved beneath the served directory
+ * n_loops: The number of event loop threads to run
+ * Returns 0 on success or -1 on error
+ */
+int event_engine_start(event_engine_t *engine, const int *listen_fds, int n_listeners,
+                       path_cache_t *paths, int n_loops);
+
+/*
+ * Stop all event loop threads and free the engine
+ * Does not close the listening sockets.
+ * engine: A pointer to the event_engine_t to stop
+ * drain: 0 to close every connection at once, or 1 to stop accepting, close idle connections
+ *        and wait for the others to finish their requests (see http_connection_draining)
+ * Returns 0 on success or -1 on error
+ */
+int event_engine_stop(event_engine_t *engine, int drain);
+
+#endif    // EVENT_ENGINE_H
@@ -0,0 +1,505 @@
+#include "fd_cache.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Changes to a directory entry that can make a cached descriptor or its metadata stale
+#define WATCH_MASK                                                                             \
+    (IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE | IN_DELETE_SELF |       \
+     IN_MOVE_SELF | IN_ONLYDIR)
+#define EVENT_BUFSIZE 4096
+
+/*
+ * Hash a path with 32-bit FNV-1a
+ * path: The NUL-terminated path to hash
+ * Returns the hash value
+ */
+static unsigned hash_path(const char *path) {
+    unsigned hash = 2166136261u;
+    for (const unsigned char *c = (const unsigned char *) path; *c != '\0'; c++) {
+        hash ^= *c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static fd_cache_shard_t *shard_for(fd_cache_t *cache, unsigned hash) {
+    return &cache->shards[hash % FD_CACHE_SHARDS];
+}
+
+static fd_cache_entry_t **bucket_for(fd_cache_shard_t *shard, unsigned hash) {
+    return &shard->buckets[(hash / FD_CACHE_SHARDS) % FD_CACHE_BUCKETS];
+}
+
+static void destroy_entry(fd_cache_entry_t *entry) {
+    if (entry->map != NULL && munmap(entry->map, entry->stat_buf.st_size) == -1) {
+        perror("munmap");
+    }
+    if (entry->fd != -1 && close(entry->fd) == -1) {
+        perror("close");
+    }
+    free(entry->path);
+    free(entry->header);
+    free(entry);
+}
+
+/*
+ * Unlink an entry from its shard's hash chain and LRU list and drop the cache's reference
+ * Must be called with the shard locked.
+ */
+static void remove_entry(fd_cache_shard_t *shard, fd_cache_entry_t *entry) {
+    fd_cache_entry_t **link = bucket_for(shard, entry->hash);
+    while (*link != entry) {
+        link = &(*link)->hash_next;
+    }
+    *link = entry->hash_next;
+
+    if (entry->lru_prev != NULL) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        shard->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next != NULL) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        shard->lru_tail = entry->lru_prev;
+    }
+
+    shard->n_entries--;
+    fd_cache_release(entry);
+}
+
+/*
+ * Move an entry to the most recently used end of its shard's LRU list
+ * Must be called with the shard locked.
+ */
+static void touch_entry(fd_cache_shard_t *shard, fd_cache_entry_t *entry) {
+    if (shard->lru_head == entry) {
+        return;
+    }
+    entry->lru_prev->lru_next = entry->lru_next;
+    if (entry->lru_next != NULL) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        shard->lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = NULL;
+    entry->lru_next = shard->lru_head;
+    shard->lru_head->lru_prev = entry;
+    shard->lru_head = entry;
+}
+
+/*
+ * Find an entry by path in a shard
+ * Must be called with the shard locked.
+ * Returns the entry or NULL if the path is not cached
+ */
+static fd_cache_entry_t *find_entry(fd_cache_shard_t *shard, const char *path, unsigned hash) {
+    for (fd_cache_entry_t *entry = *bucket_for(shard, hash); entry != NULL;
+         entry = entry->hash_next) {
+        if (entry->hash == hash && strcmp(entry->path, path) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Drop the entry for a path, if it is cached
+ * cache: The cache to remove the entry from
+ * path: The path whose file changed
+ */
+static void invalidate_path(fd_cache_t *cache, const char *path) {
+    unsigned hash = hash_path(path);
+    fd_cache_shard_t *shard = shard_for(cache, hash);
+    if (pthread_mutex_lock(&shard->lock)) {
+        perror("pthread_mutex_lock");
+        return;
+    }
+    fd_cache_entry_t *entry = find_entry(shard, path, hash);
+    if (entry != NULL) {
+        remove_entry(shard, entry);
+    }
+    if (pthread_mutex_unlock(&shard->lock)) {
+        perror("pthread_mutex_unlock");
+    }
+}
+
+/*
+ * Drop every entry, for when inotify can no longer say which files changed
+ * cache: The cache to empty
+ */
+static void invalidate_all(fd_cache_t *cache) {
+    for (int i = 0; i < FD_CACHE_SHARDS; i++) {
+        fd_cache_shard_t *shard = &cache->shards[i];
+        if (pthread_mutex_lock(&shard->lock)) {
+            perror("pthread_mutex_lock");
+            continue;
+        }
+        while (shard->lru_head != NULL) {
+            remove_entry(shard, shard->lru_head);
+        }
+        if (pthread_mutex_unlock(&shard->lock)) {
+            perror("pthread_mutex_unlock");
+        }
+    }
+}
+
+/*
+ * Forget every prefix of a directory whose watch is gone or no longer names the same directory
+ * Must be called with watches_lock held.
+ */
+static void forget_watch(fd_cache_t *cache, int wd) {
+    fd_cache_watch_t **link = &cache->watches;
+    while (*link != NULL) {
+        fd_cache_watch_t *watch = *link;
+        if (watch->wd == wd) {
+            *link = watch->next;
+            free(watch->prefix);
+            free(watch);
+        } else {
+            link = &watch->next;
+        }
+    }
+}
+
+/*
+ * Invalidate whatever cached entries an inotify event concerns
+ * cache: The cache the event was reported to
+ * event: The event
+ */
+static void handle_event(fd_cache_t *cache, const struct inotify_event *event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        invalidate_all(cache);
+        return;
+    }
+
+    if (pthread_mutex_lock(&cache->watches_lock)) {
+        perror("pthread_mutex_lock");
+        return;
+    }
+    if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+        // The directory itself went away; its old paths may now name different files
+        if (event->mask & IN_MOVE_SELF) {
+            inotify_rm_watch(cache->inotify_fd, event->wd);
+        }
+        forget_watch(cache, event->wd);
+        invalidate_all(cache);
+    } else if (event->len > 0) {
+        for (fd_cache_watch_t *watch = cache->watches; watch != NULL; watch = watch->next) {
+            char path[PATH_MAX];
+            if (watch->wd == event->wd &&
+                snprintf(path, sizeof(path), "%s%s", watch->prefix, event->name) <
+                    (int) sizeof(path)) {
+                invalidate_path(cache, path);
+            }
+        }
+    }
+    if (pthread_mutex_unlock(&cache->watches_lock)) {
+        perror("pthread_mutex_unlock");
+    }
+}
+
+/*
+ * @brief Watcher thread function
+ *
+ * @details Reads inotify events for the watched directories and invalidates the entries of
+ * changed files until the cache's wake eventfd becomes readable.
+ *
+ * @param arg should be the fd_cache_t pointer
+ */
+static void *watcher_thread(void *arg) {
+    fd_cache_t *cache = (fd_cache_t *) arg;
+    char buffer[EVENT_BUFSIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd fds[2] = {
+        {.fd = cache->inotify_fd, .events = POLLIN},
+        {.fd = cache->wake_fd, .events = POLLIN},
+    };
+
+    while (1) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+        if (fds[1].revents != 0) {
+            break;
+        }
+
+        ssize_t len = read(cache->inotify_fd, buffer, sizeof(buffer));
+        if (len == -1) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            perror("read");
+            break;
+        }
+        for (char *next = buffer; next < buffer + len;) {
+            const struct inotify_event *event = (const struct inotify_event *) next;
+            handle_event(cache, event);
+            next += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Make sure the directory holding a path is watched
+ * cache: The cache the path is about to be inserted into
+ * path: The path of the file
+ * Returns 0 on success or -1 on error
+ */
+static int watch_directory(fd_cache_t *cache, const char *path) {
+    const char *slash = strrchr(path, '/');
+    size_t prefix_len = slash != NULL ? slash + 1 - path : 0;
+
+    if (pthread_mutex_lock(&cache->watches_lock)) {
+        perror("pthread_mutex_lock");
+        return -1;
+    }
+    int result = 0;
+    fd_cache_watch_t *watch = cache->watches;
+    while (watch != NULL &&
+           (strlen(watch->prefix) != prefix_len || strncmp(watch->prefix, path, prefix_len) != 0)) {
+        watch = watch->next;
+    }
+    if (watch == NULL) {
+        watch = malloc(sizeof(fd_cache_watch_t));
+        char *prefix = strndup(path, prefix_len);
+        if (watch == NULL || prefix == NULL) {
+            perror("malloc");
+            free(watch);
+            free(prefix);
+            result = -1;
+        } else {
+            watch->prefix = prefix;
+            watch->wd = inotify_add_watch(cache->inotify_fd, prefix_len > 0 ? prefix : ".",
+                                          WATCH_MASK);
+            if (watch->wd == -1) {
+                perror("inotify_add_watch");
+                free(prefix);
+                free(watch);
+                result = -1;
+            } else {
+                watch->next = cache->watches;
+                cache->watches = watch;
+            }
+        }
+    }
+    if (pthread_mutex_unlock(&cache->watches_lock)) {
+        perror("pthread_mutex_unlock");
+    }
+    return result;
+}
+
+int fd_cache_init(fd_cache_t *cache, size_t capacity) {
+    cache->shard_capacity = capacity / FD_CACHE_SHARDS > 0 ? capacity / FD_CACHE_SHARDS : 1;
+    cache->watches = NULL;
+
+    for (int i = 0; i < FD_CACHE_SHARDS; i++) {
+        fd_cache_shard_t *shard = &cache->shards[i];
+        if (pthread_mutex_init(&shard->lock, NULL)) {
+            perror("pthread_mutex_init");
+            for (int j = 0; j < i; j++) {
+                pthread_mutex_destroy(&cache->shards[j].lock);
+            }
+            return -1;
+        }
+        memset(shard->buckets, 0, sizeof(shard->buckets));
+        shard->lru_head = NULL;
+        shard->lru_tail = NULL;
+        shard->n_entries = 0;
+    }
+
+    cache->inotify_fd = inotify_init1(IN_CLOEXEC);
+    cache->wake_fd = eventfd(0, EFD_CLOEXEC);
+    int ret_val = 0;
+    if (cache->inotify_fd == -1 || cache->wake_fd == -1 ||
+        pthread_mutex_init(&cache->watches_lock, NULL) ||
+        (ret_val = pthread_create(&cache->watcher, NULL, watcher_thread, cache)) != 0) {
+        if (ret_val != 0) {
+            fprintf(stderr, "error creating fd cache watcher: %s\n", strerror(ret_val));
+            pthread_mutex_destroy(&cache->watches_lock);
+        } else {
+            perror("fd_cache_init");
+        }
+        if (cache->inotify_fd != -1) {
+            close(cache->inotify_fd);
+        }
+        if (cache->wake_fd != -1) {
+            close(cache->wake_fd);
+        }
+        for (int i = 0; i < FD_CACHE_SHARDS; i++) {
+            pthread_mutex_destroy(&cache->shards[i].lock);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+fd_cache_entry_t *fd_cache_lookup(fd_cache_t *cache, const char *path) {
+    unsigned hash = hash_path(path);
+    fd_cache_shard_t *shard = shard_for(cache, hash);
+
+    if (pthread_mutex_lock(&shard->lock)) {
+        perror("pthread_mutex_lock");
+        return NULL;
+    }
+    fd_cache_entry_t *entry = find_entry(shard, path, hash);
+    if (entry != NULL) {
+        touch_entry(shard, entry);
+        __atomic_add_fetch(&entry->refcount, 1, __ATOMIC_RELAXED);
+    }
+    if (pthread_mutex_unlock(&shard->lock)) {
+        perror("pthread_mutex_unlock");
+    }
+    return entry;
+}
+
+fd_cache_entry_t *fd_cache_insert(fd_cache_t *cache, const char *path, int fd,
+                                  const struct stat *stat_buf, const char *mime_type,
+                                  const char *header, size_t header_len) {
+    // A change between the caller's open() and this watch goes unnoticed until the entry is
+    // evicted, so the window is kept as short as possible
+    if (watch_directory(cache, path)) {
+        return NULL;
+    }
+
+    fd_cache_entry_t *entry = calloc(1, sizeof(fd_cache_entry_t));
+    if (entry == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    entry->fd = -1;    // not owned until every allocation succeeded
+    entry->path = strdup(path);
+    entry->header = malloc(header_len);
+    if (entry->path == NULL || entry->header == NULL) {
+        perror("malloc");
+        destroy_entry(entry);
+        return NULL;
+    }
+    memcpy(entry->header, header, header_len);
+    entry->header_len = header_len;
+    entry->hash = hash_path(path);
+    entry->fd = fd;
+    entry->stat_buf = *stat_buf;
+    entry->mime_type = mime_type;
+    entry->refcount = 2;    // the caller's reference and the cache's own
+    fd_cache_shard_t *shard = shard_for(cache, entry->hash);
+
+    if (pthread_mutex_lock(&shard->lock)) {
+        perror("pthread_mutex_lock");
+        entry->fd = -1;
+        destroy_entry(entry);
+        return NULL;
+    }
+
+    // Another thread may have opened the same file at the same time
+    fd_cache_entry_t *existing = find_entry(shard, path, entry->hash);
+    if (existing != NULL) {
+        remove_entry(shard, existing);
+    }
+    while (shard->n_entries >= cache->shard_capacity) {
+        remove_entry(shard, shard->lru_tail);
+    }
+
+    entry->hash_next = *bucket_for(shard, entry->hash);
+    *bucket_for(shard, entry->hash) = entry;
+    entry->lru_next = shard->lru_head;
+    if (shard->lru_head != NULL) {
+        shard->lru_head->lru_prev = entry;
+    } else {
+        shard->lru_tail = entry;
+    }
+    shard->lru_head = entry;
+    shard->n_entries++;
+
+    if (pthread_mutex_unlock(&shard->lock)) {
+        perror("pthread_mutex_unlock");
+    }
+    return entry;
+}
+
+const char *fd_cache_map(fd_cache_entry_t *entry, int sequential) {
+    void *map = __atomic_load_n(&entry->map, __ATOMIC_ACQUIRE);
+    if (map != NULL) {
+        return map;
+    }
+
+    size_t len = entry->stat_buf.st_size;
+    map = mmap(NULL, len, PROT_READ, MAP_SHARED, entry->fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    // Advice only affects performance, so failures are not errors
+    madvise(map, len, MADV_WILLNEED);
+    if (sequential) {
+        madvise(map, len, MADV_SEQUENTIAL);
+    }
+
+    // Threads that raced to map the same file keep whichever mapping was published first
+    void *expected = NULL;
+    if (!__atomic_compare_exchange_n(&entry->map, &expected, map, 0, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_ACQUIRE)) {
+        munmap(map, len);
+        map = expected;
+    }
+    return map;
+}
+
+void fd_cache_release(fd_cache_entry_t *entry) {
+    if (__atomic_sub_fetch(&entry->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        destroy_entry(entry);
+    }
+}
+
+int fd_cache_free(fd_cache_t *cache) {
+    int result = 0;
+    uint64_t one = 1;
+    if (write(cache->wake_fd, &one, sizeof(one)) == -1) {
+        perror("write");
+        result = -1;
+    } else {
+        int ret_val = pthread_join(cache->watcher, NULL);
+        if (ret_val != 0) {
+            fprintf(stderr, "pthread_join failed: %s\n", strerror(ret_val));
+            result = -1;
+        }
+    }
+    close(cache->wake_fd);
+    close(cache->inotify_fd);
+    while (cache->watches != NULL) {
+        fd_cache_watch_t *watch = cache->watches;
+        cache->watches = watch->next;
+        free(watch->prefix);
+        free(watch);
+    }
+    if (pthread_mutex_destroy(&cache->watches_lock)) {
+        perror("pthread_mutex_destroy");
+        result = -1;
+    }
+
+    for (int i = 0; i < FD_CACHE_SHARDS; i++) {
+        fd_cache_shard_t *shard = &cache->shards[i];
+        while (shard->lru_head != NULL) {
+            remove_entry(shard, shard->lru_head);
+        }
+        if (pthread_mutex_destroy(&shard->lock)) {
+            perror("pthread_mutex_destroy");
+            result = -1;
+        }
+    }
+    return result;
+}
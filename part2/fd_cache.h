@@ -0,0 +1,117 @@
+#ifndef FD_CACHE_H
+#define FD_CACHE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define FD_CACHE_SHARDS 16
+#define FD_CACHE_BUCKETS 64    // per shard
+#define DEFAULT_FD_CACHE_ENTRIES 256
+
+// An open file plus the metadata and entity header lines a response for it needs
+// Entries are reference counted so a transfer can keep reading the file after it was evicted or
+// invalidated; the descriptor is closed once the last reference is dropped
+typedef struct fd_cache_entry {
+    char *path;
+    unsigned hash;
+    int fd;    // opened read-only
+    struct stat stat_buf;
+    const char *mime_type;
+    char *header;    // "Content-Type: ...\r\nContent-Length: ...\r\n\r\n"
+    size_t header_len;
+    void *map;    // read-only mapping of the whole file shared by every user, or NULL
+
+    int refcount;    // one held by the cache while linked in, plus one per user
+    struct fd_cache_entry *hash_next;
+    struct fd_cache_entry *lru_prev;    // towards most recently used
+    struct fd_cache_entry *lru_next;    // towards least recently used
+} fd_cache_entry_t;
+
+// One independently locked slice of the cache; paths are spread across shards by hash
+typedef struct {
+    pthread_mutex_t lock;
+    fd_cache_entry_t *buckets[FD_CACHE_BUCKETS];
+    fd_cache_entry_t *lru_head;
+    fd_cache_entry_t *lru_tail;
+    size_t n_entries;
+} fd_cache_shard_t;
+
+// A directory watched for changes to the cached files in it
+typedef struct fd_cache_watch {
+    int wd;          // inotify watch descriptor; shared by every prefix naming the directory
+    char *prefix;    // cached paths in the directory are prefix + file name
+    struct fd_cache_watch *next;
+} fd_cache_watch_t;
+
+// Struct representing a bounded, thread-safe cache of open files keyed by path
+// A watcher thread drops entries as soon as inotify reports that their file changed, so lookups
+// need no system calls at all
+typedef struct {
+    size_t shard_capacity;    // entries each shard may hold
+    fd_cache_shard_t shards[FD_CACHE_SHARDS];
+
+    int inotify_fd;
+    int wake_fd;    // eventfd that stops the watcher thread
+    pthread_t watcher;
+    pthread_mutex_t watches_lock;
+    fd_cache_watch_t *watches;
+} fd_cache_t;
+
+/*
+ * Initialize a new fd cache and start its watcher thread
+ * cache: Pointer to fd_cache_t to be initialized
+ * capacity: Total number of open files the cache may hold
+ * Returns 0 on success or -1 on error
+ */
+int fd_cache_init(fd_cache_t *cache, size_t capacity);
+
+/*
+ * Look up an open file by path
+ * cache: A pointer to the fd_cache_t to search
+ * path: The file's path
+ * Returns a referenced entry that must be passed to fd_cache_release, or NULL on a miss
+ */
+fd_cache_entry_t *fd_cache_lookup(fd_cache_t *cache, const char *path);
+
+/*
+ * Add an open file to the cache, evicting least recently used entries to make room, and start
+ * watching its directory for changes
+ * cache: A pointer to the fd_cache_t to insert into
+ * path: The file's path
+ * fd: The open file, which the cache takes ownership of on success
+ * stat_buf: The file's metadata, from fstat() on fd
+ * mime_type: The file's MIME type, a string that outlives the cache
+ * header: The entity header lines to serve along with the file
+ * header_len: The length of header
+ * Returns a referenced entry that must be passed to fd_cache_release, or NULL on error
+ */
+fd_cache_entry_t *fd_cache_insert(fd_cache_t *cache, const char *path, int fd,
+                                  const struct stat *stat_buf, const char *mime_type,
+                                  const char *header, size_t header_len);
+
+/*
+ * Get a read-only mapping of a cached file, mapping it on first use
+ * The mapping is unmapped once the entry is freed, so callers must hold a reference while they use
+ * it. The kernel is asked to read the file ahead, sequentially if it is large.
+ * entry: A referenced entry for a file that is not empty
+ * sequential: Nonzero if the file is large enough to be worth sequential readahead
+ * Returns the mapping, or NULL on error
+ */
+const char *fd_cache_map(fd_cache_entry_t *entry, int sequential);
+
+/*
+ * Drop a reference obtained from fd_cache_lookup or fd_cache_insert
+ * entry: The entry to release
+ */
+void fd_cache_release(fd_cache_entry_t *entry);
+
+/*
+ * Stop the watcher thread and close every cached file
+ * Entries still referenced elsewhere are freed when they are released.
+ * Returns 0 on success or -1 on error
+ */
+int fd_cache_free(fd_cache_t *cache);
+
+#endif    // FD_CACHE_H
@@ -0,0 +1,305 @@
+#include "file_cache.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Hash a path with 32-bit FNV-1a
+ * path: The NUL-terminated path to hash
+ * Returns the hash value
+ */
+static unsigned hash_path(const char *path) {
+    unsigned hash = 2166136261u;
+    for (const unsigned char *c = (const unsigned char *) path; *c != '\0'; c++) {
+        hash ^= *c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static file_cache_shard_t *shard_for(file_cache_t *cache, unsigned hash) {
+    return &cache->shards[hash % FILE_CACHE_SHARDS];
+}
+
+static file_cache_entry_t **bucket_for(file_cache_shard_t *shard, unsigned hash) {
+    return &shard->buckets[(hash / FILE_CACHE_SHARDS) % FILE_CACHE_BUCKETS];
+}
+
+/*
+ * Check whether an entry still matches a file's metadata
+ * Returns nonzero if the cached contents are still current
+ */
+static int entry_is_fresh(const file_cache_entry_t *entry, const struct stat *stat_buf) {
+    return entry->ino == stat_buf->st_ino && entry->st_size == stat_buf->st_size &&
+           entry->mtime.tv_sec == stat_buf->st_mtim.tv_sec &&
+           entry->mtime.tv_nsec == stat_buf->st_mtim.tv_nsec;
+}
+
+static void destroy_entry(file_cache_entry_t *entry) {
+    free(entry->path);
+    free(entry->data);
+    free(entry->header);
+    free(entry);
+}
+
+/*
+ * Unlink an entry from its shard's hash chain and LRU list and drop the cache's reference
+ * Must be called with the shard locked.
+ */
+static void remove_entry(file_cache_shard_t *shard, file_cache_entry_t *entry) {
+    file_cache_entry_t **link = bucket_for(shard, entry->hash);
+    while (*link != entry) {
+        link = &(*link)->hash_next;
+    }
+    *link = entry->hash_next;
+
+    if (entry->lru_prev != NULL) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        shard->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next != NULL) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        shard->lru_tail = entry->lru_prev;
+    }
+
+    shard->bytes -= entry->size;
+    file_cache_release(entry);
+}
+
+/*
+ * Move an entry to the most recently used end of its shard's LRU list
+ * Must be called with the shard locked.
+ */
+static void touch_entry(file_cache_shard_t *shard, file_cache_entry_t *entry) {
+    if (shard->lru_head == entry) {
+        return;
+    }
+    entry->lru_prev->lru_next = entry->lru_next;
+    if (entry->lru_next != NULL) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        shard->lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = NULL;
+    entry->lru_next = shard->lru_head;
+    shard->lru_head->lru_prev = entry;
+    shard->lru_head = entry;
+}
+
+/*
+ * Find an entry by path in a shard
+ * Must be called with the shard locked.
+ * Returns the entry or NULL if the path is not cached
+ */
+static file_cache_entry_t *find_entry(file_cache_shard_t *shard, const char *path, unsigned hash) {
+    for (file_cache_entry_t *entry = *bucket_for(shard, hash); entry != NULL;
+         entry = entry->hash_next) {
+        if (entry->hash == hash && strcmp(entry->path, path) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+int file_cache_init(file_cache_t *cache, size_t capacity) {
+    cache->shard_capacity = capacity / FILE_CACHE_SHARDS;
+
+    for (int i = 0; i < FILE_CACHE_SHARDS; i++) {
+        file_cache_shard_t *shard = &cache->shards[i];
+        if (pthread_mutex_init(&shard->lock, NULL)) {
+            perror("pthread_mutex_init");
+            for (int j = 0; j < i; j++) {
+                pthread_mutex_destroy(&cache->shards[j].lock);
+            }
+            return -1;
+        }
+        memset(shard->buckets, 0, sizeof(shard->buckets));
+        shard->lru_head = NULL;
+        shard->lru_tail = NULL;
+        shard->bytes = 0;
+    }
+
+    return 0;
+}
+
+int file_cache_admits(const file_cache_t *cache, off_t size) {
+    return size <= (off_t) cache->shard_capacity;
+}
+
+file_cache_entry_t *file_cache_lookup(file_cache_t *cache, const char *path,
+                                      const struct stat *stat_buf) {
+    unsigned hash = hash_path(path);
+    file_cache_shard_t *shard = shard_for(cache, hash);
+
+    if (pthread_mutex_lock(&shard->lock)) {
+        perror("pthread_mutex_lock");
+        return NULL;
+    }
+
+    file_cache_entry_t *entry = find_entry(shard, path, hash);
+    if (entry != NULL && !entry_is_fresh(entry, stat_buf)) {
+        // File was replaced or modified, so the cached copy is stale
+        remove_entry(shard, entry);
+        entry = NULL;
+    }
+    if (entry != NULL) {
+        touch_entry(shard, entry);
+        __atomic_add_fetch(&entry->refcount, 1, __ATOMIC_RELAXED);
+    }
+
+    if (pthread_mutex_unlock(&shard->lock)) {
+        perror("pthread_mutex_unlock");
+    }
+    return entry;
+}
+
+/*
+ * Allocate an entry with room for contents of a given size, which the caller fills in
+ * Returns the new entry, holding one reference for the caller, or NULL on error
+ */
+static file_cache_entry_t *create_entry(const char *path, unsigned hash,
+                                        const struct stat *stat_buf, size_t size,
+                                        const char *header, size_t header_len) {
+    file_cache_entry_t *entry = calloc(1, sizeof(file_cache_entry_t));
+    if (entry == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    entry->path = strdup(path);
+    entry->data = malloc(size > 0 ? size : 1);
+    entry->header = malloc(header_len);
+    if (entry->path == NULL || entry->data == NULL || entry->header == NULL) {
+        perror("malloc");
+        destroy_entry(entry);
+        return NULL;
+    }
+    memcpy(entry->header, header, header_len);
+    entry->header_len = header_len;
+    entry->hash = hash;
+    entry->ino = stat_buf->st_ino;
+    entry->st_size = stat_buf->st_size;
+    entry->mtime = stat_buf->st_mtim;
+    entry->refcount = 1;
+    return entry;
+}
+
+/*
+ * Link a filled-in entry into its shard, replacing any entry for the same path and evicting least
+ * recently used entries to make room
+ * cache: The cache to insert into
+ * entry: The entry, which is destroyed on error
+ * Returns the entry, or NULL on error
+ */
+static file_cache_entry_t *link_entry(file_cache_t *cache, file_cache_entry_t *entry) {
+    file_cache_shard_t *shard = shard_for(cache, entry->hash);
+
+    if (pthread_mutex_lock(&shard->lock)) {
+        perror("pthread_mutex_lock");
+        destroy_entry(entry);
+        return NULL;
+    }
+
+    // Another thread may have cached the same file while this one was reading it
+    file_cache_entry_t *existing = find_entry(shard, entry->path, entry->hash);
+    if (existing != NULL) {
+        remove_entry(shard, existing);
+    }
+    while (shard->bytes + entry->size > cache->shard_capacity) {
+        remove_entry(shard, shard->lru_tail);
+    }
+
+    entry->hash_next = *bucket_for(shard, entry->hash);
+    *bucket_for(shard, entry->hash) = entry;
+    entry->lru_next = shard->lru_head;
+    if (shard->lru_head != NULL) {
+        shard->lru_head->lru_prev = entry;
+    } else {
+        shard->lru_tail = entry;
+    }
+    shard->lru_head = entry;
+    shard->bytes += entry->size;
+    entry->refcount++;    // the cache's own reference
+
+    if (pthread_mutex_unlock(&shard->lock)) {
+        perror("pthread_mutex_unlock");
+    }
+    return entry;
+}
+
+file_cache_entry_t *file_cache_insert(file_cache_t *cache, const char *path,
+                                      const struct stat *stat_buf, int fd, const char *header,
+                                      size_t header_len) {
+    if (!file_cache_admits(cache, stat_buf->st_size)) {
+        return NULL;
+    }
+
+    // Read the file before taking the lock so other paths in the shard are not held up
+    file_cache_entry_t *entry =
+        create_entry(path, hash_path(path), stat_buf, stat_buf->st_size, header, header_len);
+    if (entry == NULL) {
+        return NULL;
+    }
+    while (entry->size < (size_t) stat_buf->st_size) {
+        ssize_t num_bytes_read =
+            pread(fd, entry->data + entry->size, stat_buf->st_size - entry->size, entry->size);
+        if (num_bytes_read == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("read");
+            destroy_entry(entry);
+            return NULL;
+        } else if (num_bytes_read == 0) {
+            fprintf(stderr, "read: file shrank while being cached\n");
+            destroy_entry(entry);
+            return NULL;
+        }
+        entry->size += num_bytes_read;
+    }
+
+    return link_entry(cache, entry);
+}
+
+file_cache_entry_t *file_cache_insert_data(file_cache_t *cache, const char *path,
+                                           const struct stat *stat_buf, const char *data,
+                                           size_t size, const char *header, size_t header_len) {
+    if (!file_cache_admits(cache, size)) {
+        return NULL;
+    }
+
+    file_cache_entry_t *entry =
+        create_entry(path, hash_path(path), stat_buf, size, header, header_len);
+    if (entry == NULL) {
+        return NULL;
+    }
+    memcpy(entry->data, data, size);
+    entry->size = size;
+
+    return link_entry(cache, entry);
+}
+
+void file_cache_release(file_cache_entry_t *entry) {
+    if (__atomic_sub_fetch(&entry->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        destroy_entry(entry);
+    }
+}
+
+int file_cache_free(file_cache_t *cache) {
+    int result = 0;
+    for (int i = 0; i < FILE_CACHE_SHARDS; i++) {
+        file_cache_shard_t *shard = &cache->shards[i];
+        while (shard->lru_head != NULL) {
+            remove_entry(shard, shard->lru_head);
+        }
+        if (pthread_mutex_destroy(&shard->lock)) {
+            perror("pthread_mutex_destroy");
+            result = -1;
+        }
+    }
+    return result;
+}
@@ -0,0 +1,118 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define FILE_CACHE_SHARDS 16
+#define FILE_CACHE_BUCKETS 256    // per shard
+#define DEFAULT_FILE_CACHE_BYTES (32 * 1024 * 1024)
+
+// A cached file: its contents plus the entity header lines rendered for it
+// Entries are reference counted so a response can keep sending one after it has been evicted
+typedef struct file_cache_entry {
+    char *path;
+    unsigned hash;
+    char *data;
+    size_t size;
+    char *header;    // "Content-Type: ...\r\nContent-Length: ...\r\n\r\n"
+    size_t header_len;
+
+    // Metadata the contents were read under, compared on every lookup to detect changes
+    ino_t ino;
+    off_t st_size;
+    struct timespec mtime;
+
+    int refcount;    // one held by the cache while linked in, plus one per user
+    struct file_cache_entry *hash_next;
+    struct file_cache_entry *lru_prev;    // towards most recently used
+    struct file_cache_entry *lru_next;    // towards least recently used
+} file_cache_entry_t;
+
+// One independently locked slice of the cache; paths are spread across shards by hash
+typedef struct {
+    pthread_mutex_t lock;
+    file_cache_entry_t *buckets[FILE_CACHE_BUCKETS];
+    file_cache_entry_t *lru_head;
+    file_cache_entry_t *lru_tail;
+    size_t bytes;
+} file_cache_shard_t;
+
+// Struct representing a bounded, thread-safe cache of file contents keyed by path
+typedef struct {
+    size_t shard_capacity;    // bytes each shard may hold; also the largest cacheable file
+    file_cache_shard_t shards[FILE_CACHE_SHARDS];
+} file_cache_t;
+
+/*
+ * Initialize a new file cache
+ * cache: Pointer to file_cache_t to be initialized
+ * capacity: Total number of bytes of file contents the cache may hold
+ * Returns 0 on success or -1 on error
+ */
+int file_cache_init(file_cache_t *cache, size_t capacity);
+
+/*
+ * Check whether a file is small enough to ever be cached
+ * cache: A pointer to the file_cache_t
+ * size: The size of the file in bytes
+ * Returns nonzero if the file could be cached
+ */
+int file_cache_admits(const file_cache_t *cache, off_t size);
+
+/*
+ * Look up a file, discarding the cached copy if the file changed since it was read
+ * cache: A pointer to the file_cache_t to search
+ * path: The file's path
+ * stat_buf: The file's current metadata
+ * Returns a referenced entry that must be passed to file_cache_release, or NULL on a miss
+ */
+file_cache_entry_t *file_cache_lookup(file_cache_t *cache, const char *path,
+                                      const struct stat *stat_buf);
+
+/*
+ * Read an open file into the cache, evicting least recently used entries to make room
+ * cache: A pointer to the file_cache_t to insert into
+ * path: The file's path
+ * stat_buf: The file's metadata at the time it was opened
+ * fd: The open file to read the contents from
+ * header: The entity header lines to serve along with the contents
+ * header_len: The length of header
+ * Returns a referenced entry that must be passed to file_cache_release, or NULL on error
+ */
+file_cache_entry_t *file_cache_insert(file_cache_t *cache, const char *path,
+                                      const struct stat *stat_buf, int fd, const char *header,
+                                      size_t header_len);
+
+/*
+ * Cache contents derived from a file, such as a compressed copy, under the file's path
+ * Lookups treat the entry as current for as long as the file's metadata still matches.
+ * cache: A pointer to the file_cache_t to insert into
+ * path: The path of the file the contents were derived from
+ * stat_buf: That file's metadata at the time it was read
+ * data: The contents to copy into the cache
+ * size: The length of data
+ * header: The entity header lines to serve along with the contents
+ * header_len: The length of header
+ * Returns a referenced entry that must be passed to file_cache_release, or NULL on error
+ */
+file_cache_entry_t *file_cache_insert_data(file_cache_t *cache, const char *path,
+                                           const struct stat *stat_buf, const char *data,
+                                           size_t size, const char *header, size_t header_len);
+
+/*
+ * Drop a reference obtained from file_cache_lookup, file_cache_insert or file_cache_insert_data
+ * entry: The entry to release
+ */
+void file_cache_release(file_cache_entry_t *entry);
+
+/*
+ * Deallocates and cleans up any resources associated with a file cache.
+ * Entries still referenced elsewhere are freed when they are released.
+ * Returns 0 on success or -1 on error
+ */
+int file_cache_free(file_cache_t *cache);
+
+#endif    // FILE_CACHE_H
@@ -0,0 +1,26 @@
+#define _GNU_SOURCE
+
+#include "futex.h"
+
+#include <errno.h>
+#include <linux/futex.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+int futex_wait(unsigned *word, unsigned expected) {
+    if (syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0) == -1 &&
+        errno != EAGAIN && errno != EINTR) {
+        perror("futex");
+        return -1;
+    }
+    return 0;
+}
+
+int futex_wake(unsigned *word, int n) {
+    if (syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0) == -1) {
+        perror("futex");
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,20 @@
+#ifndef FUTEX_H
+#define FUTEX_H
+
+/*
+ * Sleep until a futex word changes from an expected value or the futex is woken
+ * word: The futex word
+ * expected: The value the caller last saw; returns immediately if the word differs
+ * Returns 0 on wakeup or value mismatch and -1 on error
+ */
+int futex_wait(unsigned *word, unsigned expected);
+
+/*
+ * Wake threads sleeping on a futex word
+ * word: The futex word
+ * n: The maximum number of threads to wake
+ * Returns 0 on success or -1 on error
+ */
+int futex_wake(unsigned *word, int n);
+
+#endif    // FUTEX_H
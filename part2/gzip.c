@@ -0,0 +1,41 @@
+#include "gzip.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <zlib.h>
+
+// Adding 16 to the largest window size makes deflate write a gzip header and trailer
+#define GZIP_WINDOW_BITS (15 + 16)
+#define GZIP_MEM_LEVEL 8
+
+char *gzip_compress(const char *data, size_t len, size_t *out_len) {
+    z_stream stream = {.zalloc = Z_NULL, .zfree = Z_NULL, .opaque = Z_NULL};
+    // Each file is compressed once and then served from memory, so spend the time on ratio
+    if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, GZIP_WINDOW_BITS, GZIP_MEM_LEVEL,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        fprintf(stderr, "deflateInit2: %s\n", stream.msg != NULL ? stream.msg : "failed");
+        return NULL;
+    }
+
+    // deflateBound() is large enough for a single Z_FINISH call to compress everything
+    size_t bound = deflateBound(&stream, len);
+    char *out = malloc(bound);
+    if (out == NULL) {
+        perror("malloc");
+        deflateEnd(&stream);
+        return NULL;
+    }
+    stream.next_in = (Bytef *) data;
+    stream.avail_in = len;
+    stream.next_out = (Bytef *) out;
+    stream.avail_out = bound;
+    if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+        fprintf(stderr, "deflate: %s\n", stream.msg != NULL ? stream.msg : "output incomplete");
+        free(out);
+        deflateEnd(&stream);
+        return NULL;
+    }
+    *out_len = stream.total_out;
+    deflateEnd(&stream);
+    return out;
+}
@@ -0,0 +1,15 @@
+#ifndef GZIP_H
+#define GZIP_H
+
+#include <stddef.h>
+
+/*
+ * Compress a buffer into the gzip format
+ * data: The bytes to compress
+ * len: The number of bytes
+ * out_len: Set to the length of the compressed bytes on success
+ * Returns a malloc'd buffer holding the compressed bytes, or NULL on error
+ */
+char *gzip_compress(const char *data, size_t len, size_t *out_len);
+
+#endif    // GZIP_H
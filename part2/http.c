@@ -1,32 +1,95 @@
+#define _GNU_SOURCE
+
 #include "http.h"
 
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
-#define BUFSIZE 512
+#include "arena.h"
+#include "gzip.h"
 
-const char *get_mime_type(const char *file_extension) {
-    if (strcmp(".txt", file_extension) == 0) {
-        return "text/plain";
-    } else if (strcmp(".html", file_extension) == 0) {
-        return "text/html";
-    } else if (strcmp(".jpg", file_extension) == 0) {
-        return "image/jpeg";
-    } else if (strcmp(".png", file_extension) == 0) {
-        return "image/png";
-    } else if (strcmp(".pdf", file_extension) == 0) {
-        return "application/pdf";
-    } else if (strcmp(".mp3", file_extension) == 0) {
-        return "audio/mpeg";
-    }
+#define SPLICE_CHUNK (64 * 1024)
+#define ETAG_BUFSIZE 64
+#define MULTIPART_BOUNDARY_BUFSIZE 17
+#define MAX_MULTIPART_BODY (4 * 1024 * 1024)    // larger multi-range responses send the whole file
+// Delimiter and header of one part of a multipart/byteranges body, given the boundary, the
+// Content-Type and the range's first byte, last byte and file size
+#define PART_HEADER_FORMAT                                                                     \
+    "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %ld-%ld/%ld\r\n\r\n"
+
+// Results of the internal send_body_* helpers besides 0 (done) and -1 (error)
+#define SEND_UNSUPPORTED 1    // kernel path unavailable for this fd pair, nothing was sent
+#define SEND_WOULD_BLOCK 2    // non-blocking socket is full, retry once it is writable
+
+static transmit_mode_t transmit_mode = TRANSMIT_AUTO;
+static off_t mmap_threshold = DEFAULT_MMAP_THRESHOLD;
+static size_t io_chunk_size = DEFAULT_IO_CHUNK_SIZE;
+static path_cache_t *path_cache = NULL;
+static fd_cache_t *fd_cache = NULL;
+static file_cache_t *file_cache = NULL;
+static file_cache_t *gzip_cache = NULL;
+static const mime_table_t *mime_table = NULL;
+static max_age_rule_t max_age_rules[MAX_AGE_RULES];
+static int n_max_age_rules = 0;
+
+void set_transmit_mode(transmit_mode_t mode) {
+    transmit_mode = mode;
+}
+
+void set_mmap_threshold(off_t threshold) {
+    mmap_threshold = threshold;
+}
+
+void set_io_chunk_size(size_t size) {
+    io_chunk_size = size;
+}
+
+void set_path_cache(path_cache_t *cache) {
+    path_cache = cache;
+}
+
+void set_fd_cache(fd_cache_t *cache) {
+    fd_cache = cache;
+}
+
+void set_file_cache(file_cache_t *cache) {
+    file_cache = cache;
+}
 
-    return NULL;
+void set_gzip_cache(file_cache_t *cache) {
+    gzip_cache = cache;
+}
+
+void set_mime_table(const mime_table_t *table) {
+    mime_table = table;
+}
+
+void set_max_age_rules(const max_age_rule_t *rules, int n_rules) {
+    memcpy(max_age_rules, rules, n_rules * sizeof(max_age_rule_t));
+    n_max_age_rules = n_rules;
+}
+
+/*
+ * Get the MIME type of a file extension from the table set with set_mime_table
+ * file_extension: The extension, including its leading '.'
+ * Returns the MIME type, or DEFAULT_MIME_TYPE if it is unknown
+ */
+const char *get_mime_type(const char *file_extension) {
+    const char *mime_type =
+        mime_table != NULL ? mime_table_lookup(mime_table, file_extension + 1) : NULL;
+    return mime_type != NULL ? mime_type : DEFAULT_MIME_TYPE;
 }
 
 /*
@@ -37,133 +100,1003 @@ const char *get_mime_type(const char *file_extension) {
 const char *get_file_extension(const char *resource_path) {
     const char *extension =
         strrchr(resource_path, '.');    // get pointer to last occurrance of '.' in the string
+    if (extension != NULL && strchr(extension, '/') != NULL) {
+        return NULL;    // the '.' is in a directory name, not the file name
+    }
     return extension;    // will either return the file extension or NULL if '.' was not found
 }
 
-int read_http_request(int fd, char *resource_name) {
-    char buffer[BUFSIZE];
+/*
+ * Get the MIME type of a file from its name
+ * resource_path: The path of the file
+ * Returns the MIME type, DEFAULT_MIME_TYPE if it is unknown
+ */
+static const char *mime_type_of(const char *resource_path) {
+    const char *extension = get_file_extension(resource_path);
+    return extension != NULL ? get_mime_type(extension) : DEFAULT_MIME_TYPE;
+}
+
+/*
+ * Check whether files of a MIME type are worth compressing
+ * Images, audio and PDFs are compressed already, so gzip would only cost time.
+ * mime_type: The MIME type, or NULL if unknown
+ * Returns nonzero if the type is text-like
+ */
+static int is_compressible(const char *mime_type) {
+    return mime_type != NULL &&
+           (strncmp(mime_type, "text/", strlen("text/")) == 0 ||
+            strcmp(mime_type, "application/javascript") == 0 ||
+            strcmp(mime_type, "application/json") == 0 ||
+            strcmp(mime_type, "application/xml") == 0 || strcmp(mime_type, "image/svg+xml") == 0);
+}
+
+/*
+ * Copy a file to a non-blocking socket with sendfile(2), without passing through user space
+ * fd: The socket's file descriptor
+ * resource: The open file to send
+ * offset: The file offset to start from, advanced past every byte sent
+ * end: The file offset to stop at
+ * Returns 0 on success, SEND_UNSUPPORTED if sendfile is unavailable for this fd pair,
+ * SEND_WOULD_BLOCK, or -1 on error
+ */
+static int send_body_sendfile(int fd, int resource, off_t *offset, off_t end) {
+    off_t start = *offset;    // a body may start, or resume, anywhere in the file
+    while (*offset < end) {
+        ssize_t num_sent = sendfile(fd, resource, offset, end - *offset);
+        if (num_sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return SEND_WOULD_BLOCK;
+            } else if ((errno == EINVAL || errno == ENOSYS) && *offset == start) {
+                return SEND_UNSUPPORTED;
+            }
+            if (errno != ECONNRESET && errno != EPIPE) {
+                perror("sendfile");
+            }
+            return -1;
+        } else if (num_sent == 0) {    // file shrank underneath us
+            fprintf(stderr, "sendfile: unexpected end of file\n");
+            return -1;
+        }
+    }
+    return 0;
+}
 
-    if (read(fd, buffer, BUFSIZE) == -1) {
-        perror("read");
+/*
+ * Copy a file to a non-blocking socket with splice(2), moving pages through a pipe
+ * The pipe only lives as long as the call, so the offset advances past what reached the socket
+ * and whatever the socket did not take is read from the file again next time.
+ * fd: The socket's file descriptor
+ * resource: The open file to send
+ * offset: The file offset to start from, advanced past every byte sent
+ * end: The file offset to stop at
+ * Returns 0 on success, SEND_UNSUPPORTED if splice is unavailable for this fd pair,
+ * SEND_WOULD_BLOCK, or -1 on error
+ */
+static int send_body_splice(int fd, int resource, off_t *offset, off_t end) {
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+        perror("pipe2");
         return -1;
     }
 
-    char *token =
-        strtok(buffer, " ");    // specify the string to parse for the first call to strtok
-    if (token != NULL) {
-        token = strtok(NULL, " ");    // call strtok again, this will have resource_name
+    off_t start = *offset;    // a body may start, or resume, anywhere in the file
+    int result = 0;
+    while (result == 0 && *offset < end) {
+        size_t chunk = end - *offset < SPLICE_CHUNK ? end - *offset : SPLICE_CHUNK;
+        off_t in_offset = *offset;
+        ssize_t num_in = splice(resource, &in_offset, pipe_fds[1], NULL, chunk, SPLICE_F_MOVE);
+        if (num_in == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            int unsupported = (errno == EINVAL || errno == ENOSYS) && *offset == start;
+            result = unsupported ? SEND_UNSUPPORTED : -1;
+            if (result == -1) {
+                perror("splice");
+            }
+            break;
+        } else if (num_in == 0) {
+            fprintf(stderr, "splice: unexpected end of file\n");
+            result = -1;
+            break;
+        }
+
+        // Drain everything that was just moved into the pipe out to the socket, holding back a
+        // partial segment only while more of the file is still to come
+        unsigned int flags =
+            SPLICE_F_MOVE | SPLICE_F_NONBLOCK | (in_offset < end ? SPLICE_F_MORE : 0);
+        while (num_in > 0) {
+            ssize_t num_out = splice(pipe_fds[0], NULL, fd, NULL, num_in, flags);
+            if (num_out == -1) {
+                if (errno == EINTR) {
+                    continue;
+                } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    result = SEND_WOULD_BLOCK;
+                } else {
+                    if (errno != ECONNRESET && errno != EPIPE) {
+                        perror("splice");
+                    }
+                    result = -1;
+                }
+                break;
+            }
+            *offset += num_out;
+            num_in -= num_out;
+        }
     }
-    if (token == NULL) {
-        fprintf(stderr, "strtok error\n");
+
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    return result;
+}
+
+/*
+ * Copy a file to a non-blocking socket through a user-space buffer with pread()/send()
+ * fd: The socket's file descriptor
+ * resource: The open file to send
+ * offset: The file offset to start from, advanced past every byte sent
+ * end: The file offset to stop at
+ * Returns 0 on success, SEND_WOULD_BLOCK, or -1 on error
+ */
+static int send_body_buffered(int fd, int resource, off_t *offset, off_t end) {
+    // The chunk size is configurable up to MAX_IO_CHUNK_SIZE, too large for a thread's stack, so
+    // each thread reuses buffers from its pool instead
+    char *buffer = buffer_pool_acquire(io_chunk_size);
+    if (buffer == NULL) {
+        // error message printed in buffer_pool_acquire()
         return -1;
     }
+    int result = 0;
+    while (*offset < end) {
+        size_t chunk = end - *offset < io_chunk_size ? end - *offset : io_chunk_size;
+        ssize_t num_bytes_read = pread(resource, buffer, chunk, *offset);
+        if (num_bytes_read == -1) {    // read error occurred
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("read");
+            result = -1;
+            break;
+        } else if (num_bytes_read == 0) {
+            fprintf(stderr, "read: unexpected end of file\n");
+            result = -1;
+            break;
+        }
+
+        // Write buffer to client; every chunk but the last is corked so chunks smaller than a
+        // segment are coalesced. Only advance past what the socket accepted; the rest is re-read.
+        int more = *offset + num_bytes_read < end ? MSG_MORE : 0;
+        ssize_t num_written = send(fd, buffer, num_bytes_read, more | MSG_NOSIGNAL);
+        if (num_written == -1) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                result = SEND_WOULD_BLOCK;
+                break;
+            }
+            if (errno != ECONNRESET && errno != EPIPE) {
+                perror("send");
+            }
+            result = -1;
+            break;
+        }
+        *offset += num_written;
+    }
+    buffer_pool_release(buffer, io_chunk_size);
+    return result;
+}
 
-    strcpy(resource_name, token);
+void http_iov_advance(struct iovec **iov, int *iov_count, size_t num_written) {
+    while (*iov_count > 0 && num_written >= (*iov)->iov_len) {
+        num_written -= (*iov)->iov_len;
+        (*iov)++;
+        (*iov_count)--;
+    }
+    if (*iov_count > 0) {
+        (*iov)->iov_base = (char *) (*iov)->iov_base + num_written;
+        (*iov)->iov_len -= num_written;
+    }
+}
 
-    return 0;
+int send_http_body(int fd, int resource, off_t *offset, off_t end) {
+    int result = SEND_UNSUPPORTED;
+    if (transmit_mode != TRANSMIT_BUFFERED) {
+        result = send_body_sendfile(fd, resource, offset, end);
+        if (result == SEND_UNSUPPORTED) {
+            result = send_body_splice(fd, resource, offset, end);
+        }
+    }
+    if (result == SEND_UNSUPPORTED) {
+        result = send_body_buffered(fd, resource, offset, end);
+    }
+    return result == SEND_WOULD_BLOCK ? 1 : result;
 }
 
-int write_http_response(int fd, const char *resource_path) {
-    char *message = "";    // will hold either "404 Not Found" or "200 OK"
-    int file_exists = 1;
+/*
+ * Get the Connection header line a response needs to tell the client whether it persists
+ * request: The request being responded to
+ * Returns the header line, or an empty string where the protocol default already applies
+ */
+static const char *connection_header(const http_request_t *request) {
+    if (request->minor_version == 1) {
+        return request->keep_alive ? "" : "Connection: close\r\n";
+    }
+    return request->keep_alive ? "Connection: keep-alive\r\n" : "";
+}
 
-    struct stat stat_buf;
-    // inspect file metadata to determine if file exists and get file size
-    if (stat(resource_path, &stat_buf) == -1) {
-        if (errno == ENOENT) {    // requested file with given path does not exist, don't exit
-            message = "404 Not Found";
-            file_exists = 0;
-        } else {    // other error occurred, exit
-            perror("stat");
+/*
+ * Give up a response's body file: drop its fd cache reference, or close it if the response owns it
+ * response: The response whose resource to release
+ */
+static void release_resource(http_response_t *response) {
+    if (response->opened != NULL) {
+        fd_cache_release(response->opened);
+        response->opened = NULL;
+    } else if (response->resource != -1 && close(response->resource) == -1) {
+        perror("close");
+    }
+    response->resource = -1;
+}
+
+/*
+ * Check whether a file's responses differ between clients that do and do not accept gzip
+ * mime_type: The file's MIME type, or NULL if unknown
+ * Returns nonzero if caches in between must key the file's responses by Accept-Encoding
+ */
+static int varies_by_encoding(const char *mime_type) {
+    return gzip_cache != NULL && is_compressible(mime_type);
+}
+
+/*
+ * Check whether a request will be answered with the gzip variant of a file, if one can be built
+ * Requests for byte ranges get the identity encoding, whose offsets do not depend on compression.
+ * request: The request being responded to
+ * mime_type: The file's MIME type, or NULL if unknown
+ * Returns nonzero if the variant should be served
+ */
+static int wants_gzip(const http_request_t *request, const char *mime_type) {
+    return varies_by_encoding(mime_type) && http_request_accepts_encoding(request, "gzip") &&
+           http_request_header(request, "Range") == NULL;
+}
+
+/*
+ * Get the Cache-Control max-age configured for a MIME type
+ * The most specific matching rule wins: an exact type, then a whole top-level type, then "*".
+ * mime_type: The MIME type, or NULL if unknown
+ * Returns the max-age in seconds, or -1 if no rule matches
+ */
+static long max_age_for(const char *mime_type) {
+    long max_age = -1;
+    int best = -1;    // specificity of the rule max_age came from
+    for (int i = 0; i < n_max_age_rules; i++) {
+        const char *pattern = max_age_rules[i].pattern;
+        size_t pattern_len = strlen(pattern);
+        int specificity = -1;
+        if (strcmp(pattern, "*") == 0) {
+            specificity = 0;
+        } else if (mime_type == NULL) {
+            continue;
+        } else if (pattern_len >= 2 && strcmp(pattern + pattern_len - 2, "/*") == 0) {
+            specificity = strncasecmp(pattern, mime_type, pattern_len - 1) == 0 ? 1 : -1;
+        } else {
+            specificity = strcasecmp(pattern, mime_type) == 0 ? 2 : -1;
+        }
+        if (specificity > best) {
+            best = specificity;
+            max_age = max_age_rules[i].max_age;
+        }
+    }
+    return max_age;
+}
+
+/*
+ * Render the strong entity tag of a file's contents, which changes whenever the file does
+ * buf: Where to render the quoted tag, at least ETAG_BUFSIZE bytes
+ * file_stat: The file's metadata
+ * encoded: Nonzero to tag the gzip variant, which is a different representation
+ */
+static void render_etag(char *buf, const struct stat *file_stat, int encoded) {
+    snprintf(buf, ETAG_BUFSIZE, "\"%lx-%lx-%lx.%lx%s\"", (unsigned long) file_stat->st_ino,
+             (unsigned long) file_stat->st_size, (unsigned long) file_stat->st_mtim.tv_sec,
+             (unsigned long) file_stat->st_mtim.tv_nsec, encoded ? "-gzip" : "");
+}
+
+/*
+ * Render the header lines that let clients and caches reuse and revalidate a file response:
+ * ETag, Last-Modified, Cache-Control if a max-age is configured for its type, and Vary
+ * buf: Where to render the lines
+ * cap: The size of buf
+ * file_stat: The file's metadata
+ * mime_type: The file's MIME type, or NULL if unknown
+ * encoded: Nonzero if the response carries the gzip variant
+ * Returns the length rendered, or -1 if the lines do not fit
+ */
+static int render_validators(char *buf, size_t cap, const struct stat *file_stat,
+                             const char *mime_type, int encoded) {
+    char etag[ETAG_BUFSIZE];
+    render_etag(etag, file_stat, encoded);
+    char last_modified[HTTP_DATE_BUFSIZE];
+    struct tm tm;
+    strftime(last_modified, sizeof(last_modified), "%a, %d %b %Y %H:%M:%S GMT",
+             gmtime_r(&file_stat->st_mtime, &tm));
+    char cache_control[HEADER_BUFSIZE] = "";
+    long max_age = max_age_for(mime_type);
+    if (max_age != -1) {
+        snprintf(cache_control, sizeof(cache_control), "Cache-Control: max-age=%ld\r\n", max_age);
+    }
+
+    const char *vary = varies_by_encoding(mime_type) ? "Vary: Accept-Encoding\r\n" : "";
+    int len = snprintf(buf, cap, "ETag: %s\r\nLast-Modified: %s\r\n%s%s", etag, last_modified,
+                       cache_control, vary);
+    if (len < 0 || (size_t) len >= cap) {
+        fprintf(stderr, "response header too large\n");
+        return -1;
+    }
+    return len;
+}
+
+/*
+ * Render the entity header lines of a file response, through the blank line ending the header
+ * buf: Where to render the lines
+ * cap: The size of buf
+ * file_stat: The file's metadata
+ * mime_type: The file's MIME type, or NULL if unknown
+ * encoded: Nonzero if the body is the gzip variant
+ * content_type: The Content-Type of the body, which differs from mime_type for multipart bodies
+ * content_range: A Content-Range header line for a single range, or ""
+ * content_length: The length of the body
+ * Returns the length rendered, or -1 if the lines do not fit
+ */
+static int render_fields(char *buf, size_t cap, const struct stat *file_stat,
+                         const char *mime_type, int encoded, const char *content_type,
+                         const char *content_range, off_t content_length) {
+    char validators[HEADER_BUFSIZE];
+    if (render_validators(validators, sizeof(validators), file_stat, mime_type, encoded) == -1) {
+        return -1;
+    }
+    int len = snprintf(buf, cap,
+                       "Content-Type: %s\r\n%s%sContent-Length: %ld\r\nAccept-Ranges: bytes\r\n"
+                       "%s\r\n",
+                       content_type, encoded ? "Content-Encoding: gzip\r\n" : "", content_range,
+                       (long) content_length, validators);
+    if (len < 0 || (size_t) len >= cap) {
+        fprintf(stderr, "response header too large\n");
+        return -1;
+    }
+    return len;
+}
+
+/*
+ * Read bytes of a file into memory, without moving its offset
+ * fd: The open file
+ * dst: Where to read the bytes to
+ * len: The number of bytes to read
+ * offset: Where in the file to start reading
+ * Returns 0 on success or -1 on error, including the file ending early
+ */
+static int read_fully(int fd, char *dst, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t num_bytes_read = pread(fd, dst, len, offset);
+        if (num_bytes_read == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("read");
+            return -1;
+        } else if (num_bytes_read == 0) {
+            fprintf(stderr, "read: unexpected end of file\n");
             return -1;
         }
-    } else {    // file exists
-        message = "200 OK";
+        dst += num_bytes_read;
+        offset += num_bytes_read;
+        len -= num_bytes_read;
+    }
+    return 0;
+}
+
+/*
+ * Build the gzip variant of a file and add it to the gzip cache
+ * A sibling file with ".gz" appended to the name is used as is, unless it is older than the file;
+ * otherwise the file is compressed.
+ * resolved: The resolved path of the file
+ * file_stat: The file's metadata, which the variant stays valid for
+ * resource: The open file
+ * mime_type: The file's MIME type
+ * Returns a referenced gzip cache entry, or NULL if the variant could not be built or cached
+ */
+static file_cache_entry_t *build_gzip_variant(const resolved_path_t *resolved,
+                                              const struct stat *file_stat, int resource,
+                                              const char *mime_type) {
+    if (file_stat->st_size == 0 || !file_cache_admits(gzip_cache, file_stat->st_size)) {
+        return NULL;
     }
 
-    if (file_exists) {
-        int resource = open(resource_path, O_RDONLY,
-                            S_IRUSR);    // open file to read, give read permissions to user
-        if (resource == -1) {
-            perror("open");
+    char sibling_path[PATH_MAX];
+    struct stat sibling_stat;
+    int sibling = -1;
+    if (snprintf(sibling_path, sizeof(sibling_path), "%s.gz", resolved->relative) <
+        (int) sizeof(sibling_path)) {
+        sibling = path_cache_open(path_cache, sibling_path);
+    }
+    if (sibling != -1 &&
+        (fstat(sibling, &sibling_stat) == -1 || !S_ISREG(sibling_stat.st_mode) ||
+         sibling_stat.st_size == 0 || !file_cache_admits(gzip_cache, sibling_stat.st_size) ||
+         sibling_stat.st_mtime < file_stat->st_mtime)) {
+        close(sibling);
+        sibling = -1;
+    }
+
+    // Read whichever file supplies the bytes into memory: compressing from a shared mapping would
+    // fault with SIGBUS if the file were truncated meanwhile
+    int source = sibling != -1 ? sibling : resource;
+    size_t source_len = sibling != -1 ? sibling_stat.st_size : file_stat->st_size;
+    char *contents = malloc(source_len);
+    if (contents == NULL) {
+        perror("malloc");
+    }
+    int failed = contents == NULL || read_fully(source, contents, source_len, 0);
+    if (sibling != -1 && close(sibling) == -1) {
+        perror("close");
+    }
+    if (failed) {
+        free(contents);
+        return NULL;
+    }
+
+    const char *data = contents;
+    size_t data_len = source_len;
+    char *compressed = NULL;
+    if (sibling == -1) {
+        compressed = gzip_compress(contents, source_len, &data_len);
+        data = compressed;
+    }
+
+    file_cache_entry_t *entry = NULL;
+    char fields[HEADER_BUFSIZE];
+    int fields_len =
+        render_fields(fields, sizeof(fields), file_stat, mime_type, 1, mime_type, "", data_len);
+    if (data != NULL && fields_len != -1) {
+        entry = file_cache_insert_data(gzip_cache, resolved->path, file_stat, data, data_len,
+                                       fields, fields_len);
+    }
+    free(compressed);
+    free(contents);
+    return entry;
+}
+
+/*
+ * Find the gzip variant of a file in the gzip cache, building it on a miss
+ * resolved: The resolved path of the file
+ * file_stat: The file's current metadata
+ * resource: The open file
+ * mime_type: The file's MIME type
+ * Returns a referenced gzip cache entry, or NULL if the variant is not available
+ */
+static file_cache_entry_t *find_gzip_variant(const resolved_path_t *resolved,
+                                             const struct stat *file_stat, int resource,
+                                             const char *mime_type) {
+    file_cache_entry_t *entry = file_cache_lookup(gzip_cache, resolved->path, file_stat);
+    if (entry == NULL) {
+        entry = build_gzip_variant(resolved, file_stat, resource, mime_type);
+    }
+    return entry;
+}
+
+/*
+ * Send a response's body from a mapping of its file instead of the file itself, so the whole
+ * response goes out in one writev() and every worker shares the same page cache pages
+ * An fd cache entry's shared mapping is reused; otherwise the response maps and closes the file.
+ * On failure the response keeps sending from the file.
+ * response: A response whose body is a non-empty range of an open file, possibly all of it
+ * file_size: The size of the whole file, which is mapped so body_start stays a valid offset
+ */
+static void map_body(http_response_t *response, off_t file_size) {
+    int sequential = response->body_len >= mmap_threshold;
+    if (response->opened != NULL) {
+        // The entry's reference, still held, keeps its mapping alive
+        response->mapped = fd_cache_map(response->opened, sequential);
+        if (response->mapped != NULL) {
+            response->resource = -1;
+        }
+        return;
+    }
+
+    void *map = mmap(NULL, file_size, PROT_READ, MAP_SHARED, response->resource, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return;
+    }
+    // Advice only affects performance, so failures are not errors; it covers the body's pages
+    off_t advice_start = response->body_start & ~((off_t) getpagesize() - 1);
+    size_t advice_len = response->body_start + response->body_len - advice_start;
+    madvise((char *) map + advice_start, advice_len, MADV_WILLNEED);
+    if (sequential) {
+        madvise((char *) map + advice_start, advice_len, MADV_SEQUENTIAL);
+    }
+    release_resource(response);
+    response->mapped = map;
+    response->mapping_len = file_size;
+}
+
+/*
+ * Copy bytes of a file response's body out of the file cache entry or the file holding them
+ * The file is read rather than mapped, since touching a mapping of a file that is truncated
+ * meanwhile raises SIGBUS.
+ * response: A prepared file response that is not mapped yet
+ * offset: Where in the file to start copying
+ * len: The number of bytes to copy
+ * dst: Where to copy them to
+ * Returns 0 on success or -1 on error
+ */
+static int copy_body(const http_response_t *response, off_t offset, size_t len, char *dst) {
+    if (response->cached != NULL) {
+        memcpy(dst, response->cached->data + offset, len);
+        return 0;
+    }
+    return read_fully(response->resource, dst, len, offset);
+}
+
+/*
+ * Turn a file response into a 206 whose body is one range of the file, sent from the same source
+ * request: The request being responded to
+ * file_stat: The file's metadata
+ * mime_type: The file's MIME type
+ * range: The satisfiable range to send
+ * response: The prepared file response, updated in place
+ * Returns 0 on success or -1 on error
+ */
+static int prepare_single_range(const http_request_t *request, const struct stat *file_stat,
+                                const char *mime_type, const http_range_t *range,
+                                http_response_t *response) {
+    char content_range[HEADER_BUFSIZE];
+    snprintf(content_range, sizeof(content_range), "Content-Range: bytes %ld-%ld/%ld\r\n",
+             (long) range->first, (long) range->last, (long) response->body_len);
+    off_t len = range->last - range->first + 1;
+
+    int status_len = snprintf(response->header, sizeof(response->header),
+                              "HTTP/1.%d 206 Partial Content\r\n%s", request->minor_version,
+                              connection_header(request));
+    int fields_len =
+        render_fields(response->header + status_len, sizeof(response->header) - status_len,
+                      file_stat, mime_type, 0, mime_type, content_range, len);
+    if (fields_len == -1) {
+        http_response_release(response);
+        return -1;
+    }
+    response->status = 206;
+    response->header_len = status_len + fields_len;
+    response->body_start = range->first;
+    response->body_len = len;
+    return 0;
+}
+
+/*
+ * Turn a file response into a 206 whose multipart/byteranges body holds several ranges
+ * The body is assembled in memory, so requests whose parts would be too large, or would add up
+ * to more than the whole file, are answered with the whole file instead.
+ * request: The request being responded to
+ * file_stat: The file's metadata
+ * mime_type: The file's MIME type
+ * ranges: The satisfiable ranges to send, in order
+ * n_ranges: The number of ranges
+ * response: The prepared file response, updated in place
+ * Returns 0 on success or -1 on error
+ */
+static int prepare_multiple_ranges(const http_request_t *request, const struct stat *file_stat,
+                                   const char *mime_type, const http_range_t *ranges,
+                                   int n_ranges, http_response_t *response) {
+    static unsigned long n_boundaries = 0;
+    char boundary[MULTIPART_BOUNDARY_BUFSIZE];
+    snprintf(boundary, sizeof(boundary), "%016lx",
+             (unsigned long) time(NULL) ^
+                 __atomic_add_fetch(&n_boundaries, 1, __ATOMIC_RELAXED) * 0x9e3779b97f4a7c15ul);
+
+    // Every part is "\r\n--<boundary>\r\n<part header>\r\n<bytes>", then "\r\n--<boundary>--\r\n"
+    off_t range_bytes = 0;
+    size_t total = 0;
+    for (int i = 0; i < n_ranges; i++) {
+        off_t len = ranges[i].last - ranges[i].first + 1;
+        range_bytes += len;
+        total += snprintf(NULL, 0, PART_HEADER_FORMAT, boundary, mime_type,
+                          (long) ranges[i].first, (long) ranges[i].last,
+                          (long) response->body_len) +
+                 len;
+    }
+    total += snprintf(NULL, 0, "\r\n--%s--\r\n", boundary);
+    if (range_bytes > response->body_len || total > MAX_MULTIPART_BODY) {
+        return 0;
+    }
+
+    char *body = malloc(total + 1);    // sprintf() NUL-terminates the closing delimiter
+    if (body == NULL) {
+        perror("malloc");
+        http_response_release(response);
+        return -1;
+    }
+    size_t len = 0;
+    for (int i = 0; i < n_ranges; i++) {
+        len += sprintf(body + len, PART_HEADER_FORMAT, boundary, mime_type, (long) ranges[i].first,
+                       (long) ranges[i].last, (long) response->body_len);
+        size_t range_len = ranges[i].last - ranges[i].first + 1;
+        if (copy_body(response, ranges[i].first, range_len, body + len)) {
+            free(body);
+            http_response_release(response);
             return -1;
         }
+        len += range_len;
+    }
+    len += sprintf(body + len, "\r\n--%s--\r\n", boundary);
 
-        // Find content type
-        const char *extension = get_file_extension(resource_path);
-        const char *mime_type = get_mime_type(extension);
+    // The parts are copied out, so the file, cache entry or mapping is no longer needed
+    http_response_release(response);
+    response->body = body;
+    response->body_start = 0;
+    response->body_len = len;
 
-        // Find file length
-        char file_size[12];
-        snprintf(file_size, 12, "%d", (unsigned) stat_buf.st_size);    // convert st_size to string
+    char content_type[HEADER_BUFSIZE];
+    snprintf(content_type, sizeof(content_type), "multipart/byteranges; boundary=%s", boundary);
+    int status_len = snprintf(response->header, sizeof(response->header),
+                              "HTTP/1.%d 206 Partial Content\r\n%s", request->minor_version,
+                              connection_header(request));
+    int fields_len =
+        render_fields(response->header + status_len, sizeof(response->header) - status_len,
+                      file_stat, mime_type, 0, content_type, "", len);
+    if (fields_len == -1) {
+        http_response_release(response);
+        return -1;
+    }
+    response->status = 206;
+    response->header_len = status_len + fields_len;
+    return 0;
+}
 
-        // Calculate size of header to write to client
-        int capacity = strlen("HTTP/1.0 \r\nContent-Type: \r\nContent-Length: \r\n\r\n") +
-                       strlen(message) + strlen(mime_type) + strlen(file_size) + 1;
-        char header[capacity];
+/*
+ * Check whether a client's stored copy of a file is still current, so a 304 can replace the body
+ * If-None-Match is compared to the entity tag of the representation the request would get;
+ * If-Modified-Since is only consulted without it.
+ * request: The request being responded to
+ * file_stat: The file's current metadata
+ * encoded: Nonzero if the request would get the gzip variant
+ * Returns nonzero if the file has not been modified
+ */
+static int is_not_modified(const http_request_t *request, const struct stat *file_stat,
+                           int encoded) {
+    const http_slice_t *if_none_match = http_request_header(request, "If-None-Match");
+    if (if_none_match != NULL) {
+        char etag[ETAG_BUFSIZE];
+        render_etag(etag, file_stat, encoded);
+        return http_etag_list_matches(*if_none_match, etag);
+    }
+    const http_slice_t *if_modified_since = http_request_header(request, "If-Modified-Since");
+    if (if_modified_since != NULL) {
+        time_t since = http_parse_date(*if_modified_since);
+        return since != -1 && file_stat->st_mtime <= since;
+    }
+    return 0;
+}
 
-        // Put together header for writing to the client
-        snprintf(header, capacity, "HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %s\r\n\r\n",
-                 message, mime_type, file_size);
+/*
+ * Prepare a body-less 304 response carrying the validators of the representation the client has
+ * request: The request being responded to
+ * file_stat: The file's metadata
+ * mime_type: The file's MIME type
+ * encoded: Nonzero if the client's copy is the gzip variant
+ * response: Filled in with the response; any file it holds already is released
+ * Returns 0 on success or -1 on error
+ */
+static int prepare_not_modified(const http_request_t *request, const struct stat *file_stat,
+                                const char *mime_type, int encoded, http_response_t *response) {
+    char validators[HEADER_BUFSIZE];
+    int validators_len =
+        render_validators(validators, sizeof(validators), file_stat, mime_type, encoded);
+    release_resource(response);
+    if (validators_len == -1) {
+        return -1;
+    }
+    response->status = 304;
+    response->body_len = 0;
+    int header_len = snprintf(response->header, sizeof(response->header),
+                              "HTTP/1.%d 304 Not Modified\r\n%s%s\r\n", request->minor_version,
+                              connection_header(request), validators);
+    if (header_len < 0 || (size_t) header_len >= sizeof(response->header)) {
+        fprintf(stderr, "response header too large\n");
+        return -1;
+    }
+    response->header_len = header_len;
+    return 0;
+}
 
-        // Write header to the client
-        if (write(fd, header, strlen(header)) == -1) {
-            if (errno != ECONNRESET) {
-                // If peer resets on shutdown, do not print error message
-                perror("write");
-            }
-            close(resource);
+/*
+ * Finish a 200 response for a file once its body source is chosen: take the header lines of a
+ * cache entry supplying the body, then narrow the response to any byte ranges the request asks for
+ * request: The request being responded to
+ * resource_path: The path of the file
+ * file_stat: The file's metadata
+ * response: The response, with its status line rendered and any other header lines after it
+ * Returns 0 on success or -1 on error
+ */
+static int complete_file_response(const http_request_t *request, const char *resource_path,
+                                  const struct stat *file_stat, http_response_t *response) {
+    if (response->cached != NULL) {
+        if (response->cached->header_len >= sizeof(response->header) - response->header_len) {
+            fprintf(stderr, "response header too large\n");
+            http_response_release(response);
             return -1;
         }
+        memcpy(response->header + response->header_len, response->cached->header,
+               response->cached->header_len);
+        response->header_len += response->cached->header_len;
+        response->body_len = response->cached->size;
+    }
 
-        // Read the file in chunks and write to the client in chunks
-        int num_bytes_read = 0;
-        char buffer[BUFSIZE];
-        while ((num_bytes_read = read(resource, buffer, BUFSIZE)) > 0) {
-            // Write buffer to client
-            if (write(fd, buffer, num_bytes_read) == -1) {
-                if (errno != ECONNRESET) {
-                    // If peer resets on shutdown, do not print error message
-                    perror("write");
-                }
-                close(resource);
+    const http_slice_t *range_header = http_request_header(request, "Range");
+    if (range_header == NULL) {
+        return 0;
+    }
+    http_range_t ranges[HTTP_MAX_RANGES];
+    int n_ranges = http_parse_range(*range_header, response->body_len, ranges);
+    if (n_ranges == -1) {
+        // A Range header that cannot be honoured is ignored and the whole file sent
+        return 0;
+    } else if (n_ranges == 0) {
+        off_t size = response->body_len;
+        http_response_release(response);
+        response->status = 416;
+        response->body_len = 0;
+        int header_len = snprintf(response->header, sizeof(response->header),
+                                  "HTTP/1.%d 416 Range Not Satisfiable\r\n%s"
+                                  "Content-Range: bytes */%ld\r\nContent-Length: 0\r\n\r\n",
+                                  request->minor_version, connection_header(request), (long) size);
+        if ((size_t) header_len >= sizeof(response->header)) {
+            return -1;
+        }
+        response->header_len = header_len;
+        return 0;
+    }
+
+    const char *mime_type = mime_type_of(resource_path);
+    if (n_ranges == 1) {
+        return prepare_single_range(request, file_stat, mime_type, &ranges[0], response);
+    }
+    return prepare_multiple_ranges(request, file_stat, mime_type, ranges, n_ranges, response);
+}
+
+int prepare_error_response(const http_request_t *request, int status, http_response_t *response) {
+    const char *reason;
+    switch (status) {
+        case 400:
+            reason = "Bad Request";
+            break;
+        case 404:
+            reason = "Not Found";
+            break;
+        default:
+            status = 501;
+            reason = "Not Implemented";
+            break;
+    }
+    response->status = status;
+    response->cached = NULL;
+    response->body = NULL;
+    response->resource = -1;
+    response->opened = NULL;
+    response->mapped = NULL;
+    response->mapping_len = 0;
+    response->body_start = 0;
+    response->body_len = 0;
+    int header_len = snprintf(response->header, sizeof(response->header),
+                              "HTTP/1.%d %d %s\r\n%sContent-Length: 0\r\n\r\n",
+                              request->minor_version, status, reason, connection_header(request));
+    if ((size_t) header_len >= sizeof(response->header)) {
+        return -1;
+    }
+    response->header_len = header_len;
+    return 0;
+}
+
+int prepare_http_response(const http_request_t *request, const resolved_path_t *resource,
+                          http_response_t *response) {
+    response->status = 200;
+    response->header_len = 0;
+    response->cached = NULL;
+    response->body = NULL;
+    response->resource = -1;
+    response->opened = NULL;
+    response->mapped = NULL;
+    response->mapping_len = 0;
+    response->body_start = 0;
+    response->body_len = 0;
+
+    // Paths that climb out of the served directory are answered as if nothing were there
+    if (resource->escapes) {
+        return prepare_error_response(request, 404, response);
+    }
+    const char *resource_path = resource->path;
+
+    // An fd cache hit has the file open already, along with its metadata and header lines
+    struct stat stat_buf;
+    const struct stat *file_stat = &stat_buf;
+    if (fd_cache != NULL) {
+        response->opened = fd_cache_lookup(fd_cache, resource_path);
+    }
+    if (response->opened != NULL) {
+        response->resource = response->opened->fd;
+        file_stat = &response->opened->stat_buf;
+    } else {
+        // Opening first walks the path once; the metadata then comes from the file itself
+        response->resource = path_cache_open(path_cache, resource->relative);
+        if (response->resource == -1) {
+            if (errno != ENOENT && errno != ENOTDIR && errno != ELOOP && errno != EXDEV) {
+                perror("openat2");
                 return -1;
             }
+            // missing, or reached through a symbolic link or from outside the directory
+            return prepare_error_response(request, 404, response);
         }
-        if (num_bytes_read == -1) {    // read error occurred
-            if (errno != ECONNRESET) {
-                // If peer resets on shutdown, do not print error message
-                perror("read");
-            }
-            close(resource);
+        if (fstat(response->resource, &stat_buf) == -1) {
+            perror("fstat");
+            http_response_release(response);
             return -1;
         }
+        if (!S_ISREG(stat_buf.st_mode)) {    // directories and devices are not served
+            release_resource(response);
+            return prepare_error_response(request, 404, response);
+        }
+    }
 
-        // Close resource file
-        if (close(resource) == -1) {
-            if (errno != ECONNRESET) {
-                // If peer resets on shutdown, do not print error message
-                perror("close");
-            }
-            return -1;
+    // Settle the representation first: a file too large for the gzip cache, or one that fails to
+    // compress, goes out as is with the identity validators, so revalidations must use those too
+    const char *mime_type = mime_type_of(resource_path);
+    file_cache_entry_t *variant = NULL;
+    if (wants_gzip(request, mime_type)) {
+        variant = find_gzip_variant(resource, file_stat, response->resource, mime_type);
+    }
+    int encoded = variant != NULL;
+
+    // A revalidation that finds the client's copy current is answered without sending the body
+    if (is_not_modified(request, file_stat, encoded)) {
+        if (variant != NULL) {
+            file_cache_release(variant);
         }
-    } else {    // file does not exist
-        // Calculate size of header to write to client
-        int capacity = strlen("HTTP/1.0 \r\nContent-Length: 0\r\n\r\n") + strlen(message);
-        char header[capacity];
+        return prepare_not_modified(request, file_stat, mime_type, encoded, response);
+    }
 
-        // Put together header for writing to the client
-        snprintf(header, capacity, "HTTP/1.0 %s\r\nContent-Length: 0\r\n\r\n", message);
+    // Status line varies per request; everything after it is a property of the file
+    int status_len = snprintf(response->header, sizeof(response->header), "HTTP/1.%d 200 OK\r\n%s",
+                              request->minor_version, connection_header(request));
+    response->header_len = status_len;
+    response->body_len = file_stat->st_size;
 
-        // Write the response to the client
-        if (write(fd, header, strlen(header)) == -1) {
-            if (errno != ECONNRESET) {
-                // If peer resets on shutdown, do not print error message
-                perror("write");
-            }
+    // The gzip variant, when the client takes it, replaces the file altogether
+    if (variant != NULL) {
+        response->cached = variant;
+        release_resource(response);
+        return complete_file_response(request, resource_path, file_stat, response);
+    }
+
+    // A cache hit supplies the rest of the header and the body from memory
+    if (file_cache != NULL) {
+        response->cached = file_cache_lookup(file_cache, resource_path, file_stat);
+        if (response->cached != NULL) {
+            release_resource(response);
+            return complete_file_response(request, resource_path, file_stat, response);
+        }
+    }
+
+    char *fields = response->header + status_len;
+    size_t fields_cap = sizeof(response->header) - status_len;
+    int fields_len;
+    if (response->opened != NULL) {
+        fields_len = response->opened->header_len;
+        if ((size_t) fields_len >= fields_cap) {
+            fprintf(stderr, "response header too large\n");
+            http_response_release(response);
             return -1;
         }
+        memcpy(fields, response->opened->header, fields_len);
+    } else {
+        // Put together the rest of the header for writing to the client
+        fields_len = render_fields(fields, fields_cap, &stat_buf, mime_type, 0, mime_type, "",
+                                   stat_buf.st_size);
+        if (fields_len == -1) {
+            http_response_release(response);
+            return -1;
+        }
+        if (fd_cache != NULL) {
+            response->opened = fd_cache_insert(fd_cache, resource_path, response->resource,
+                                               &stat_buf, mime_type, fields, fields_len);
+        }
+    }
+
+    if (file_cache != NULL && file_cache_admits(file_cache, file_stat->st_size)) {
+        response->cached =
+            file_cache_insert(file_cache, resource_path, file_stat, response->resource, fields,
+                              fields_len);
+        if (response->cached != NULL) {
+            release_resource(response);
+            return complete_file_response(request, resource_path, file_stat, response);
+        }
+    }
+
+    response->header_len += fields_len;
+    if (complete_file_response(request, resource_path, file_stat, response)) {
+        return -1;
+    }
+    // Mapping waits until the ranges are known: a multipart body has been copied out by now
+    if (response->resource != -1 && response->body_len > 0 &&
+        (transmit_mode == TRANSMIT_MMAP ||
+         (transmit_mode == TRANSMIT_AUTO && response->body_len < mmap_threshold))) {
+        map_body(response, file_stat->st_size);
     }
+    return 0;
+}
 
+int prepare_generated_response(const http_request_t *request, const char *content_type,
+                               char *body, size_t body_len, http_response_t *response) {
+    response->status = 200;
+    response->cached = NULL;
+    response->body = body;
+    response->resource = -1;
+    response->opened = NULL;
+    response->mapped = NULL;
+    response->mapping_len = 0;
+    response->body_start = 0;
+    response->body_len = body_len;
+
+    int header_len =
+        snprintf(response->header, sizeof(response->header),
+                 "HTTP/1.%d 200 OK\r\n%sContent-Type: %s\r\nContent-Length: %zu\r\n\r\n",
+                 request->minor_version, connection_header(request), content_type, body_len);
+    if (header_len < 0 || (size_t) header_len >= sizeof(response->header)) {
+        fprintf(stderr, "response header too large\n");
+        http_response_release(response);
+        return -1;
+    }
+    response->header_len = header_len;
     return 0;
 }
+
+size_t http_response_size(const http_response_t *response) {
+    return response->header_len + response->body_len;
+}
+
+int http_response_iov(const http_response_t *response, struct iovec *iov) {
+    int n = 0;
+    iov[n].iov_base = (void *) response->header;
+    iov[n++].iov_len = response->header_len;
+    const char *body = response->cached != NULL ? response->cached->data
+                       : response->body != NULL ? response->body
+                                                : response->mapped;
+    if (body != NULL) {
+        iov[n].iov_base = (void *) (body + response->body_start);
+        iov[n++].iov_len = response->body_len;
+    }
+    return n;
+}
+
+int http_response_msg_flags(const http_response_t *response) {
+    return MSG_NOSIGNAL | (response->resource != -1 && response->body_len > 0 ? MSG_MORE : 0);
+}
+
+void http_response_drop_body(http_response_t *response) {
+    http_response_release(response);
+    response->body_start = 0;
+    response->body_len = 0;
+}
+
+void http_response_release(http_response_t *response) {
+    if (response->cached != NULL) {
+        file_cache_release(response->cached);
+        response->cached = NULL;
+    }
+    free(response->body);
+    response->body = NULL;
+    if (response->mapping_len > 0 && munmap((void *) response->mapped, response->mapping_len)) {
+        perror("munmap");
+    }
+    response->mapped = NULL;
+    response->mapping_len = 0;
+    release_resource(response);
+}
@@ -3,20 +3,211 @@
 #ifndef HTTP_H
 #define HTTP_H
 
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "fd_cache.h"
+#include "file_cache.h"
+#include "http_parser.h"
+#include "mime.h"
+#include "path_cache.h"
+
+// Large enough for any response header this server renders
+#define HEADER_BUFSIZE 512
+#define HTTP_RESPONSE_IOVS 2
+#define DEFAULT_IO_CHUNK_SIZE 512
+#define MAX_IO_CHUNK_SIZE (16 * 1024 * 1024)
+#define DEFAULT_MMAP_THRESHOLD (1024 * 1024)
+#define DEFAULT_GZIP_CACHE_BYTES (8 * 1024 * 1024)
+#define MAX_AGE_RULES 32
+#define MIME_PATTERN_BUFSIZE 128
+
+// A response ready to transmit: header bytes, then a body from the file cache, a generated
+// buffer, a mapped file or an open file
+// The body is the body_len bytes of its source starting at body_start, which is nonzero only when
+// a single byte range of a file was requested
+typedef struct {
+    int status;                     // HTTP status code
+    char header[HEADER_BUFSIZE];    // the complete header
+    size_t header_len;
+    file_cache_entry_t *cached;    // file contents to send from memory, or NULL
+    char *body;                    // malloc'd body generated by the server, or NULL
+    int resource;                  // open body file to send when not cached, or -1
+    fd_cache_entry_t *opened;      // fd cache entry resource or mapped belongs to, or NULL if owned
+    const char *mapped;            // read-only mapping of the body file, or NULL
+    size_t mapping_len;            // length to unmap on release if mapped is owned, else 0
+    off_t body_start;
+    off_t body_len;
+} http_response_t;
+
+// Strategies for transmitting the body of a response
+typedef enum {
+    TRANSMIT_BUFFERED,    // read()/write() through a user-space buffer
+    TRANSMIT_ZERO_COPY,   // sendfile(), then splice(), falling back to buffered
+    TRANSMIT_MMAP,        // writev() of the header and a mapping of the file, else zero-copy
+    TRANSMIT_AUTO,        // mmap below the mmap threshold, zero-copy from it upwards
+} transmit_mode_t;
+
+// A Cache-Control max-age for file responses whose MIME type matches a pattern
+typedef struct {
+    char pattern[MIME_PATTERN_BUFSIZE];    // "type/subtype", "type/*" or "*", ignoring case
+    long max_age;                          // seconds
+} max_age_rule_t;
+
 /*
- * Read an HTTP request from an active TCP connection socket
- * fd: The socket's file descriptor
- * resource_name: Set to the name of the requested resource on success
+ * Look up a requested resource and prepare the response for it
+ * Small files are served from the file cache set with set_file_cache, if any, and text-like files
+ * gzip-compressed from the gzip cache set with set_gzip_cache to clients that accept it.
+ * Conditional requests whose copy is current get a 304, and Range requests a 206 or 416. Only
+ * regular files below the directory of the cache set with set_path_cache are served; anything
+ * else, including paths through symbolic links, gets a 404.
+ * request: The request being responded to, which sets the protocol version and Connection header
+ * resource: The requested resource, resolved with path_cache_resolve
+ * response: Filled in with the response; must be passed to http_response_release when done
  * Returns 0 on success or -1 on error
  */
-int read_http_request(int fd, char *resource_name);
+int prepare_http_response(const http_request_t *request, const resolved_path_t *resource,
+                          http_response_t *response);
 
 /*
- * Write an HTTP response to an active TCP connection socket
- * fd: The socket's file descriptor
- * resource_path: The path to the requested resource in the server's file system
+ * Prepare a response whose body was generated by the server rather than read from a file
+ * request: The request being responded to, which sets the protocol version and Connection header
+ * content_type: The MIME type of the body
+ * body: A malloc'd body, which the response takes ownership of even on error
+ * body_len: The length of the body
+ * response: Filled in with the response; must be passed to http_response_release when done
  * Returns 0 on success or -1 on error
  */
-int write_http_response(int fd, const char *resource_path);
+int prepare_generated_response(const http_request_t *request, const char *content_type,
+                               char *body, size_t body_len, http_response_t *response);
+
+/*
+ * Prepare a body-less response that reports an error in the request itself
+ * request: The request being responded to, which sets the protocol version and Connection header
+ * status: 400 (Bad Request), 404 (Not Found) or 501 (Not Implemented)
+ * response: Filled in with the response; must be passed to http_response_release when done
+ * Returns 0 on success or -1 on error
+ */
+int prepare_error_response(const http_request_t *request, int status, http_response_t *response);
+
+/*
+ * Get the total number of bytes a prepared response sends, header included
+ * response: The prepared response
+ * Returns the number of bytes
+ */
+size_t http_response_size(const http_response_t *response);
+
+/*
+ * Describe the in-memory part of a response as buffers for writev()
+ * This is the whole response unless response->resource is set, in which case that file's contents
+ * follow.
+ * response: The prepared response
+ * iov: Array of at least HTTP_RESPONSE_IOVS entries to fill
+ * Returns the number of entries filled
+ */
+int http_response_iov(const http_response_t *response, struct iovec *iov);
+
+/*
+ * Get the flags to send the in-memory part of a response with
+ * When a file body follows, MSG_MORE holds back the header's partial segment so the header and
+ * the start of the body leave in the same packet.
+ * response: The prepared response
+ * Returns flags for sendmsg(), including MSG_NOSIGNAL
+ */
+int http_response_msg_flags(const http_response_t *response);
+
+/*
+ * Advance a series of buffers past bytes that have been written
+ * iov: Pointer to the first unwritten buffer, updated in place
+ * iov_count: Pointer to the number of unwritten buffers, updated in place
+ * num_written: The number of bytes just written
+ */
+void http_iov_advance(struct iovec **iov, int *iov_count, size_t num_written);
+
+/*
+ * Turn a prepared response into the answer to a HEAD request: the same header, without a body
+ * response: The prepared response, whose body source is released
+ */
+void http_response_drop_body(http_response_t *response);
+
+/*
+ * Release the file, cache entry and generated body held by a prepared response
+ * response: The response to release
+ */
+void http_response_release(http_response_t *response);
+
+/*
+ * Send as much of a response body as a non-blocking socket will take without waiting
+ * fd: The socket's file descriptor
+ * resource: The open file holding the body
+ * offset: The file offset to resume from, advanced past every byte sent
+ * end: The file offset at which the body ends
+ * Returns 0 once the whole body is sent, 1 if the socket is full, or -1 on error
+ */
+int send_http_body(int fd, int resource, off_t *offset, off_t end);
+
+/*
+ * Select how responses transmit bodies that are not in the file cache
+ * Auto is the default. Zero-copy falls back to the buffered loop on its own whenever the kernel
+ * cannot sendfile()/splice() between the resource and the socket, and mmap falls back to
+ * zero-copy whenever a file cannot be mapped.
+ * mode: The transmit mode used for all subsequent responses
+ */
+void set_transmit_mode(transmit_mode_t mode);
+
+/*
+ * Set the body size from which auto mode sends files with sendfile() rather than from a mapping
+ * Mappings at least this large are also read ahead sequentially.
+ * threshold: The size in bytes
+ */
+void set_mmap_threshold(off_t threshold);
+
+/*
+ * Set how many bytes of a file are read at a time when a body is copied through user space
+ * size: The chunk size, between 1 and MAX_IO_CHUNK_SIZE
+ */
+void set_io_chunk_size(size_t size);
+
+/*
+ * Resolve and open requested resources beneath the directory a path cache was opened on
+ * cache: The cache to use for all subsequent responses, which must be set before any is prepared
+ */
+void set_path_cache(path_cache_t *cache);
+
+/*
+ * Keep files open between requests instead of looking up and opening their paths every time
+ * cache: The cache to use for all subsequent responses, or NULL to always open files
+ */
+void set_fd_cache(fd_cache_t *cache);
+
+/*
+ * Serve small files from an in-memory cache
+ * cache: The cache to use for all subsequent responses, or NULL to always read from disk
+ */
+void set_file_cache(file_cache_t *cache);
+
+/*
+ * Look up the Content-Type of files by their extensions in a table
+ * Files whose extension the table lacks, or every file if there is no table, are served as
+ * DEFAULT_MIME_TYPE.
+ * table: The table to use for all subsequent responses, which must outlive the fd cache, or NULL
+ */
+void set_mime_table(const mime_table_t *table);
+
+/*
+ * Set the Cache-Control max-age sent with each MIME type
+ * Types no rule matches get no Cache-Control header. The most specific matching rule applies.
+ * rules: The rules, which are copied
+ * n_rules: The number of rules, at most MAX_AGE_RULES
+ */
+void set_max_age_rules(const max_age_rule_t *rules, int n_rules);
+
+/*
+ * Serve text-like files gzip-compressed to clients that accept it
+ * Each file's compressed copy, or its precompressed ".gz" sibling, is kept in the given cache.
+ * cache: The cache to use for all subsequent responses, or NULL to never compress
+ */
+void set_gzip_cache(file_cache_t *cache);
 
 #endif    // HTTP_H
@@ -0,0 +1,460 @@
+#include "http_connection.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+static int idle_timeout_ms = DEFAULT_IDLE_TIMEOUT_MS;
+static int max_requests = DEFAULT_MAX_REQUESTS;
+static int header_timeout_ms = DEFAULT_HEADER_TIMEOUT_MS;
+static int send_timeout_ms = DEFAULT_SEND_TIMEOUT_MS;
+
+void http_connection_set_keep_alive(int timeout_ms, int requests) {
+    idle_timeout_ms = timeout_ms;
+    max_requests = requests;
+}
+
+void http_connection_set_timeouts(int header_ms, int send_ms) {
+    header_timeout_ms = header_ms;
+    send_timeout_ms = send_ms;
+}
+
+int http_connection_draining(const http_connection_t *conn) {
+    return __atomic_load_n(conn->draining, __ATOMIC_RELAXED);
+}
+
+void http_connection_arm_deadline(conn_deadline_t *deadline, timeout_phase_t phase,
+                                  long long now_ns) {
+    int timeout_ms;
+    switch (phase) {
+        case TIMEOUT_IDLE:
+            timeout_ms = idle_timeout_ms;
+            break;
+        case TIMEOUT_HEADER:
+            timeout_ms = header_timeout_ms;
+            break;
+        case TIMEOUT_SEND:
+            timeout_ms = send_timeout_ms;
+            break;
+        default:
+            timeout_ms = 0;
+            break;
+    }
+    deadline->phase = timeout_ms > 0 ? phase : TIMEOUT_NONE;
+    deadline->deadline_ns = now_ns + timeout_ms * 1000000LL;
+}
+
+int http_connection_deadline_timeout(const conn_deadline_t *deadline, long long now_ns) {
+    if (deadline->phase == TIMEOUT_NONE) {
+        return -1;
+    } else if (now_ns >= deadline->deadline_ns) {
+        return 0;
+    }
+    return (deadline->deadline_ns - now_ns + 999999) / 1000000;
+}
+
+void http_connection_count_timeout(const conn_deadline_t *deadline) {
+    switch (deadline->phase) {
+        case TIMEOUT_IDLE:
+            metrics_add(COUNTER_TIMEOUT_IDLE, 1);
+            break;
+        case TIMEOUT_HEADER:
+            metrics_add(COUNTER_TIMEOUT_HEADER, 1);
+            break;
+        case TIMEOUT_SEND:
+            metrics_add(COUNTER_TIMEOUT_SEND, 1);
+            break;
+        default:
+            break;
+    }
+}
+
+void http_connection_init(http_connection_t *conn, int fd, path_cache_t *paths,
+                          const int *draining) {
+    conn->fd = fd;
+    conn->state = CONN_READING_REQUEST;
+    conn->paths = paths;
+    conn->draining = draining;
+    conn->request_len = 0;
+    conn->request_consumed = 0;
+    http_parser_init(&conn->parser);
+    arena_init(&conn->arena);
+    conn->keep_alive = 0;
+    conn->requests_served = 0;
+    conn->request_start_ns = 0;
+    // The first request gets the header timeout from the moment the client connects
+    http_connection_arm_deadline(&conn->deadline, TIMEOUT_HEADER, metrics_now_ns());
+    conn->response.cached = NULL;
+    conn->response.body = NULL;
+    conn->response.resource = -1;
+    conn->response.opened = NULL;
+    conn->response.mapped = NULL;
+    conn->response.mapping_len = 0;
+    conn->iov_left = 0;
+    conn->body_offset = 0;
+}
+
+/*
+ * Apply the keep-alive settings to a request, clearing its keep_alive flag if the connection
+ * must close after the response
+ * conn: The connection, whose requests_served counts this request
+ * request: The parsed request
+ */
+static void limit_keep_alive(const http_connection_t *conn, http_request_t *request) {
+    // Stop honoring keep-alive once the connection has used up its request budget, or its engine
+    // is draining its connections
+    if (idle_timeout_ms == 0 || conn->requests_served >= max_requests ||
+        http_connection_draining(conn)) {
+        request->keep_alive = 0;
+    }
+}
+
+/*
+ * Check that a request is one this server answers, and that the connection can carry on after it
+ * Request bodies are never parsed: the caller skips a body that fits in the receive buffer, and
+ * closes the connection after the response otherwise.
+ * request: The parsed request, whose keep_alive flag is cleared if the connection must close
+ * body_len: Set to the length of the request body, or more than REQUEST_BUFSIZE if it is larger
+ * Returns 0 if the request can be answered, or the status of the error response it gets instead
+ */
+static int check_request(http_request_t *request, size_t *body_len) {
+    *body_len = 0;
+    int have_length = 0;
+    for (int i = 0; i < request->n_headers; i++) {
+        const http_header_t *header = &request->headers[i];
+        if (header->name.len == strlen("Transfer-Encoding") &&
+            strncasecmp(header->name.data, "Transfer-Encoding", header->name.len) == 0) {
+            // Where a chunked body ends is never worked out, so nothing after it can be trusted
+            request->keep_alive = 0;
+            return 501;
+        } else if (header->name.len != strlen("Content-Length") ||
+                   strncasecmp(header->name.data, "Content-Length", header->name.len) != 0) {
+            continue;
+        }
+        // Only a plain decimal length can be trusted to say where the request ends; it stops
+        // growing once it is too large to skip, so it cannot overflow
+        size_t digits = 0;
+        size_t length = 0;
+        while (digits < header->value.len && header->value.data[digits] >= '0' &&
+               header->value.data[digits] <= '9') {
+            if (length <= REQUEST_BUFSIZE) {
+                length = length * 10 + (header->value.data[digits] - '0');
+            }
+            digits++;
+        }
+        if (digits == 0 || digits != header->value.len || (have_length && length != *body_len)) {
+            *body_len = 0;
+            request->keep_alive = 0;
+            return 400;
+        }
+        *body_len = length;
+        have_length = 1;
+    }
+
+    if (!http_slice_equals(request->method, "GET") && !http_slice_equals(request->method, "HEAD")) {
+        request->keep_alive = 0;
+        return 501;
+    }
+    return 0;
+}
+
+/*
+ * Prepare the response to a parsed request
+ * METRICS_PATH is answered with the server's metrics, any other path from the file system.
+ * paths: The cache of paths resolved beneath the served directory
+ * request: The parsed request
+ * arena: The connection's arena, which holds per-request state until the response is sent
+ * response: Filled in with the response; must be passed to http_response_release when done
+ * Returns 0 on success or -1 on error
+ */
+static int prepare_response(path_cache_t *paths, const http_request_t *request, arena_t *arena,
+                            http_response_t *response) {
+    if (http_slice_equals(request->path, METRICS_PATH)) {
+        size_t body_len;
+        char *body = metrics_render(&body_len);
+        if (body == NULL) {
+            return -1;
+        }
+        return prepare_generated_response(request, "text/plain; version=0.0.4", body, body_len,
+                                          response);
+    }
+
+    const resolved_path_t *resource =
+        path_cache_resolve(paths, request->path.data, request->path.len, arena);
+    if (resource == NULL) {
+        // error message printed in path_cache_resolve()
+        return -1;
+    }
+    return prepare_http_response(request, resource, response);
+}
+
+void http_connection_received(http_connection_t *conn, size_t len) {
+    if (conn->request_len == 0) {
+        conn->request_start_ns = metrics_now_ns();
+        // The deadline is set once per request, so trickling bytes in does not extend it
+        if (conn->deadline.phase == TIMEOUT_IDLE) {
+            http_connection_arm_deadline(&conn->deadline, TIMEOUT_HEADER, conn->request_start_ns);
+        }
+    }
+    conn->request_len += len;
+}
+
+/*
+ * Parse the next request from the bytes already received, then look up the resource and render
+ * the response header
+ * conn: A pointer to the http_connection_t in the CONN_READING_REQUEST state
+ * Returns CONN_WANT_READ if more bytes are needed, CONN_WANT_WRITE once the response is ready, or
+ * CONN_ERROR on error
+ */
+static conn_status_t start_response(http_connection_t *conn) {
+    http_request_t *request = &conn->parsed;
+    int request_len = http_parser_execute(&conn->parser, conn->request, conn->request_len, request);
+    if (request_len == 0) {
+        if (conn->request_len == REQUEST_BUFSIZE) {
+            fprintf(stderr, "request header too large\n");
+            return CONN_ERROR;
+        }
+        return CONN_WANT_READ;
+    } else if (request_len == -1) {
+        return CONN_ERROR;
+    }
+
+    size_t body_len;
+    int error_status = check_request(request, &body_len);
+    // A body that fits in the receive buffer is read along with the request and skipped, so it is
+    // neither parsed as the next request nor reset by closing the socket before it arrives
+    if (body_len <= REQUEST_BUFSIZE - (size_t) request_len) {
+        if (conn->request_len < request_len + body_len) {
+            return CONN_WANT_READ;
+        }
+        request_len += body_len;
+    } else {
+        request->keep_alive = 0;
+    }
+    conn->request_consumed = request_len;
+    long long parsed_ns = metrics_now_ns();
+    metrics_record(STAGE_READ_REQUEST, parsed_ns - conn->request_start_ns);
+
+    conn->requests_served++;
+    limit_keep_alive(conn, request);
+    conn->keep_alive = request->keep_alive;
+
+    if (error_status != 0 ? prepare_error_response(request, error_status, &conn->response)
+                          : prepare_response(conn->paths, request, &conn->arena, &conn->response)) {
+        return CONN_ERROR;
+    }
+    // A HEAD request gets the header a GET would, without the body
+    if (http_slice_equals(request->method, "HEAD")) {
+        http_response_drop_body(&conn->response);
+    }
+    conn->send_start_ns = metrics_now_ns();
+    metrics_record(STAGE_LOOKUP, conn->send_start_ns - parsed_ns);
+    http_connection_arm_deadline(&conn->deadline, TIMEOUT_SEND, conn->send_start_ns);
+    conn->iov_next = conn->iov;
+    conn->iov_left = http_response_iov(&conn->response, conn->iov);
+    conn->body_offset = conn->response.body_start;
+    conn->state = CONN_SENDING_HEADER;
+
+    return CONN_WANT_WRITE;
+}
+
+/*
+ * Parse the next request from the bytes already received, reading more as they become available,
+ * then look up the resource and render the response header
+ * conn: A pointer to the http_connection_t in the CONN_READING_REQUEST state
+ * Returns CONN_WANT_READ if more bytes are needed, CONN_WANT_WRITE once the response is ready,
+ * CONN_DONE if the peer hung up, or CONN_ERROR on error
+ */
+static conn_status_t read_request(http_connection_t *conn) {
+    conn_status_t status = start_response(conn);
+    while (status == CONN_WANT_READ) {
+        ssize_t num_bytes_read = read(conn->fd, conn->request + conn->request_len,
+                                      REQUEST_BUFSIZE - conn->request_len);
+        if (num_bytes_read == -1) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return CONN_WANT_READ;
+            } else if (errno != ECONNRESET) {
+                perror("read");
+            }
+            return CONN_ERROR;
+        } else if (num_bytes_read == 0) {    // peer closed the connection
+            return CONN_DONE;
+        }
+        http_connection_received(conn, num_bytes_read);
+        status = start_response(conn);
+    }
+    return status;
+}
+
+/*
+ * Drop the request that was just answered from the receive buffer and get ready for the next
+ * conn: A pointer to the http_connection_t whose response has been fully sent
+ */
+static void finish_request(http_connection_t *conn) {
+    conn->request_len -= conn->request_consumed;
+    memmove(conn->request, conn->request + conn->request_consumed, conn->request_len);
+    conn->request_consumed = 0;
+    http_parser_init(&conn->parser);
+    arena_reset(&conn->arena);
+    conn->state = CONN_READING_REQUEST;
+    // A pipelined request has already arrived, so its clocks start now
+    long long now_ns = metrics_now_ns();
+    conn->request_start_ns = conn->request_len > 0 ? now_ns : 0;
+    http_connection_arm_deadline(&conn->deadline,
+                                 conn->request_len > 0 ? TIMEOUT_HEADER : TIMEOUT_IDLE, now_ns);
+}
+
+/*
+ * Write as much of the in-memory part of the response as the socket will take
+ * The send deadline restarts if the socket fills up after taking some of it.
+ * conn: A pointer to the http_connection_t in the CONN_SENDING_HEADER state
+ * Returns CONN_WANT_WRITE if the socket filled up, CONN_DONE once it is all sent, or
+ * CONN_ERROR on error
+ */
+static conn_status_t send_header(http_connection_t *conn) {
+    int progressed = 0;
+    while (conn->iov_left > 0) {
+        struct msghdr msg = {.msg_iov = conn->iov_next, .msg_iovlen = conn->iov_left};
+        ssize_t num_written = sendmsg(conn->fd, &msg, http_response_msg_flags(&conn->response));
+        if (num_written == -1) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (progressed) {
+                    http_connection_arm_deadline(&conn->deadline, TIMEOUT_SEND, metrics_now_ns());
+                }
+                return CONN_WANT_WRITE;
+            } else if (errno != ECONNRESET && errno != EPIPE) {
+                perror("sendmsg");
+            }
+            return CONN_ERROR;
+        }
+        http_iov_advance(&conn->iov_next, &conn->iov_left, num_written);
+        progressed = 1;
+    }
+
+    return CONN_DONE;
+}
+
+/*
+ * Record a fully sent response and move on to the next request, if the connection stays open
+ * conn: A pointer to the http_connection_t in the CONN_FINISHED state
+ * Returns 0 if the connection goes on to its next request, or 1 if it should be closed
+ */
+static int finish_response(http_connection_t *conn) {
+    long long finished_ns = metrics_now_ns();
+    metrics_record(STAGE_SEND_RESPONSE, finished_ns - conn->send_start_ns);
+    metrics_record(STAGE_REQUEST, finished_ns - conn->request_start_ns);
+    metrics_count_response(conn->response.status, http_response_size(&conn->response));
+    http_response_release(&conn->response);
+    if (!conn->keep_alive) {
+        return 1;
+    }
+    finish_request(conn);
+    // A draining server answers requests that already arrived, but waits for no more
+    return conn->request_len == 0 && http_connection_draining(conn);
+}
+
+conn_status_t http_connection_advance(http_connection_t *conn) {
+    while (1) {
+        conn_status_t status;
+        switch (conn->state) {
+            case CONN_READING_REQUEST:
+                status = read_request(conn);
+                if (status != CONN_WANT_WRITE) {
+                    return status;
+                }
+                break;
+
+            case CONN_SENDING_HEADER:
+                status = send_header(conn);
+                if (status != CONN_DONE) {
+                    return status;
+                }
+                conn->state =
+                    conn->response.resource == -1 ? CONN_FINISHED : CONN_SENDING_BODY;
+                break;
+
+            case CONN_SENDING_BODY: {
+                off_t sent_offset = conn->body_offset;
+                int result = send_http_body(
+                    conn->fd, conn->response.resource, &conn->body_offset,
+                    conn->response.body_start + conn->response.body_len);
+                if (result == 1) {
+                    if (conn->body_offset != sent_offset) {
+                        http_connection_arm_deadline(&conn->deadline, TIMEOUT_SEND,
+                                                     metrics_now_ns());
+                    }
+                    return CONN_WANT_WRITE;
+                } else if (result == -1) {
+                    return CONN_ERROR;
+                }
+                conn->state = CONN_FINISHED;
+                break;
+            }
+
+            case CONN_FINISHED:
+                if (finish_response(conn)) {
+                    return CONN_DONE;
+                }
+                break;
+        }
+    }
+}
+
+conn_status_t http_connection_process(http_connection_t *conn) {
+    while (1) {
+        switch (conn->state) {
+            case CONN_READING_REQUEST:
+                return start_response(conn);
+
+            case CONN_SENDING_HEADER:
+            case CONN_SENDING_BODY:
+                return CONN_WANT_WRITE;
+
+            case CONN_FINISHED:
+                if (finish_response(conn)) {
+                    return CONN_DONE;
+                }
+                break;
+        }
+    }
+}
+
+void http_connection_sent(http_connection_t *conn, size_t len) {
+    if (conn->state == CONN_SENDING_HEADER) {
+        http_iov_advance(&conn->iov_next, &conn->iov_left, len);
+        if (conn->iov_left == 0) {
+            conn->state = conn->response.resource == -1 ? CONN_FINISHED : CONN_SENDING_BODY;
+        }
+    } else {
+        conn->body_offset += len;
+    }
+    if (conn->state == CONN_SENDING_BODY &&
+        conn->body_offset == conn->response.body_start + conn->response.body_len) {
+        conn->state = CONN_FINISHED;
+    }
+    if (len > 0 && conn->state != CONN_FINISHED) {
+        http_connection_arm_deadline(&conn->deadline, TIMEOUT_SEND, metrics_now_ns());
+    }
+}
+
+int http_connection_close(http_connection_t *conn) {
+    int result = 0;
+    http_response_release(&conn->response);
+    arena_free(&conn->arena);
+    if (conn->fd != -1 && close(conn->fd) == -1) {
+        perror("close");
+        result = -1;
+    }
+    conn->fd = -1;
+    return result;
+}
@@ -0,0 +1,178 @@
+#ifndef HTTP_CONNECTION_H
+#define HTTP_CONNECTION_H
+
+#include <sys/types.h>
+
+#include "arena.h"
+#include "http.h"
+
+#define REQUEST_BUFSIZE 2048
+#define DEFAULT_IDLE_TIMEOUT_MS 5000
+#define DEFAULT_HEADER_TIMEOUT_MS 10000
+#define DEFAULT_SEND_TIMEOUT_MS 30000
+#define DEFAULT_MAX_REQUESTS 100
+
+// Stages a connection moves through while serving a request
+typedef enum {
+    CONN_READING_REQUEST,
+    CONN_SENDING_HEADER,    // header, plus the body when it comes from the file cache
+    CONN_SENDING_BODY,      // body streamed from an open file
+    CONN_FINISHED,
+} conn_state_t;
+
+// What a connection needs before it can make further progress
+typedef enum {
+    CONN_ERROR = -1,
+    CONN_WANT_READ,
+    CONN_WANT_WRITE,
+    CONN_DONE,
+} conn_status_t;
+
+// What a connection is waiting for, each with its own timeout
+typedef enum {
+    TIMEOUT_NONE,      // no deadline applies
+    TIMEOUT_IDLE,      // the first byte of the next request on a persistent connection
+    TIMEOUT_HEADER,    // the rest of a request whose first byte has arrived
+    TIMEOUT_SEND,      // the client to make room for more of the response
+} timeout_phase_t;
+
+// When a connection is closed unless it makes progress first
+typedef struct {
+    timeout_phase_t phase;
+    long long deadline_ns;    // on the metrics_now_ns() clock
+} conn_deadline_t;
+
+// Struct holding everything needed to resume serving a client on a non-blocking socket
+// An engine either lets http_connection_advance do the I/O on fd, or does it itself and reports
+// each completion with http_connection_received or http_connection_sent.
+typedef struct {
+    int fd;    // the client's socket, or -1 if the engine does the I/O
+    conn_state_t state;
+    path_cache_t *paths;    // resolves request paths beneath the served directory
+    const int *draining;    // set by the engine when it stops accepting to let connections finish
+
+    // Bytes received but not yet consumed; pipelined requests queue up here
+    char request[REQUEST_BUFSIZE];
+    size_t request_len;
+    size_t request_consumed;    // length of the request currently being answered
+    http_parser_t parser;       // progress parsing the request at the front of the buffer
+    http_request_t parsed;      // the request being parsed or answered, pointing into request
+    arena_t arena;              // state of the request being answered, freed after its response
+    int keep_alive;             // whether to wait for another request after this response
+    int requests_served;
+    long long request_start_ns;    // when the first byte of the current request arrived, or 0
+    long long send_start_ns;       // when the response started being sent
+    conn_deadline_t deadline;
+
+    http_response_t response;
+    struct iovec iov[HTTP_RESPONSE_IOVS];    // unsent in-memory part of the response
+    struct iovec *iov_next;
+    int iov_left;
+    off_t body_offset;    // progress through response.resource
+} http_connection_t;
+
+/*
+ * Configure persistent connections for all connections
+ * idle_timeout_ms: How long a connection may wait for its next request, or 0 to disable keep-alive
+ * max_requests: The number of requests served on one connection before it is closed
+ */
+void http_connection_set_keep_alive(int idle_timeout_ms, int max_requests);
+
+/*
+ * Configure the deadlines of all connections
+ * Together with the idle timeout, these bound how long any client can hold a connection without
+ * making progress: a request must arrive in full within the header timeout of its first byte,
+ * however slowly it trickles in, and a response must not stall for the send timeout.
+ * header_timeout_ms: How long a request may take to arrive, or 0 for no limit
+ * send_timeout_ms: How long sending a response may go without progress, or 0 for no limit
+ */
+void http_connection_set_timeouts(int header_timeout_ms, int send_timeout_ms);
+
+/*
+ * Check whether a connection's engine is draining it, so that it closes once it has answered the
+ * requests already received from it
+ * Responses sent while draining carry Connection: close.
+ * conn: The connection
+ * Returns 1 if it is draining, or 0 otherwise
+ */
+int http_connection_draining(const http_connection_t *conn);
+
+/*
+ * Start the deadline of a phase, or clear the deadline if the phase has no timeout
+ * deadline: The connection's deadline
+ * phase: What the connection is now waiting for
+ * now_ns: The current time on the metrics_now_ns() clock
+ */
+void http_connection_arm_deadline(conn_deadline_t *deadline, timeout_phase_t phase,
+                                  long long now_ns);
+
+/*
+ * Get how long a connection can still wait before its deadline passes
+ * deadline: The connection's deadline
+ * now_ns: The current time on the metrics_now_ns() clock
+ * Returns a timeout in milliseconds for poll()-like calls, rounded up, 0 if the deadline has
+ * passed, or -1 if there is none
+ */
+int http_connection_deadline_timeout(const conn_deadline_t *deadline, long long now_ns);
+
+/*
+ * Count a connection that is being closed because its deadline passed
+ * deadline: The connection's expired deadline
+ */
+void http_connection_count_timeout(const conn_deadline_t *deadline);
+
+/*
+ * Initialize a connection for a freshly accepted client
+ * conn: Pointer to http_connection_t to be initialized
+ * fd: The client's non-blocking socket file descriptor, or -1 if the engine does the I/O
+ * paths: The cache of paths resolved beneath the served directory
+ * draining: The engine's flag, set to nonzero once the engine drains its connections; read
+ *           without locking, so it must outlive the connection
+ */
+void http_connection_init(http_connection_t *conn, int fd, path_cache_t *paths,
+                          const int *draining);
+
+/*
+ * Make as much progress on a connection as its socket allows without blocking
+ * After a response on a persistent connection it moves on to the next pipelined request, if any.
+ * conn->deadline is updated to match whatever the connection is left waiting for.
+ * conn: A pointer to the http_connection_t to advance
+ * Returns CONN_WANT_READ or CONN_WANT_WRITE if the socket must become ready first, CONN_DONE
+ * once the final response has been sent or the peer hung up, or CONN_ERROR on error
+ */
+conn_status_t http_connection_advance(http_connection_t *conn);
+
+/*
+ * Make as much progress on a connection as the bytes already received allow, without any I/O
+ * Like http_connection_advance, it answers pipelined requests and updates conn->deadline.
+ * conn: A pointer to the http_connection_t to advance, whose fd is not used
+ * Returns CONN_WANT_READ if more of the request must be received into the free space after
+ * request + request_len, CONN_WANT_WRITE if more of the response must be sent (the iov_left
+ * iovecs at iov_next in CONN_SENDING_HEADER, or response.resource from body_offset to the end of
+ * the body in CONN_SENDING_BODY), CONN_DONE once the final response has been sent, or CONN_ERROR
+ * on error
+ */
+conn_status_t http_connection_process(http_connection_t *conn);
+
+/*
+ * Record bytes received for a connection driven with http_connection_process
+ * conn: A pointer to the http_connection_t that was waiting for a request
+ * len: The number of bytes written into the free space after request + request_len
+ */
+void http_connection_received(http_connection_t *conn, size_t len);
+
+/*
+ * Record part of the response sent for a connection driven with http_connection_process
+ * conn: A pointer to the http_connection_t whose response is being sent
+ * len: The number of bytes sent from the iovecs at iov_next, or of the body from body_offset
+ */
+void http_connection_sent(http_connection_t *conn, size_t len);
+
+/*
+ * Release the resources held by a connection, including its socket if it has one
+ * conn: A pointer to the http_connection_t to close
+ * Returns 0 on success or -1 on error
+ */
+int http_connection_close(http_connection_t *conn);
+
+#endif    // HTTP_CONNECTION_H
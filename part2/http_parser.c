@@ -0,0 +1,444 @@
+#define _GNU_SOURCE
+
+#include "http_parser.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define OFF_MAX INT64_MAX
+_Static_assert(sizeof(off_t) == sizeof(int64_t), "range offsets assume a 64-bit off_t");
+
+/*
+ * Find the first occurrence of a byte, 16 bytes at a time where SSE2 is available
+ * start: The first byte to search
+ * end: One past the last byte to search
+ * c: The byte to find
+ * Returns a pointer to the byte, or NULL if it does not occur
+ */
+static const char *find_byte(const char *start, const char *end, char c) {
+#ifdef __SSE2__
+    const __m128i needle = _mm_set1_epi8(c);
+    while (end - start >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) start);
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+        if (mask != 0) {
+            return start + __builtin_ctz(mask);
+        }
+        start += 16;
+    }
+#endif
+    return memchr(start, c, end - start);
+}
+
+/*
+ * Check whether a byte may appear in a method or header name (an RFC 9110 token)
+ */
+static int is_token_char(unsigned char c) {
+    return c > ' ' && c < 0x7f && strchr("\"(),/:;<=>?@[\\]{}", c) == NULL;
+}
+
+static int is_token(const char *start, size_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (!is_token_char(start[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Decide from a request's Connection header whether the client wants the connection kept open
+ * value: The header value, a comma-separated list of tokens
+ * keep_alive: Updated if the value contains a "close" or "keep-alive" token
+ */
+static void parse_connection_header(http_slice_t value, int *keep_alive) {
+    const char *token = value.data;
+    size_t len = value.len;
+    while (len > 0) {
+        while (len > 0 && (*token == ' ' || *token == '\t' || *token == ',')) {
+            token++;
+            len--;
+        }
+        size_t token_len = 0;
+        while (token_len < len && token[token_len] != ',' && token[token_len] != ' ' &&
+               token[token_len] != '\t') {
+            token_len++;
+        }
+        if (token_len == strlen("close") && strncasecmp(token, "close", token_len) == 0) {
+            *keep_alive = 0;
+        } else if (token_len == strlen("keep-alive") &&
+                   strncasecmp(token, "keep-alive", token_len) == 0) {
+            *keep_alive = 1;
+        }
+        token += token_len;
+        len -= token_len;
+    }
+}
+
+/*
+ * Split a request line "<method> <target> HTTP/1.<minor>" into the request
+ * Returns 0 on success or -1 if malformed
+ */
+static int parse_request_line(const char *line, size_t len, http_request_t *request) {
+    const char *end = line + len;
+    const char *target = find_byte(line, end, ' ');
+    if (target == NULL || !is_token(line, target - line)) {
+        fprintf(stderr, "malformed request line\n");
+        return -1;
+    }
+    request->method.data = line;
+    request->method.len = target - line;
+
+    target++;
+    const char *target_end = find_byte(target, end, ' ');
+    if (target_end == NULL || target_end == target) {
+        fprintf(stderr, "malformed request line\n");
+        return -1;
+    }
+    for (const char *c = target; c < target_end; c++) {
+        if ((unsigned char) *c <= ' ' || *c == 0x7f) {
+            fprintf(stderr, "malformed request target\n");
+            return -1;
+        }
+    }
+    request->target.data = target;
+    request->target.len = target_end - target;
+    const char *query = find_byte(target, target_end, '?');
+    request->path.data = target;
+    request->path.len = (query != NULL ? query : target_end) - target;
+
+    const char *version = target_end + 1;
+    if (end - version != strlen("HTTP/1.x") || strncmp(version, "HTTP/1.", 7) != 0 ||
+        (version[7] != '0' && version[7] != '1')) {
+        fprintf(stderr, "unsupported HTTP version\n");
+        return -1;
+    }
+    request->minor_version = version[7] - '0';
+    // HTTP/1.1 connections persist by default, HTTP/1.0 ones only when asked to
+    request->keep_alive = request->minor_version == 1;
+    request->n_headers = 0;
+    return 0;
+}
+
+/*
+ * Split a header line "<name>:<whitespace><value><whitespace>" into the next header slot
+ * Returns 0 on success or -1 if malformed or there are too many headers
+ */
+static int parse_header_line(const char *line, size_t len, http_request_t *request) {
+    const char *end = line + len;
+    const char *colon = find_byte(line, end, ':');
+    // A name must be a token, which also rules out obsolete folded continuation lines
+    if (colon == NULL || !is_token(line, colon - line)) {
+        fprintf(stderr, "malformed header line\n");
+        return -1;
+    }
+    if (request->n_headers == HTTP_MAX_HEADERS) {
+        fprintf(stderr, "too many request headers\n");
+        return -1;
+    }
+
+    const char *value = colon + 1;
+    while (value < end && (*value == ' ' || *value == '\t')) {
+        value++;
+    }
+    while (end > value && (end[-1] == ' ' || end[-1] == '\t')) {
+        end--;
+    }
+    http_header_t *header = &request->headers[request->n_headers++];
+    header->name.data = line;
+    header->name.len = colon - line;
+    header->value.data = value;
+    header->value.len = end - value;
+
+    if (header->name.len == strlen("Connection") &&
+        strncasecmp(line, "Connection", header->name.len) == 0) {
+        parse_connection_header(header->value, &request->keep_alive);
+    }
+    return 0;
+}
+
+void http_parser_init(http_parser_t *parser) {
+    parser->state = PARSE_REQUEST_LINE;
+    parser->line_start = 0;
+    parser->scanned = 0;
+}
+
+int http_parser_execute(http_parser_t *parser, const char *buf, size_t len,
+                        http_request_t *request) {
+    while (parser->state != PARSE_DONE) {
+        const char *newline = find_byte(buf + parser->scanned, buf + len, '\n');
+        if (newline == NULL) {
+            parser->scanned = len;
+            return 0;
+        }
+
+        // Every line must end in CRLF
+        const char *line = buf + parser->line_start;
+        if (newline == line || newline[-1] != '\r') {
+            fprintf(stderr, "request line not terminated by CRLF\n");
+            return -1;
+        }
+        size_t line_len = newline - 1 - line;
+        parser->line_start = parser->scanned = newline + 1 - buf;
+
+        if (parser->state == PARSE_REQUEST_LINE) {
+            // Empty lines before a request are ignored, as RFC 9112 recommends
+            if (line_len > 0) {
+                if (parse_request_line(line, line_len, request)) {
+                    return -1;
+                }
+                parser->state = PARSE_HEADERS;
+            }
+        } else if (line_len == 0) {    // blank line ends the headers
+            parser->state = PARSE_DONE;
+        } else if (parse_header_line(line, line_len, request)) {
+            return -1;
+        }
+    }
+    return parser->line_start;
+}
+
+int parse_http_request(const char *buf, size_t len, http_request_t *request) {
+    http_parser_t parser;
+    http_parser_init(&parser);
+    return http_parser_execute(&parser, buf, len, request);
+}
+
+const http_slice_t *http_request_header(const http_request_t *request, const char *name) {
+    size_t name_len = strlen(name);
+    for (int i = 0; i < request->n_headers; i++) {
+        const http_header_t *header = &request->headers[i];
+        if (header->name.len == name_len && strncasecmp(header->name.data, name, name_len) == 0) {
+            return &header->value;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Check whether a qvalue rules out the content coding it is attached to
+ * value: The text after "q="
+ * len: The length of value
+ * Returns nonzero if the weight is zero, such as "0" or "0.000"
+ */
+static int qvalue_is_zero(const char *value, size_t len) {
+    if (len == 0 || value[0] != '0') {
+        return 0;
+    }
+    for (size_t i = 1; i < len; i++) {
+        if (value[i] != '0' && !(i == 1 && value[i] == '.')) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int http_request_accepts_encoding(const http_request_t *request, const char *coding) {
+    size_t coding_len = strlen(coding);
+    int wildcard = 0;
+    for (int i = 0; i < request->n_headers; i++) {
+        const http_header_t *header = &request->headers[i];
+        if (header->name.len != strlen("Accept-Encoding") ||
+            strncasecmp(header->name.data, "Accept-Encoding", header->name.len) != 0) {
+            continue;
+        }
+
+        // A comma-separated list of codings, each optionally weighted by ";q=<qvalue>"
+        const char *p = header->value.data;
+        const char *end = p + header->value.len;
+        while (p < end) {
+            const char *element_end = memchr(p, ',', end - p);
+            if (element_end == NULL) {
+                element_end = end;
+            }
+            while (p < element_end && (*p == ' ' || *p == '\t')) {
+                p++;
+            }
+            const char *name = p;
+            while (p < element_end && *p != ';' && *p != ' ' && *p != '\t') {
+                p++;
+            }
+            size_t name_len = p - name;
+
+            int acceptable = 1;
+            while ((p = memchr(p, ';', element_end - p)) != NULL) {
+                p++;
+                while (p < element_end && (*p == ' ' || *p == '\t')) {
+                    p++;
+                }
+                if (element_end - p >= 2 && (*p == 'q' || *p == 'Q') && p[1] == '=') {
+                    const char *qvalue = p + 2;
+                    p = qvalue;
+                    while (p < element_end && *p != ';' && *p != ' ' && *p != '\t') {
+                        p++;
+                    }
+                    acceptable = !qvalue_is_zero(qvalue, p - qvalue);
+                }
+            }
+
+            // A coding named explicitly overrides the "*" wildcard
+            if (name_len == coding_len && strncasecmp(name, coding, coding_len) == 0) {
+                return acceptable;
+            } else if (name_len == 1 && *name == '*') {
+                wildcard = acceptable;
+            }
+            p = element_end < end ? element_end + 1 : end;
+        }
+    }
+    return wildcard;
+}
+
+/*
+ * Parse a run of decimal digits as a file offset
+ * p: Pointer to the first character, advanced past the digits
+ * end: One past the last character available
+ * value: Set to the number on success
+ * Returns 0 on success or -1 if there are no digits or the number overflows
+ */
+static int parse_offset(const char **p, const char *end, off_t *value) {
+    const char *start = *p;
+    off_t number = 0;
+    while (*p < end && **p >= '0' && **p <= '9') {
+        int digit = **p - '0';
+        if (number > (OFF_MAX - digit) / 10) {
+            return -1;
+        }
+        number = number * 10 + digit;
+        (*p)++;
+    }
+    *value = number;
+    return *p > start ? 0 : -1;
+}
+
+int http_parse_range(http_slice_t value, off_t size, http_range_t *ranges) {
+    const char *p = value.data;
+    const char *end = p + value.len;
+    if (value.len < strlen("bytes=") || strncasecmp(p, "bytes=", strlen("bytes=")) != 0) {
+        return -1;
+    }
+    p += strlen("bytes=");
+
+    int n_specs = 0;
+    int n_ranges = 0;
+    while (p < end) {
+        // Elements are separated by commas with optional whitespace; empty elements are allowed
+        if (*p == ',' || *p == ' ' || *p == '\t') {
+            p++;
+            continue;
+        }
+        if (++n_specs > HTTP_MAX_RANGES) {
+            return -1;
+        }
+
+        off_t first;
+        off_t last;
+        if (*p == '-') {
+            // "-N" selects the final N bytes
+            p++;
+            off_t suffix_len;
+            if (parse_offset(&p, end, &suffix_len)) {
+                return -1;
+            }
+            if (suffix_len == 0 || size == 0) {
+                continue;
+            }
+            first = suffix_len < size ? size - suffix_len : 0;
+            last = size - 1;
+        } else {
+            // "A-B" selects bytes A through B, and "A-" everything from A on
+            if (parse_offset(&p, end, &first) || p == end || *p != '-') {
+                return -1;
+            }
+            p++;
+            last = OFF_MAX;
+            if (p < end && *p >= '0' && *p <= '9' && parse_offset(&p, end, &last)) {
+                return -1;
+            }
+            if (last < first) {
+                return -1;
+            }
+            if (first >= size) {
+                continue;
+            }
+            if (last >= size) {
+                last = size - 1;
+            }
+        }
+        if (p < end && *p != ',' && *p != ' ' && *p != '\t') {
+            return -1;
+        }
+        ranges[n_ranges].first = first;
+        ranges[n_ranges].last = last;
+        n_ranges++;
+    }
+    return n_specs > 0 ? n_ranges : -1;
+}
+
+int http_etag_list_matches(http_slice_t value, const char *etag) {
+    size_t etag_len = strlen(etag);
+    const char *p = value.data;
+    const char *end = p + value.len;
+    while (p < end) {
+        if (*p == ',' || *p == ' ' || *p == '\t') {
+            p++;
+            continue;
+        }
+        if (*p == '*') {
+            return 1;
+        }
+        if (end - p >= 2 && p[0] == 'W' && p[1] == '/') {
+            p += 2;
+        }
+        // An entity tag is an opaque quoted string, which cannot contain quotes itself
+        const char *tag = p;
+        if (p == end || *p != '"') {
+            return 0;
+        }
+        const char *close = memchr(p + 1, '"', end - p - 1);
+        if (close == NULL) {
+            return 0;
+        }
+        p = close + 1;
+        if ((size_t) (p - tag) == etag_len && memcmp(tag, etag, etag_len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+time_t http_parse_date(http_slice_t value) {
+    // IMF-fixdate, then the obsolete RFC 850 and asctime() formats
+    static const char *const formats[] = {
+        "%a, %d %b %Y %H:%M:%S GMT",
+        "%A, %d-%b-%y %H:%M:%S GMT",
+        "%a %b %e %H:%M:%S %Y",
+    };
+    char date[HTTP_DATE_BUFSIZE];
+    if (value.len >= sizeof(date)) {
+        return -1;
+    }
+    memcpy(date, value.data, value.len);
+    date[value.len] = '\0';
+
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        struct tm tm = {0};
+        const char *rest = strptime(date, formats[i], &tm);
+        if (rest != NULL && *rest == '\0') {
+            return timegm(&tm);
+        }
+    }
+    return -1;
+}
+
+int http_slice_equals(http_slice_t slice, const char *str) {
+    return slice.len == strlen(str) && memcmp(slice.data, str, slice.len) == 0;
+}
@@ -0,0 +1,128 @@
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define HTTP_MAX_HEADERS 32
+#define HTTP_MAX_RANGES 16    // more ranges than this in one request are ignored
+#define HTTP_DATE_BUFSIZE 64    // longer than any valid HTTP-date
+
+// A run of bytes inside the buffer a request was parsed from; not NUL-terminated
+typedef struct {
+    const char *data;
+    size_t len;
+} http_slice_t;
+
+typedef struct {
+    http_slice_t name;
+    http_slice_t value;    // without surrounding whitespace
+} http_header_t;
+
+// Fields of a parsed HTTP request; every slice points into the buffer that was parsed, so the
+// request is only valid while those bytes stay in place
+typedef struct {
+    http_slice_t method;
+    http_slice_t target;    // request target exactly as sent
+    http_slice_t path;      // target up to any '?' query
+    int minor_version;      // 0 for HTTP/1.0, 1 for HTTP/1.1
+    int keep_alive;         // whether the connection may stay open after the response
+    http_header_t headers[HTTP_MAX_HEADERS];
+    int n_headers;
+} http_request_t;
+
+// A satisfiable byte range of a representation, both ends inclusive
+typedef struct {
+    off_t first;
+    off_t last;
+} http_range_t;
+
+// Which part of the request the parser expects next
+typedef enum {
+    PARSE_REQUEST_LINE,
+    PARSE_HEADERS,
+    PARSE_DONE,
+} http_parse_state_t;
+
+// Resumable parser state: bytes that have already been searched are never scanned again
+typedef struct {
+    http_parse_state_t state;
+    size_t line_start;    // offset of the first byte of the line being parsed
+    size_t scanned;       // offset up to which the line has been searched for its end
+} http_parser_t;
+
+/*
+ * Reset a parser to expect a new request at the start of its buffer
+ * parser: Pointer to http_parser_t to be initialized
+ */
+void http_parser_init(http_parser_t *parser);
+
+/*
+ * Parse as much of a request as has arrived
+ * Call again with the same buffer, grown by newly received bytes, until the request is complete.
+ * Only the first request in buf is parsed; any bytes after it belong to pipelined requests.
+ * parser: The parser, which remembers how far it got in buf
+ * buf: The bytes received from the client so far
+ * len: The number of bytes in buf
+ * request: Filled in as lines complete; valid once the request is complete
+ * Returns the length of the complete request, 0 if more bytes are needed, or -1 if malformed
+ */
+int http_parser_execute(http_parser_t *parser, const char *buf, size_t len,
+                        http_request_t *request);
+
+/*
+ * Parse an HTTP request that may have only partially arrived, from scratch
+ * Returns the length of the complete request, 0 if more bytes are needed, or -1 if malformed
+ */
+int parse_http_request(const char *buf, size_t len, http_request_t *request);
+
+/*
+ * Find a header of a parsed request by name, ignoring case
+ * request: The parsed request
+ * name: The header name
+ * Returns the header's value, or NULL if the request does not have it
+ */
+const http_slice_t *http_request_header(const http_request_t *request, const char *name);
+
+/*
+ * Check whether a request's Accept-Encoding headers allow a response in a content coding
+ * request: The parsed request
+ * coding: The content coding, such as "gzip"
+ * Returns nonzero if the coding is listed, or covered by "*", without a weight of zero
+ */
+int http_request_accepts_encoding(const http_request_t *request, const char *coding);
+
+/*
+ * Parse the value of a Range header against the representation it selects from
+ * value: The header value, such as "bytes=0-499, -500"
+ * size: The length of the representation
+ * ranges: Array of at least HTTP_MAX_RANGES entries, filled in with the satisfiable ranges in the
+ *         order requested and clipped to the representation
+ * Returns the number of satisfiable ranges, which is 0 if none are, or -1 if the header must be
+ * ignored because it is malformed, uses a unit other than bytes or lists too many ranges
+ */
+int http_parse_range(http_slice_t value, off_t size, http_range_t *ranges);
+
+/*
+ * Check whether an If-None-Match header value lists an entity tag, using weak comparison
+ * value: The header value, a comma-separated list of entity tags or "*"
+ * etag: The quoted entity tag of the current representation
+ * Returns nonzero if the list holds the tag, ignoring any W/ prefix, or is "*"
+ */
+int http_etag_list_matches(http_slice_t value, const char *etag);
+
+/*
+ * Parse an HTTP-date, in the preferred IMF-fixdate format or either obsolete one
+ * value: The date, such as "Sun, 06 Nov 1994 08:49:37 GMT"
+ * Returns the time, or -1 if the date is invalid
+ */
+time_t http_parse_date(http_slice_t value);
+
+/*
+ * Compare a slice to a NUL-terminated string
+ * Returns nonzero if they hold the same bytes
+ */
+int http_slice_equals(http_slice_t slice, const char *str);
+
+#endif    // HTTP_PARSER_H
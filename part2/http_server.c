@@ -1,26 +1,119 @@
 #define _GNU_SOURCE
 
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#include "admission.h"
+#include "affinity.h"
+#include "config.h"
 #include "connection_queue.h"
+#include "event_engine.h"
+#include "fd_cache.h"
+#include "file_cache.h"
 #include "http.h"
+#include "http_connection.h"
+#include "metrics.h"
+#include "path_cache.h"
+#include "uring_engine.h"
+#include "work_stealing.h"
 
-#define BUFSIZE 512
-#define LISTEN_QUEUE_LEN 5
-#define N_THREADS 5
+#define LISTEN_FDS_ENV "HTTP_SERVER_LISTEN_FDS"    // listening sockets a successor takes over
+#define READY_FD_ENV "HTTP_SERVER_READY_FD"        // pipe a successor reports it is serving on
+#define UPGRADE_TIMEOUT_MS 10000                   // how long a successor has to start serving
+#define DRAIN_POLL_MS 10    // how often a draining thread pool checks for queued connections
+
+// Where thread-pool workers get their connections from; only the selected member is used
+typedef struct {
+    scheduler_t scheduler;
+    connection_queue_t queue;
+    work_scheduler_t deques;
+} dispatcher_t;
+
+struct thread_pool;
+
+// Argument handed to each thread-pool worker
+typedef struct {
+    struct thread_pool *pool;
+    int index;
+} worker_arg_t;
+
+// Argument handed to each acceptor; acceptor i accepts from listen_fds[i]
+typedef struct {
+    struct thread_pool *pool;
+    int index;
+} acceptor_arg_t;
+
+// The thread-pool engine: acceptors hand connections to workers through a dispatcher
+// Acceptor 0 is the main thread, which only accepts for the newest pool; the others are threads.
+typedef struct thread_pool {
+    dispatcher_t dispatcher;
+    path_cache_t *paths;
+    int shutdown_fd;    // eventfd written to release the threads parked on sockets when stopping
+    int draining;       // whether stopping workers let their connections finish first
+    pthread_t *workers;
+    worker_arg_t *worker_args;
+    int n_workers;    // the number of worker threads started
+    pthread_t *acceptors;    // indexed like listen_fds, so acceptors[0] is unused
+    acceptor_arg_t *acceptor_args;
+    int n_acceptors;    // one more than the number of acceptor threads started
+} thread_pool_t;
+
+// Everything one configuration is served with
+// A reload starts the next generation on the same listening sockets before draining this one in
+// the background, so accepting never stops.
+typedef struct generation {
+    server_config_t config;
+    engine_t engine;    // the engine running, which is epoll where io_uring is unavailable
+    path_cache_t paths;    // the served directory, opened for each generation, and the paths in it
+    mime_table_t mime_table;
+    file_cache_t file_cache;
+    file_cache_t gzip_cache;
+    fd_cache_t fd_cache;
+    thread_pool_t pool;    // only the member for engine is used
+    event_engine_t events;
+    uring_engine_t uring;
+    pthread_t older;    // retires the generation replaced before this one
+    int has_older;      // whether older is still to be joined
+    struct generation *failed;    // reloads that failed to start while this one served
+} generation_t;
+
+// How the engine is stopped once the main thread has seen a signal
+typedef enum {
+    STOP_NONE,     // keep serving
+    STOP_NOW,      // close every connection (SIGINT)
+    STOP_DRAIN,    // stop accepting and let the connections finish (a successor is serving)
+} stop_mode_t;
 
 int keep_going = 1;
-int sock_fd = -1;
-const char *serve_dir;
+int reload_requested = 0;     // set by SIGHUP
+int upgrade_requested = 0;    // set by SIGUSR2
+int server_argc;    // the command line, reread by reloads and reused by upgrades
+char **server_argv;
+int ready_fd = -1;    // pipe to the server that started this one for an upgrade, until serving
+pid_t successor_pid = -1;    // server started by SIGUSR2 that has not reported serving yet
+int successor_fd = -1;       // pipe successor_pid reports on
+long long successor_deadline_ns;    // when successor_pid is given up on
+int *listen_fds = NULL;    // one listening socket per acceptor, bound with SO_REUSEPORT if many
+int n_listeners = 0;
+pthread_t retirer;    // retires the last generation replaced, after those replaced before it
+int retiring = 0;     // whether retirer is still to be joined
 
 /**
  * @brief Handler to shutdown server on SIGINT
@@ -31,245 +124,1415 @@ void handle_sigint(int signo) {
     keep_going = 0;
 }
 
+/**
+ * @brief Handler to reload the configuration on SIGHUP
+ */
+void handle_sighup(int signo) {
+    reload_requested = 1;
+}
+
+/**
+ * @brief Handler to hand the listening sockets to a new server process on SIGUSR2
+ */
+void handle_sigusr2(int signo) {
+    upgrade_requested = 1;
+}
+
+/**
+ * @brief Check whether a signal has asked the main thread to stop serving as it does
+ */
+int stop_requested(void) {
+    return !keep_going || reload_requested || upgrade_requested;
+}
+
+/**
+ * @brief Get how long the main thread may wait before checking on the successor again
+ *
+ * @param timeout filled in with the time left until the successor is given up on
+ * @return timeout, or NULL if no successor is starting
+ */
+struct timespec *successor_timeout(struct timespec *timeout) {
+    if (successor_pid == -1) {
+        return NULL;
+    }
+    long long left_ns = successor_deadline_ns - metrics_now_ns();
+    if (left_ns < 0) {
+        left_ns = 0;
+    }
+    timeout->tv_sec = left_ns / 1000000000;
+    timeout->tv_nsec = left_ns % 1000000000;
+    return timeout;
+}
+
+/**
+ * @brief Initialize the structure workers take connections from
+ *
+ * @param dispatcher the dispatcher_t to initialize
+ * @param scheduler whether to use one shared queue or per-worker work-stealing deques
+ * @param n_workers the number of workers that will take from the dispatcher
+ * @param capacity capacity of the shared queue, or of each worker's deque
+ * @return 0 on success or -1 on error
+ */
+int dispatcher_init(dispatcher_t *dispatcher, scheduler_t scheduler, int n_workers, int capacity) {
+    dispatcher->scheduler = scheduler;
+    if (scheduler == SCHEDULER_STEAL) {
+        return work_scheduler_init(&dispatcher->deques, n_workers, n_listeners, capacity);
+    }
+    return connection_queue_init_capacity(&dispatcher->queue, capacity);
+}
+
+/**
+ * @brief Hand a connection accepted by the given acceptor to the workers without blocking
+ *
+ * @details With work-stealing deques the connection goes to the preferred worker if it can;
+ * the shared queue has no say in which worker dequeues it
+ *
+ * @param worker the worker to prefer, or -1 for none
+ * @return 0 on success, 1 if there is no room, or -1 if the dispatcher has shut down
+ */
+int dispatcher_try_submit(dispatcher_t *dispatcher, int acceptor, int worker, int client_fd) {
+    if (dispatcher->scheduler == SCHEDULER_STEAL) {
+        return work_scheduler_try_submit(&dispatcher->deques, acceptor, worker, client_fd);
+    }
+    return connection_queue_try_enqueue(&dispatcher->queue, client_fd);
+}
+
+/**
+ * @brief Hand a connection accepted by the given acceptor to the workers, blocking until
+ * there is room
+ *
+ * @param worker the worker to prefer, or -1 for none
+ * @return 0 on success or -1 if the dispatcher has shut down
+ */
+int dispatcher_submit(dispatcher_t *dispatcher, int acceptor, int worker, int client_fd) {
+    int result = dispatcher_try_submit(dispatcher, acceptor, worker, client_fd);
+    if (result != 1) {
+        return result;
+    }
+    if (dispatcher->scheduler == SCHEDULER_STEAL) {
+        return work_scheduler_submit(&dispatcher->deques, acceptor, client_fd);
+    }
+    return connection_queue_enqueue(&dispatcher->queue, client_fd);
+}
+
+/**
+ * @brief Take the next connection for a worker, blocking until there is one
+ *
+ * @return the client fd, or -1 on error or shutdown
+ */
+int dispatcher_take(dispatcher_t *dispatcher, int worker) {
+    if (dispatcher->scheduler == SCHEDULER_STEAL) {
+        return work_scheduler_take(&dispatcher->deques, worker);
+    }
+    return connection_queue_dequeue(&dispatcher->queue);
+}
+
+/**
+ * @brief Count the connections waiting for a worker, for the metrics queue depth gauge
+ *
+ * @param arg should be a dispatcher_t pointer
+ */
+long dispatcher_depth(void *arg) {
+    dispatcher_t *dispatcher = (dispatcher_t *) arg;
+    if (dispatcher->scheduler == SCHEDULER_STEAL) {
+        return work_scheduler_depth(&dispatcher->deques);
+    }
+    return connection_queue_depth(&dispatcher->queue);
+}
+
+/**
+ * @brief Unblock every thread waiting on the dispatcher and make further calls fail
+ */
+int dispatcher_shutdown(dispatcher_t *dispatcher) {
+    if (dispatcher->scheduler == SCHEDULER_STEAL) {
+        return work_scheduler_shutdown(&dispatcher->deques);
+    }
+    return connection_queue_shutdown(&dispatcher->queue);
+}
+
+/**
+ * @brief Free the resources held by the dispatcher
+ */
+int dispatcher_free(dispatcher_t *dispatcher) {
+    if (dispatcher->scheduler == SCHEDULER_STEAL) {
+        return work_scheduler_free(&dispatcher->deques);
+    }
+    return connection_queue_free(&dispatcher->queue);
+}
+
+/**
+ * @brief Wait until a worker's connection can make progress again
+ *
+ * @details Polls the client socket together with the pool's shutdown_fd so that a worker parked on
+ * an idle keep-alive connection notices the pool stopping; while draining, only idle connections
+ * are given up. The poll timeout is whatever is left of the connection's deadline, which is
+ * counted if it passes.
+ *
+ * @param pool the pool the worker belongs to
+ * @param conn the connection being served
+ * @param status what the connection reported it is waiting on
+ * @return 0 when the socket is ready, or -1 on timeout, shutdown or error
+ */
+int wait_for_connection(thread_pool_t *pool, http_connection_t *conn, conn_status_t status) {
+    struct pollfd pfds[2];
+    pfds[0].fd = conn->fd;
+    pfds[0].events = status == CONN_WANT_READ ? POLLIN : POLLOUT;
+    pfds[1].fd = pool->shutdown_fd;
+    pfds[1].events = POLLIN;
+
+    while (1) {
+        int timeout = http_connection_deadline_timeout(&conn->deadline, metrics_now_ns());
+        if (timeout == 0) {
+            http_connection_count_timeout(&conn->deadline);
+            return -1;
+        }
+        int n_ready = poll(pfds, 2, timeout);
+        if (n_ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            return -1;
+        }
+        // Pool is shutting down
+        if (pfds[1].revents) {
+            if (!http_connection_draining(conn) || conn->deadline.phase == TIMEOUT_IDLE) {
+                return -1;
+            }
+            // shutdown_fd stays readable, so wait on the client alone from now on
+            pfds[1].fd = -1;
+            n_ready--;
+        }
+        // A timed out poll goes round again to confirm the deadline against the clock
+        if (n_ready > 0) {
+            return 0;
+        }
+    }
+}
+
 /**
  * @brief Worker thread function to parse http requests and send http responses
  *
- * @details Continually loops to get file descriptors from a shared (thread-safe) queue, reads the
- * http request, finds the request resource, and writes an http response back
+ * @details Continually loops to get file descriptors from the dispatcher (a shared queue or this
+ * worker's deque), then serves requests on that connection until the client closes it,
+ * keep-alive ends or its deadline passes. Exits once the dispatcher shuts down.
  *
- * @param arg should be a connection_queue_t pointer which stores client fds in a thread-safe manner
+ * @param arg should be a worker_arg_t pointer naming the pool and this worker's index
  */
 void *worker_thread(void *arg) {
-    connection_queue_t *queue = (connection_queue_t *) arg;
-    char resource_name[BUFSIZE];
-    char resource_path[BUFSIZE];
-    // int read_error = 0;
+    worker_arg_t *worker = (worker_arg_t *) arg;
+    thread_pool_t *pool = worker->pool;
+    http_connection_t conn;
 
-    while (keep_going) {
-        int fd = connection_queue_dequeue(queue);
+    while (1) {
+        int fd = dispatcher_take(&pool->dispatcher, worker->index);
         if (fd == -1) {
-            // exit if file descriptor is invalid and queue has shutdown
+            // exit if file descriptor is invalid and dispatcher has shutdown
             break;
         }
 
-        if (read_http_request(fd, resource_name)) {
-            // if (!queue->shutdown) {
-            printf("Error from reading in worker thread\n");
-            //}
+        // The connection state machine expects a non-blocking socket; waits happen in poll()
+        int flags = fcntl(fd, F_GETFL);
+        if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+            perror("fcntl");
             close(fd);
             continue;
         }
 
-        // if (!read_error) {
-        snprintf(resource_path, (strlen(serve_dir) + strlen(resource_name) + 1), "%s%s", serve_dir,
-                 resource_name);
-        //}
+        http_connection_init(&conn, fd, pool->paths, &pool->draining);
+        conn_status_t status;
+        while ((status = http_connection_advance(&conn)) == CONN_WANT_READ ||
+               status == CONN_WANT_WRITE) {
+            if (wait_for_connection(pool, &conn, status)) {
+                break;
+            }
+        }
 
-        if (write_http_response(fd, resource_path)) {
-            printf("Error from writing in worker thread\n");
+        http_connection_close(&conn);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Wake every worker of a pool blocked on a client connection, and every acceptor thread,
+ * so they can see the pool stopping
+ */
+void wake_workers(thread_pool_t *pool) {
+    uint64_t one = 1;
+    if (write(pool->shutdown_fd, &one, sizeof(one)) == -1) {
+        perror("write");
+    }
+}
+
+/**
+ * @brief Accept clients from one listening socket and hand them to the workers
+ *
+ * @details Polls the (non-blocking) listening socket together with the pool's shutdown_fd, so
+ * acceptor threads stop once their pool is stopping. The main thread, acceptor 0, polls with
+ * signals unblocked instead, and stops when one interrupts the poll, or when the successor
+ * started by start_successor() reports or runs out of time.
+ *
+ * @param acceptor names the pool and the index of this acceptor's listening socket
+ * @param sigmask the signal mask to poll with in the main thread, or NULL in acceptor threads
+ * @return 0 on shutdown or -1 on error
+ */
+int accept_connections(acceptor_arg_t *acceptor, const sigset_t *sigmask) {
+    dispatcher_t *dispatcher = &acceptor->pool->dispatcher;
+    struct pollfd pfds[3];
+    pfds[0].fd = listen_fds[acceptor->index];
+    pfds[0].events = POLLIN;
+    pfds[1].fd = acceptor->pool->shutdown_fd;
+    pfds[1].events = POLLIN;
+    pfds[2].fd = sigmask != NULL ? successor_fd : -1;
+    pfds[2].events = POLLIN;
+
+    // Signals only reach the main thread, which blocks them outside ppoll() so that none arrives
+    // between the check and the wait; the others run until shutdown_fd is written
+    while (sigmask == NULL || !stop_requested()) {
+        struct timespec timeout;
+        int n_ready = ppoll(pfds, 3, sigmask != NULL ? successor_timeout(&timeout) : NULL, sigmask);
+        if (n_ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("ppoll");
+            return -1;
+        }
+        if (n_ready == 0 || pfds[1].revents || pfds[2].revents) {
+            break;
+        }
+
+        int client_fd = accept4(pfds[0].fd, NULL, NULL, SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            // another connection may be pending, or the client gave up before it was accepted
+            if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK ||
+                errno == ECONNABORTED) {
+                continue;
+            }
+            perror("accept");
+            return -1;
+        }
+        metrics_add(COUNTER_ACCEPTED, 1);
+
+        // When shedding is configured, rather than block (and let the kernel backlog overflow
+        // into connect timeouts), turn the client away at once when workers are falling behind.
+        // With pinned threads, the worker on the CPU that received the connection's packets
+        // should serve it.
+        int worker = affinity_incoming_index(client_fd);
+        admission_decision_t decision = ADMIT;
+        int result;
+        if (admission_enabled()) {
+            decision = admission_check(dispatcher_depth(dispatcher));
+            result = decision == ADMIT
+                         ? dispatcher_try_submit(dispatcher, acceptor->index, worker, client_fd)
+                         : 1;
+        } else {
+            result = dispatcher_submit(dispatcher, acceptor->index, worker, client_fd);
+        }
+        if (result == -1) {
+            // dispatcher has shut down
+            close(client_fd);
+            break;
+        } else if (result == 1) {
+            admission_shed(client_fd, decision == ADMIT ? SHED_QUEUE_DEPTH : decision);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Thread function for every acceptor other than the main thread's
+ *
+ * @param arg should be an acceptor_arg_t pointer
+ */
+void *acceptor_thread(void *arg) {
+    accept_connections((acceptor_arg_t *) arg, NULL);
+    return NULL;
+}
+
+/**
+ * @brief Close every listening socket opened by open_listeners()
+ *
+ * @return 0 on success or -1 if any close failed
+ */
+int close_listeners(void) {
+    int result = 0;
+    for (int i = 0; i < n_listeners; i++) {
+        if (close(listen_fds[i])) {
+            perror("close");
+            result = -1;
+        }
+    }
+    free(listen_fds);
+    listen_fds = NULL;
+    n_listeners = 0;
+    return result;
+}
+
+/**
+ * @brief Open the listening sockets, one per acceptor
+ *
+ * @details With more than one socket each is bound with SO_REUSEPORT, so the kernel spreads new
+ * connections across their accept queues instead of funneling them through one
+ *
+ * @param port the port to listen on
+ * @param count the number of sockets to open
+ * @param backlog the listen() backlog of each socket
+ * @return 0 on success or -1 on error, in which case no socket is left open
+ */
+int open_listeners(const char *port, int count, int backlog) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;    // TCP
+    hints.ai_flags = AI_PASSIVE;        // Will be acting as a server
+
+    struct addrinfo *server;
+    int ret_val = getaddrinfo(NULL, port, &hints, &server);
+    if (ret_val) {
+        fprintf(stderr, "getaddrinfo failed: %s\n", gai_strerror(ret_val));
+        return -1;
+    }
+    listen_fds = malloc(count * sizeof(int));
+    if (listen_fds == NULL) {
+        perror("malloc");
+        freeaddrinfo(server);
+        return -1;
+    }
+
+    int one = 1;
+    for (n_listeners = 0; n_listeners < count; n_listeners++) {
+        int fd = socket(server->ai_family, server->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                        server->ai_protocol);
+        if (fd == -1) {
+            perror("socket");
+            break;
+        }
+        // SO_REUSEADDR lets a restarted server bind while old connections are in TIME_WAIT
+        // Accepted sockets inherit TCP_NODELAY, even those io_uring installs as fixed files:
+        // responses are written whole, so Nagle would only delay their last segment
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) ||
+            (count > 1 && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one))) ||
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one))) {
+            perror("setsockopt");
+            close(fd);
+            break;
+        }
+        if (bind(fd, server->ai_addr, server->ai_addrlen)) {
+            perror("bind");
             close(fd);
+            break;
+        }
+        if (listen(fd, backlog)) {
+            perror("listen");
+            close(fd);
+            break;
+        }
+        listen_fds[n_listeners] = fd;
+    }
+    freeaddrinfo(server);
+
+    if (n_listeners < count) {
+        close_listeners();
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Take over the listening sockets of the server that started this one for an upgrade
+ *
+ * @details The sockets keep their accept queues, so no client is refused while servers change
+ *
+ * @param fds the comma-separated descriptors of the sockets, from LISTEN_FDS_ENV
+ * @return 0 on success or -1 on error, in which case no socket is left open
+ */
+int inherit_listeners(const char *fds) {
+    int count = 1;
+    for (const char *c = fds; *c != '\0'; c++) {
+        if (*c == ',') {
+            count++;
+        }
+    }
+    listen_fds = malloc(count * sizeof(int));
+    if (listen_fds == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    const char *next = fds;
+    for (n_listeners = 0; n_listeners < count; n_listeners++) {
+        char *end;
+        long fd = strtol(next, &end, 10);
+        int listening = 0;
+        socklen_t len = sizeof(listening);
+        if (end == next || (*end != ',' && *end != '\0') || fd < 0 || fd > INT_MAX ||
+            getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) || !listening) {
+            fprintf(stderr, "%s does not name listening sockets: %s\n", LISTEN_FDS_ENV, fds);
+            break;
+        }
+        // They had to be inherited across execve(), but later children should not get them
+        if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+            perror("fcntl");
+            break;
+        }
+        listen_fds[n_listeners] = fd;
+        next = end + 1;
+    }
+
+    if (n_listeners < count) {
+        close_listeners();
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Apply the listening socket settings of a reloaded configuration
+ *
+ * @details The backlog of the open sockets changes in place, but their number cannot: that takes
+ * a restart
+ *
+ * @param config the reloaded configuration
+ * @return 0 on success or -1 on error
+ */
+int update_listeners(const server_config_t *config) {
+    if (config->n_acceptors != n_listeners) {
+        fprintf(stderr, "keeping %d listening sockets, as acceptors only change on restart\n",
+                n_listeners);
+    }
+    for (int i = 0; i < n_listeners; i++) {
+        if (listen(listen_fds[i], config->backlog)) {
+            perror("listen");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Print command line usage
+ */
+void print_usage(const char *program) {
+    printf("Usage: %s [-f config_file] [-a acceptors] [-b backlog] [-c cache_bytes] "
+           "[-C 'mime_pattern max_age'] [-d shed_queue_depth] [-e threads|epoll|uring] "
+           "[-H header_timeout_ms] [-i io_chunk_size] "
+           "[-k idle_timeout_ms] "
+           "[-m buffered|zero_copy|mmap|auto] [-M mmap_threshold] [-o fd_cache_entries] "
+           "[-p 0|1] [-q queue_capacity] [-r max_requests] [-R retry_after] [-s shared|steal] "
+           "[-S send_timeout_ms] [-t workers|auto] [-T mime_types_file] [-w shed_wait_ms] "
+           "[-z gzip_cache_bytes] <directory> <port>\n",
+           program);
+    printf("  Options apply in order, so each overrides any config file named before it\n");
+    printf("  -a N opens N SO_REUSEPORT listening sockets (at most the number of workers), each "
+           "with its own acceptor\n");
+    printf("  -p 1 pins thread i to the i-th usable CPU, and steers each connection to the socket "
+           "and worker of the CPU that received it\n");
+    printf("  -C sends Cache-Control: max-age with types matching a pattern such as text/html, "
+           "image/* or *, and may be repeated\n");
+    printf("  -T adds the types in a mime.types file to the built-in ones; files of unknown "
+           "types are served as %s\n",
+           DEFAULT_MIME_TYPE);
+    printf("  With -e threads and -d or -w set, clients get 503 with Retry-After once the queue "
+           "is full or -d deep, or while queue waits stay above -w ms for %d ms; otherwise "
+           "acceptors wait for room in the queue\n",
+           CODEL_INTERVAL_MS);
+    printf("  Connections close when a request takes -H ms to arrive from its first byte, or a "
+           "response makes no progress for -S ms\n");
+    printf("  A config file may set serve_dir to serve another directory than the one given\n");
+    printf("  SIGHUP rereads the options and config files and serves new connections with them "
+           "while the current ones finish, with the served directory opened again and fresh "
+           "caches; "
+           "SIGUSR2 runs %s again on the same listening sockets and exits once "
+           "it serves and the connections finish\n",
+           program);
+    printf("  -m auto maps bodies smaller than the mmap threshold and sends larger ones with "
+           "sendfile\n");
+    printf("  -c 0 disables the file cache, -o 0 the fd cache, -z 0 gzip and -k 0 keep-alive, and "
+           "-H 0 or -S 0 their timeout; defaults are -a 1 -b %d -c %d -H %d -i %d -k %d -m auto "
+           "-M %d -o %d -p 0 -q %d -r %d -S %d -t %d -z %d\n",
+           LISTEN_QUEUE_LEN, DEFAULT_FILE_CACHE_BYTES, DEFAULT_HEADER_TIMEOUT_MS,
+           DEFAULT_IO_CHUNK_SIZE, DEFAULT_IDLE_TIMEOUT_MS, DEFAULT_MMAP_THRESHOLD,
+           DEFAULT_FD_CACHE_ENTRIES, CAPACITY, DEFAULT_MAX_REQUESTS, DEFAULT_SEND_TIMEOUT_MS,
+           DEFAULT_WORKERS, DEFAULT_GZIP_CACHE_BYTES);
+}
+
+/**
+ * @brief Get the config key a command-line option sets
+ *
+ * @param opt the option character returned by getopt()
+ * @return the key, or NULL if opt does not name a setting
+ */
+const char *option_key(int opt) {
+    switch (opt) {
+        case 'a':
+            return "acceptors";
+        case 'b':
+            return "backlog";
+        case 'c':
+            return "cache_bytes";
+        case 'd':
+            return "shed_queue_depth";
+        case 'C':
+            return "max_age";
+        case 'e':
+            return "engine";
+        case 'H':
+            return "header_timeout_ms";
+        case 'i':
+            return "io_chunk_size";
+        case 'k':
+            return "idle_timeout_ms";
+        case 'm':
+            return "transmit";
+        case 'M':
+            return "mmap_threshold";
+        case 'o':
+            return "fd_cache_entries";
+        case 'p':
+            return "pin_cpus";
+        case 'q':
+            return "queue_capacity";
+        case 'r':
+            return "max_requests";
+        case 'R':
+            return "retry_after";
+        case 's':
+            return "scheduler";
+        case 'S':
+            return "send_timeout_ms";
+        case 't':
+            return "workers";
+        case 'T':
+            return "mime_types";
+        case 'w':
+            return "shed_wait_ms";
+        case 'z':
+            return "gzip_cache_bytes";
+        default:
+            return NULL;
+    }
+}
+
+/**
+ * @brief Read the configuration from the command line and the config files it names
+ *
+ * @details Called again on SIGHUP, so that edited config files take effect
+ *
+ * @param argc the number of arguments
+ * @param argv the arguments, options first and then the directory to serve and the port
+ * @param config filled in with the validated configuration
+ * @return the index of the directory argument, or -1 on error
+ */
+int parse_arguments(int argc, char **argv, server_config_t *config) {
+    config_init(config);
+    optind = 0;    // makes getopt() start over when rereading
+    int opt;
+    while ((opt = getopt(argc, argv, "a:b:c:C:d:e:f:H:i:k:m:M:o:p:q:r:R:s:S:t:T:w:z:")) != -1) {
+        if (opt == 'f') {
+            if (config_load_file(config, optarg)) {
+                // error message printed in config_load_file()
+                return -1;
+            }
+        } else if (option_key(opt) == NULL || config_set(config, option_key(opt), optarg)) {
+            print_usage(argv[0]);
+            return -1;
+        }
+    }
+    if (argc - optind != 2) {
+        print_usage(argv[0]);
+        return -1;
+    }
+    // The directory operand is served unless a config file names another one
+    if (config->serve_dir[0] == '\0' && config_set(config, "serve_dir", argv[optind])) {
+        // error message printed in config_set()
+        return -1;
+    }
+    // Checked here so that a reload naming a missing directory keeps the current one
+    struct stat dir_stat;
+    if (stat(config->serve_dir, &dir_stat) == -1) {
+        perror("stat");
+        return -1;
+    } else if (!S_ISDIR(dir_stat.st_mode)) {
+        fprintf(stderr, "%s is not a directory\n", config->serve_dir);
+        return -1;
+    }
+    if (config_validate(config)) {
+        // error message printed in config_validate()
+        return -1;
+    }
+    return optind;
+}
+
+/**
+ * @brief Tell the server that started this one for an upgrade that it can stop accepting
+ */
+void notify_ready(void) {
+    if (ready_fd == -1) {
+        return;
+    }
+    char ready = 1;
+    if (write(ready_fd, &ready, sizeof(ready)) == -1) {
+        perror("write");
+    }
+    close(ready_fd);
+    ready_fd = -1;
+}
+
+/**
+ * @brief Start a new server process that takes over the listening sockets
+ *
+ * @details The successor is executed from the path this server was started as, with the same
+ * arguments, so replacing the binary there and sending SIGUSR2 upgrades the server. It inherits
+ * the sockets across execve(), learning their numbers from LISTEN_FDS_ENV, and writes to the pipe
+ * named by READY_FD_ENV once it is serving. This server keeps serving meanwhile, with the main
+ * thread polling the pipe until check_successor() finds the successor serving or gives up on it.
+ *
+ * @return 0 once the successor has been started, or -1 on error
+ */
+int start_successor(void) {
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+        perror("pipe2");
+        return -1;
+    }
+
+    // Built before fork(): the child of a threaded process may only make async-signal-safe calls
+    int n_env = 0;
+    while (environ[n_env] != NULL) {
+        n_env++;
+    }
+    char **env = malloc((n_env + 3) * sizeof(char *));
+    char *listen_var = malloc(sizeof(LISTEN_FDS_ENV) + n_listeners * 12);
+    char ready_var[sizeof(READY_FD_ENV) + 12];
+    if (env == NULL || listen_var == NULL) {
+        perror("malloc");
+        free(env);
+        free(listen_var);
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return -1;
+    }
+    int len = sprintf(listen_var, "%s=", LISTEN_FDS_ENV);
+    for (int i = 0; i < n_listeners; i++) {
+        len += sprintf(listen_var + len, i == 0 ? "%d" : ",%d", listen_fds[i]);
+    }
+    snprintf(ready_var, sizeof(ready_var), "%s=%d", READY_FD_ENV, pipe_fds[1]);
+    memcpy(env, environ, n_env * sizeof(char *));
+    env[n_env] = listen_var;
+    env[n_env + 1] = ready_var;
+    env[n_env + 2] = NULL;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Let the sockets and the pipe survive execve(), and unblock the signals threads block
+        sigset_t no_signals;
+        sigemptyset(&no_signals);
+        for (int i = 0; i < n_listeners; i++) {
+            fcntl(listen_fds[i], F_SETFD, 0);
+        }
+        fcntl(pipe_fds[1], F_SETFD, 0);
+        sigprocmask(SIG_SETMASK, &no_signals, NULL);
+        execvpe(server_argv[0], server_argv, env);
+        _exit(127);
+    }
+    free(env);
+    free(listen_var);
+    close(pipe_fds[1]);
+    if (pid == -1) {
+        perror("fork");
+        close(pipe_fds[0]);
+        return -1;
+    }
+
+    successor_pid = pid;
+    successor_fd = pipe_fds[0];
+    successor_deadline_ns = metrics_now_ns() + UPGRADE_TIMEOUT_MS * 1000000LL;
+    return 0;
+}
+
+/**
+ * @brief Kill the successor started by start_successor() and forget about it
+ */
+void kill_successor(void) {
+    close(successor_fd);
+    successor_fd = -1;
+    kill(successor_pid, SIGKILL);
+    waitpid(successor_pid, NULL, 0);
+    successor_pid = -1;
+}
+
+/**
+ * @brief See whether the successor started by start_successor() is serving yet
+ *
+ * @details The pipe delivers the successor's byte, or end-of-file if it exits first. A successor
+ * that does neither within UPGRADE_TIMEOUT_MS is killed, and this server carries on.
+ *
+ * @return 1 if it is serving, 0 if it may still start, or -1 if it has been given up on
+ */
+int check_successor(void) {
+    struct pollfd pfd = {.fd = successor_fd, .events = POLLIN};
+    int n_ready = poll(&pfd, 1, 0);
+    char ready = 0;
+    if (n_ready == -1) {
+        perror("poll");
+    } else if (n_ready == 0 && metrics_now_ns() < successor_deadline_ns) {
+        return 0;
+    } else if (n_ready == 1 && read(successor_fd, &ready, sizeof(ready)) == -1) {
+        perror("read");
+    }
+    if (ready) {
+        close(successor_fd);
+        successor_fd = -1;
+        successor_pid = -1;
+        return 1;
+    }
+
+    fprintf(stderr, "upgrade failed: the new server did not start serving\n");
+    kill_successor();
+    return -1;
+}
+
+/**
+ * @brief Stop a thread pool and free it
+ *
+ * @details Wakes every acceptor and worker and joins the acceptor threads, then shuts the
+ * dispatcher down so no worker stays blocked on it and joins the workers. When draining, workers
+ * first take every connection still queued, and serve their connections to the end.
+ *
+ * @param pool the thread_pool_t to stop, whose acceptor 0 must no longer be accepting
+ * @param drain whether to let the connections finish
+ * @return 0 on success or -1 on error
+ */
+int thread_pool_stop(thread_pool_t *pool, int drain) {
+    int result = 0;
+    // Workers read the flag when woken, so it is set first
+    __atomic_store_n(&pool->draining, drain, __ATOMIC_RELAXED);
+    wake_workers(pool);
+    for (int i = 1; i < pool->n_acceptors; i++) {
+        int ret_val = pthread_join(pool->acceptors[i], NULL);
+        if (ret_val != 0) {
+            fprintf(stderr, "pthread_join failed: %s\n", strerror(ret_val));
+            result = -1;
+        }
+    }
+    while (drain && pool->n_workers > 0 && dispatcher_depth(&pool->dispatcher) > 0) {
+        usleep(DRAIN_POLL_MS * 1000);
+    }
+    if (dispatcher_shutdown(&pool->dispatcher)) {
+        result = -1;
+    }
+    for (int i = 0; i < pool->n_workers; i++) {
+        int ret_val = pthread_join(pool->workers[i], NULL);
+        if (ret_val != 0) {
+            fprintf(stderr, "pthread_join failed: %s\n", strerror(ret_val));
+            result = -1;
+        }
+    }
+
+    if (close(pool->shutdown_fd) == -1) {
+        perror("close");
+        result = -1;
+    }
+    if (dispatcher_free(&pool->dispatcher)) {
+        // error message printed in connection_queue_free()/work_scheduler_free()
+        result = -1;
+    }
+    free(pool->workers);
+    free(pool->worker_args);
+    free(pool->acceptors);
+    free(pool->acceptor_args);
+    return result;
+}
+
+/**
+ * @brief Start the workers and acceptor threads of a thread pool
+ *
+ * @details The main thread is acceptor 0, accepting from the first listening socket with
+ * accept_connections() once this returns; every other listening socket gets an acceptor thread
+ * of its own
+ *
+ * @param pool the thread_pool_t to start
+ * @param config the scheduler, number of workers and queue capacity to use
+ * @param paths the cache of paths resolved beneath the served directory
+ * @return 0 on success or -1 on error
+ */
+int thread_pool_start(thread_pool_t *pool, const server_config_t *config, path_cache_t *paths) {
+    // The server this one took the sockets over from may have left them blocking
+    for (int i = 0; i < n_listeners; i++) {
+        int flags = fcntl(listen_fds[i], F_GETFL);
+        if (flags == -1 || fcntl(listen_fds[i], F_SETFL, flags | O_NONBLOCK) == -1) {
+            perror("fcntl");
+            return -1;
+        }
+    }
+
+    if (dispatcher_init(&pool->dispatcher, config->scheduler, config->n_workers,
+                        config->queue_capacity)) {
+        // error message printed in connection_queue_init()/work_scheduler_init()
+        return -1;
+    }
+    pool->paths = paths;
+    pool->draining = 0;
+    pool->shutdown_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (pool->shutdown_fd == -1) {
+        perror("eventfd");
+        dispatcher_free(&pool->dispatcher);
+        return -1;
+    }
+    pool->workers = malloc(config->n_workers * sizeof(pthread_t));
+    pool->worker_args = malloc(config->n_workers * sizeof(worker_arg_t));
+    pool->acceptors = malloc(n_listeners * sizeof(pthread_t));
+    pool->acceptor_args = malloc(n_listeners * sizeof(acceptor_arg_t));
+    if (pool->workers == NULL || pool->worker_args == NULL || pool->acceptors == NULL ||
+        pool->acceptor_args == NULL) {
+        perror("malloc");
+        free(pool->workers);
+        free(pool->worker_args);
+        free(pool->acceptors);
+        free(pool->acceptor_args);
+        close(pool->shutdown_fd);
+        dispatcher_free(&pool->dispatcher);
+        return -1;
+    }
+
+    int result = 0;
+    for (pool->n_workers = 0; pool->n_workers < config->n_workers; pool->n_workers++) {
+        worker_arg_t *worker = &pool->worker_args[pool->n_workers];
+        worker->pool = pool;
+        worker->index = pool->n_workers;
+        int ret_val = affinity_thread_create(&pool->workers[pool->n_workers], worker->index,
+                                             worker_thread, worker);
+        if (ret_val != 0) {
+            fprintf(stderr, "error creating thread number %d: %s\n", worker->index,
+                    strerror(ret_val));
+            result = -1;
+            break;
+        }
+    }
+
+    // Acceptor 0 is the main thread itself, so its entry in acceptors is never joined
+    pool->n_acceptors = 0;
+    for (; result == 0 && pool->n_acceptors < n_listeners; pool->n_acceptors++) {
+        acceptor_arg_t *acceptor = &pool->acceptor_args[pool->n_acceptors];
+        acceptor->pool = pool;
+        acceptor->index = pool->n_acceptors;
+        if (acceptor->index == 0) {
             continue;
         }
+        int ret_val = affinity_thread_create(&pool->acceptors[acceptor->index], acceptor->index,
+                                             acceptor_thread, acceptor);
+        if (ret_val != 0) {
+            fprintf(stderr, "error creating acceptor number %d: %s\n", acceptor->index,
+                    strerror(ret_val));
+            result = -1;
+            break;
+        }
+    }
 
-        close(fd);    // TODO: error check
+    if (result != 0) {
+        thread_pool_stop(pool, 0);
     }
+    return result;
+}
 
+/**
+ * @brief Report the queue depth gauge of a generation
+ *
+ * @details Registered along with the generation it reports on; a metrics render racing with a
+ * reload may pass it another generation, which is still alive
+ *
+ * @param arg should be a generation_t pointer
+ * @return the connections waiting in its thread pool, or 0 if it runs another engine
+ */
+long generation_queue_depth(void *arg) {
+    generation_t *generation = (generation_t *) arg;
+    if (generation->engine != ENGINE_THREADS) {
+        return 0;
+    }
+    return dispatcher_depth(&generation->pool.dispatcher);
+}
+
+/**
+ * @brief Make a generation's settings, MIME table and caches the ones requests are served with
+ *
+ * @details Connections of generations that are still draining pick them up for any request they
+ * start from now on
+ *
+ * @param generation the generation to serve with
+ * @return 0 on success or -1 on error
+ */
+int apply_generation(generation_t *generation) {
+    const server_config_t *config = &generation->config;
+    http_connection_set_keep_alive(config->idle_timeout_ms, config->max_requests);
+    http_connection_set_timeouts(config->header_timeout_ms, config->send_timeout_ms);
+    set_transmit_mode(config->transmit);
+    set_mmap_threshold(config->mmap_threshold);
+    set_io_chunk_size(config->io_chunk_size);
+    set_max_age_rules(config->max_age_rules, config->n_max_age_rules);
+    admission_configure(config->shed_queue_depth, config->shed_wait_ms, config->retry_after);
+    set_path_cache(&generation->paths);
+    set_mime_table(&generation->mime_table);
+    set_file_cache(config->cache_bytes > 0 ? &generation->file_cache : NULL);
+    set_gzip_cache(config->gzip_cache_bytes > 0 ? &generation->gzip_cache : NULL);
+    set_fd_cache(config->fd_cache_entries > 0 ? &generation->fd_cache : NULL);
+    metrics_set_queue_depth(
+        generation->engine == ENGINE_THREADS ? generation_queue_depth : NULL, generation);
+    if (affinity_configure(config->pin_cpus) || affinity_steer_listeners(listen_fds, n_listeners)) {
+        // error message printed in affinity_configure()/affinity_steer_listeners()
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Free a generation whose engine has stopped, along with the reloads that failed while it
+ * served
+ *
+ * @param generation the generation to free
+ * @return 0 on success or -1 on error
+ */
+int close_generation(generation_t *generation) {
+    int result = 0;
+    while (generation != NULL) {
+        const server_config_t *config = &generation->config;
+        if (config->fd_cache_entries > 0 && fd_cache_free(&generation->fd_cache)) {
+            result = -1;
+        }
+        if (config->gzip_cache_bytes > 0 && file_cache_free(&generation->gzip_cache)) {
+            result = -1;
+        }
+        if (config->cache_bytes > 0 && file_cache_free(&generation->file_cache)) {
+            result = -1;
+        }
+        mime_table_free(&generation->mime_table);
+        if (path_cache_free(&generation->paths)) {
+            result = -1;
+        }
+        generation_t *failed = generation->failed;
+        free(generation);
+        generation = failed;
+    }
+    return result;
+}
+
+/**
+ * @brief Open the served directory, MIME table and caches a configuration calls for
+ *
+ * @param config the configuration, which is copied
+ * @return a new generation with no engine running yet, or NULL on error
+ */
+generation_t *open_generation(const server_config_t *config) {
+    generation_t *generation = malloc(sizeof(generation_t));
+    if (generation == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    generation->config = *config;
+    generation->has_older = 0;
+    generation->failed = NULL;
+    config = &generation->config;
+
+    // Resources are opened beneath the served directory rather than looked up from the top.
+    // Every generation opens it again, since the directory may have been replaced or reconfigured.
+    if (path_cache_init(&generation->paths, config->serve_dir, DEFAULT_PATH_CACHE_ENTRIES)) {
+        // error message printed in path_cache_init()
+        free(generation);
+        return NULL;
+    }
+    if (mime_table_init(&generation->mime_table)) {
+        // error message printed in mime_table_init()
+        path_cache_free(&generation->paths);
+        free(generation);
+        return NULL;
+    }
+    if (config->mime_types[0] != '\0' &&
+        mime_table_load(&generation->mime_table, config->mime_types)) {
+        // error message printed in mime_table_load()
+        mime_table_free(&generation->mime_table);
+        path_cache_free(&generation->paths);
+        free(generation);
+        return NULL;
+    }
+    if (config->cache_bytes > 0 && file_cache_init(&generation->file_cache, config->cache_bytes)) {
+        // error message printed in file_cache_init()
+        mime_table_free(&generation->mime_table);
+        path_cache_free(&generation->paths);
+        free(generation);
+        return NULL;
+    }
+    if (config->gzip_cache_bytes > 0 &&
+        file_cache_init(&generation->gzip_cache, config->gzip_cache_bytes)) {
+        // error message printed in file_cache_init()
+        if (config->cache_bytes > 0) {
+            file_cache_free(&generation->file_cache);
+        }
+        mime_table_free(&generation->mime_table);
+        path_cache_free(&generation->paths);
+        free(generation);
+        return NULL;
+    }
+    if (config->fd_cache_entries > 0 &&
+        fd_cache_init(&generation->fd_cache, config->fd_cache_entries)) {
+        // error message printed in fd_cache_init()
+        if (config->gzip_cache_bytes > 0) {
+            file_cache_free(&generation->gzip_cache);
+        }
+        if (config->cache_bytes > 0) {
+            file_cache_free(&generation->file_cache);
+        }
+        mime_table_free(&generation->mime_table);
+        path_cache_free(&generation->paths);
+        free(generation);
+        return NULL;
+    }
+    return generation;
+}
+
+/**
+ * @brief Stop the engine of a generation
+ *
+ * @param generation the generation whose engine is running
+ * @param drain whether to let the connections finish
+ * @return 0 on success or -1 on error
+ */
+int stop_engine(generation_t *generation, int drain) {
+    if (generation->engine == ENGINE_URING) {
+        return uring_engine_stop(&generation->uring, drain);
+    } else if (generation->engine == ENGINE_EPOLL) {
+        return event_engine_stop(&generation->events, drain);
+    }
+    return thread_pool_stop(&generation->pool, drain);
+}
+
+/**
+ * @brief Start serving a configuration on the listening sockets, alongside the current generation
+ * if there is one
+ *
+ * @details Falls back to the epoll event engine when the kernel lacks io_uring or any operation
+ * the io_uring engine needs, or refuses its rings. All signals must be blocked, so the engine's threads inherit that
+ * mask. On failure the current generation's settings are applied again; connections of the
+ * current generation may have picked up the failed one's caches meanwhile, so it is only freed
+ * along with the current generation.
+ *
+ * @param config the configuration to serve
+ * @param current the generation serving clients so far, or NULL
+ * @return the new generation, or NULL on error
+ */
+generation_t *start_generation(const server_config_t *config, generation_t *current) {
+    generation_t *generation = open_generation(config);
+    if (generation == NULL) {
+        // error message printed in open_generation()
+        return NULL;
+    }
+    generation->engine = config->engine;
+    if (generation->engine == ENGINE_URING && !uring_engine_supported()) {
+        fprintf(stderr, "io_uring is unavailable, using the epoll engine instead\n");
+        generation->engine = ENGINE_EPOLL;
+    }
+
+    int result = apply_generation(generation);
+    if (result == 0 && generation->engine == ENGINE_URING) {
+        result = uring_engine_start(&generation->uring, listen_fds, n_listeners,
+                                    &generation->paths, config->n_workers);
+        if (result == URING_UNAVAILABLE) {
+            // error message printed in uring_engine_start()
+            fprintf(stderr, "io_uring is unavailable, using the epoll engine instead\n");
+            generation->engine = ENGINE_EPOLL;
+            result = 0;
+        }
+    }
+    if (result == 0 && generation->engine == ENGINE_EPOLL) {
+        result = event_engine_start(&generation->events, listen_fds, n_listeners,
+                                    &generation->paths, config->n_workers);
+    } else if (result == 0 && generation->engine == ENGINE_THREADS) {
+        result = thread_pool_start(&generation->pool, config, &generation->paths);
+    }
+    if (result == 0) {
+        return generation;
+    }
+
+    // error message printed in apply_generation() or the engine's start function
+    if (current == NULL) {
+        close_generation(generation);
+    } else {
+        apply_generation(current);
+        generation->failed = current->failed;
+        current->failed = generation;
+    }
     return NULL;
 }
 
 /**
- * @brief Helper function to cleanup threads on error
+ * @brief Join the thread retiring a generation, which has joined those replaced before it
  *
- * @details iterates from start_val to end_val-1 and joins the thread at that index in threads.
- * Calling join_multiple_threads(0, N_THREADS,...) will join all threads
+ * @param thread the thread started by retire_generation()
+ * @return 0 on success or -1 if retiring any of the generations failed
+ */
+int join_retirer(pthread_t thread) {
+    void *retired;
+    int ret_val = pthread_join(thread, &retired);
+    if (ret_val != 0) {
+        fprintf(stderr, "pthread_join failed: %s\n", strerror(ret_val));
+        return -1;
+    }
+    return retired == NULL ? 0 : -1;
+}
+
+/**
+ * @brief Thread function that drains a replaced generation and frees it
+ *
+ * @details Connections of the generations replaced before it may hold entries of its caches, as
+ * they pick up the newest settings, so it is only freed once those are
  *
- * @param start_val initial index of thread to start joining (inclusive)
- * @param end_val final index of iteration (exclusive)
+ * @param arg should be the generation_t to retire
+ * @return NULL on success, or arg if anything failed
  */
-void join_multiple_threads(int start_val, int end_val, pthread_t threads[N_THREADS]) {
-    for (int j = start_val; j < end_val; j++) {
-        // pthread_join() not error checked because this function is only called during the cleanup
-        // of another error Final join loop only uses this function in the error case
-        pthread_join(threads[j], NULL);
+void *retire_thread(void *arg) {
+    generation_t *generation = (generation_t *) arg;
+    int result = stop_engine(generation, 1);
+    if (generation->has_older && join_retirer(generation->older)) {
+        result = -1;
+    }
+    if (close_generation(generation)) {
+        result = -1;
     }
+    return result == 0 ? NULL : arg;
 }
 
-int main(int argc, char **argv) {
-    // First argument is directory to serve, second is port
-    if (argc != 3) {
-        printf("Usage: %s <directory> <port>\n", argv[0]);
-        return 1;
+/**
+ * @brief Drain a generation that has been replaced, and free it, in the background
+ *
+ * @details If no thread can be started for that, the main thread does it instead
+ *
+ * @param generation the generation to retire, no longer accepted for by the main thread
+ * @return 0 on success or -1 on error
+ */
+int retire_generation(generation_t *generation) {
+    generation->older = retirer;
+    generation->has_older = retiring;
+    int ret_val = pthread_create(&retirer, NULL, retire_thread, generation);
+    if (ret_val == 0) {
+        retiring = 1;
+        return 0;
     }
 
-    serve_dir = argv[1];
-    const char *port = argv[2];
+    fprintf(stderr, "error creating thread to retire a configuration: %s\n", strerror(ret_val));
+    retiring = 0;
+    return retire_thread(generation) == NULL ? 0 : -1;
+}
 
-    // Create worker threads
-    connection_queue_t queue;
-    if (connection_queue_init(&queue)) {
-        // error message printed in connection_queue_init()
-        // no need to free connection queue
-        return 1;
+/**
+ * @brief Serve the reread configuration in a new generation, then retire the current one
+ *
+ * @details If the configuration cannot be read or served, the current generation carries on
+ *
+ * @param current the generation serving clients, replaced on success
+ * @return 0 on success or -1 if retiring the current generation failed
+ */
+int reload_generation(generation_t **current) {
+    server_config_t config;
+    generation_t *next = NULL;
+    if (parse_arguments(server_argc, server_argv, &config) != -1 && !update_listeners(&config)) {
+        next = start_generation(&config, *current);
+    }
+    if (next == NULL) {
+        // error message printed in parse_arguments(), update_listeners() or start_generation()
+        fprintf(stderr, "reload failed: keeping the current configuration\n");
+        return 0;
+    }
+
+    generation_t *replaced = *current;
+    *current = next;
+    return retire_generation(replaced);
+}
+
+/**
+ * @brief Act on the signals, and the successor's report, that ended the main thread's wait
+ *
+ * @details SIGINT stops the server at once. SIGHUP rereads the configuration and serves it in a
+ * new generation while the old one drains, and SIGUSR2 starts a successor process, which this
+ * server drains for once it is serving; if either fails the server keeps serving as it was.
+ *
+ * @param current the generation serving clients, replaced by a reload
+ * @return STOP_NOW, STOP_DRAIN, or STOP_NONE to go on serving
+ */
+stop_mode_t next_stop_mode(generation_t **current) {
+    if (!keep_going) {
+        return STOP_NOW;
+    }
+    if (successor_pid != -1 && check_successor() == 1) {
+        return STOP_DRAIN;
+    }
+    if (upgrade_requested) {
+        upgrade_requested = 0;
+        if (successor_pid == -1 && start_successor()) {
+            // error message printed in start_successor()
+            fprintf(stderr, "upgrade failed: keeping this server\n");
+        }
+    }
+    if (reload_requested) {
+        reload_requested = 0;
+        if (reload_generation(current)) {
+            // error message printed in reload_generation()
+            return STOP_NOW;
+        }
+    }
+    return STOP_NONE;
+}
+
+/**
+ * @brief Let the main thread serve until a signal or the successor needs it
+ *
+ * @details With the thread pool, the main thread accepts from the first listening socket
+ * meanwhile; the other engines need nothing from it, so it sleeps. Signals are unblocked only
+ * within ppoll(), so none can arrive between the check and the wait.
+ *
+ * @param current the generation serving clients
+ * @param main_mask the signal mask the main thread had before signals were blocked
+ * @return 0 on success or -1 on error
+ */
+int wait_for_events(generation_t *current, const sigset_t *main_mask) {
+    if (current->engine == ENGINE_THREADS) {
+        // Pinned only while accepting, so a successor started on SIGUSR2 does not inherit it
+        int failed =
+            affinity_pin(0) || accept_connections(&current->pool.acceptor_args[0], main_mask);
+        return affinity_unpin() || failed ? -1 : 0;
+    }
+
+    struct pollfd pfd = {.fd = successor_fd, .events = POLLIN};
+    while (!stop_requested()) {
+        struct timespec timeout;
+        if (ppoll(&pfd, 1, successor_timeout(&timeout), main_mask) != -1) {
+            break;    // the successor reported or ran out of time
+        } else if (errno != EINTR) {
+            perror("ppoll");
+            return -1;
+        }
     }
+    return 0;
+}
 
+/**
+ * @brief Install the handlers of the signals that stop, reload and upgrade the server
+ *
+ * @return 0 on success or -1 on error
+ */
+int install_signal_handlers(void) {
     // Catch SIGINT so we can clean up properly
     struct sigaction sigact;
-    sigact.sa_handler = handle_sigint;
     if (sigfillset(&sigact.sa_mask) == -1) {
         perror("sigfillset");
-        connection_queue_shutdown(&queue);
-        connection_queue_free(&queue);
-        return 1;
+        return -1;
     }
     sigact.sa_flags = 0;    // No SA_RESTART
+    sigact.sa_handler = handle_sigint;
     if (sigaction(SIGINT, &sigact, NULL) == -1) {
         perror("sigaction");
-        connection_queue_shutdown(&queue);
-        connection_queue_free(&queue);
-        return 1;
+        return -1;
     }
+    sigact.sa_handler = handle_sighup;
+    if (sigaction(SIGHUP, &sigact, NULL) == -1) {
+        perror("sigaction");
+        return -1;
+    }
+    sigact.sa_handler = handle_sigusr2;
+    if (sigaction(SIGUSR2, &sigact, NULL) == -1) {
+        perror("sigaction");
+        return -1;
+    }
+    return 0;
+}
 
-    // Setup TCP Server
-    struct addrinfo hints;
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;    // TCP
-    hints.ai_flags = AI_PASSIVE;        // Will be acting as a server
-
-    struct addrinfo *server;
-    int ret_val = getaddrinfo(NULL, port, &hints, &server);
-    if (ret_val) {
-        fprintf(stderr, "getaddrinfo failed: %s\n", gai_strerror(ret_val));
-        connection_queue_shutdown(&queue);
-        connection_queue_free(&queue);
+int main(int argc, char **argv) {
+    // Options tune the server; then the directory to serve and the port
+    server_argc = argc;
+    server_argv = argv;
+    server_config_t config;
+    int operands = parse_arguments(argc, argv, &config);
+    if (operands == -1) {
+        // error message printed in parse_arguments()
         return 1;
     }
-    sock_fd = socket(server->ai_family, server->ai_socktype, server->ai_protocol);
-    if (sock_fd == -1) {
-        perror("socket");
-        freeaddrinfo(server);
-        connection_queue_shutdown(&queue);
-        connection_queue_free(&queue);
-        return 1;
+    const char *port = argv[operands + 1];
+
+    // A server started by SIGUSR2 reports to its predecessor once it is serving
+    const char *ready = getenv(READY_FD_ENV);
+    if (ready != NULL) {
+        ready_fd = atoi(ready);
+        fcntl(ready_fd, F_SETFD, FD_CLOEXEC);
+        unsetenv(READY_FD_ENV);
     }
-    if (bind(sock_fd, server->ai_addr, server->ai_addrlen)) {
-        perror("bind");
-        freeaddrinfo(server);
-        connection_queue_shutdown(&queue);
-        connection_queue_free(&queue);
-        close(sock_fd);
+
+    // Setup TCP Server, or take over the one of the server this one upgrades
+    const char *inherited = getenv(LISTEN_FDS_ENV);
+    if (inherited != NULL ? inherit_listeners(inherited)
+                          : open_listeners(port, config.n_acceptors, config.backlog)) {
+        // error message printed in inherit_listeners()/open_listeners()
         return 1;
     }
-    if (listen(sock_fd, LISTEN_QUEUE_LEN)) {
-        perror("listen");
-        freeaddrinfo(server);
-        connection_queue_shutdown(&queue);
-        connection_queue_free(&queue);
-        close(sock_fd);
+    unsetenv(LISTEN_FDS_ENV);
+    if (install_signal_handlers()) {
+        // error message printed in install_signal_handlers()
+        close_listeners();
         return 1;
     }
-    freeaddrinfo(server);
 
     // Signal handling
-    sigset_t main_mask;      // set that stores current signal mask
-    sigset_t worker_mask;    // set used to block signals to worker threads
-    if (sigfillset(&worker_mask)) {
+    sigset_t main_mask;     // set that stores current signal mask
+    sigset_t all_mask;      // set used to block signals to every thread the server starts
+    if (sigfillset(&all_mask)) {
         perror("sigfillset");
-        connection_queue_shutdown(&queue);
-        connection_queue_free(&queue);
-        close(sock_fd);
+        close_listeners();
         return 1;
     }
-    // block all signals to workers
-    if (sigprocmask(SIG_BLOCK, &worker_mask, &main_mask)) {
+    // Block all signals: threads inherit the mask, and the main thread only takes signals while
+    // it waits in ppoll()
+    if (sigprocmask(SIG_BLOCK, &all_mask, &main_mask)) {
         perror("sigprocmask");
-        connection_queue_shutdown(&queue);
-        connection_queue_free(&queue);
-        close(sock_fd);
+        close_listeners();
         return 1;
     }
 
-    pthread_t threads[N_THREADS];
-    for (int i = 0; i < N_THREADS; i++) {
-        int ret_val = pthread_create(&threads[i], NULL, worker_thread, &queue);
-        if (ret_val != 0) {
-            fprintf(stderr, "error creating thread number %d: %s", i, strerror(ret_val));
-            connection_queue_shutdown(&queue);
-            join_multiple_threads(0, i, threads);
-            connection_queue_free(&queue);
-            close(sock_fd);
-            return 1;
-        }
-    }
-
-    // Revert to mask from before creating threads, so main thread can receive signals
-    if (sigprocmask(SIG_SETMASK, &main_mask, NULL)) {
-        perror("sigprocmask");
-        connection_queue_shutdown(&queue);
-        join_multiple_threads(0, N_THREADS, threads);
-        connection_queue_free(&queue);
-        close(sock_fd);
+    generation_t *current = start_generation(&config, NULL);
+    if (current == NULL) {
+        // error message printed in start_generation()
+        close_listeners();
+        metrics_free();
         return 1;
     }
+    notify_ready();
 
-    // Main thread loop
-    while (keep_going) {
-        int client_fd = accept(sock_fd, NULL, NULL);
-        if (client_fd < 0) {
-            if (errno == EINTR) {
-                break;
-            }
-            perror("accept");
-            connection_queue_shutdown(&queue);
-            join_multiple_threads(0, N_THREADS, threads);
-            connection_queue_free(&queue);
-            close(sock_fd);
-            return 1;
-        }
-        if (connection_queue_enqueue(&queue, client_fd)) {
-            connection_queue_shutdown(&queue);
-            join_multiple_threads(0, N_THREADS, threads);
-            connection_queue_free(&queue);
-            close(client_fd);
-            close(sock_fd);
-            return 1;
-        }
-        if (close(client_fd) == -1) {
-            perror("close");
-            connection_queue_shutdown(&queue);
-            join_multiple_threads(0, N_THREADS, threads);
-            connection_queue_free(&queue);
-            close(sock_fd);
-            return 1;
+    // Main thread loop, until a signal or a serving successor stops the server. SIGHUP serves the
+    // reread configuration alongside the current one, which drains in the background.
+    int result = 0;
+    stop_mode_t mode = STOP_NONE;
+    while (mode == STOP_NONE) {
+        if (wait_for_events(current, &main_mask)) {
+            // error message printed in wait_for_events()
+            result = 1;
+            break;
         }
+        mode = next_stop_mode(&current);
     }
 
-    // Once SIGINT has been sent
-    if (connection_queue_shutdown(&queue)) {
-        join_multiple_threads(0, N_THREADS, threads);
-        connection_queue_free(&queue);
-        close(sock_fd);
-        return 1;
+    if (successor_pid != -1) {
+        kill_successor();
     }
-    if (close(sock_fd)) {
-        perror("close");
-        join_multiple_threads(0, N_THREADS, threads);
-        connection_queue_free(&queue);
-        return 1;
+    if (stop_engine(current, mode == STOP_DRAIN)) {
+        result = 1;
     }
-    for (int i = 0; i < N_THREADS; i++) {
-        int result = pthread_join(threads[i], NULL);
-        if (result != 0) {
-            fprintf(stderr, "pthread_join failed: %s\n", strerror(result));
-            join_multiple_threads(i + 1, N_THREADS, threads);
-            connection_queue_free(&queue);
-            return 1;
-        }
+    if (retiring && join_retirer(retirer)) {
+        result = 1;
     }
-    if (connection_queue_free(&queue)) {
-        // error message printed in connection_queue_free()
-        return 1;
+    if (close_generation(current)) {
+        result = 1;
     }
-
-    return 0;
+    if (close_listeners()) {
+        result = 1;
+    }
+    metrics_free();
+    return result;
 }
@@ -0,0 +1,696 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_CONNECTIONS 16
+#define DEFAULT_DURATION_S 5
+#define DEFAULT_THREADS 1
+#define DEFAULT_RESOURCE_DIR "server_files"
+#define REQUEST_BUFSIZE 1024
+#define RESPONSE_HEADER_BUFSIZE 1024
+#define READ_BUFSIZE 65536
+#define MAX_EVENTS 64
+#define POLL_INTERVAL_MS 100
+
+// Results of receive_response besides a status code (done) and 0 (more to come)
+#define RESPONSE_ERROR -1
+#define RESPONSE_CLOSED -2    // reused keep-alive connection was closed before the response
+
+// A file to request and how often, relative to the other files in the mix
+typedef struct {
+    char *name;
+    int weight;
+} resource_t;
+
+// Where one connection is in its current request
+typedef enum {
+    BENCH_SENDING,      // connecting or writing the request
+    BENCH_RECEIVING,    // reading the response header and body
+} bench_state_t;
+
+// A client connection and the request it has in flight
+typedef struct {
+    int fd;
+    bench_state_t state;
+    int requests_served;    // completed on this connection, to recognize a closed keep-alive
+    long long start_ns;     // when the request in flight was started, connect included
+
+    char request[REQUEST_BUFSIZE];
+    size_t request_len;
+    size_t request_sent;
+
+    char header[RESPONSE_HEADER_BUFSIZE];    // response header received so far
+    size_t header_len;
+    int header_done;
+    int status;
+    int close_after;    // server will close the connection once the response is done
+    long long body_left;
+} bench_connection_t;
+
+// One load generating thread, its connections and everything it measured
+typedef struct {
+    pthread_t thread;
+    int n_connections;
+    uint64_t rng;
+
+    long requests;
+    long non_2xx;
+    long errors;
+    long long bytes;
+    unsigned *latencies_us;
+    long n_latencies;
+    long latencies_cap;
+} bench_thread_t;
+
+static struct addrinfo *server;
+static const char *host;
+static resource_t *resources;
+static int n_resources;
+static int total_weight;
+static int keep_alive = 0;
+static long long deadline_ns;
+
+/*
+ * Read the monotonic clock
+ * Returns the current time in nanoseconds
+ */
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Pick the next resource to request, weighted by the mix
+ * Returns an index into resources
+ */
+static int pick_resource(bench_thread_t *thread) {
+    // xorshift64 keeps each thread's sequence independent without locking
+    thread->rng ^= thread->rng << 13;
+    thread->rng ^= thread->rng >> 7;
+    thread->rng ^= thread->rng << 17;
+    int target = thread->rng % total_weight;
+    for (int i = 0; i < n_resources; i++) {
+        target -= resources[i].weight;
+        if (target < 0) {
+            return i;
+        }
+    }
+    return n_resources - 1;
+}
+
+/*
+ * Record a request's latency and outcome once its whole response has arrived
+ * Returns 0 on success or -1 if the latency could not be stored
+ */
+static int record_response(bench_thread_t *thread, bench_connection_t *conn, int status) {
+    thread->requests++;
+    if (status < 200 || status > 299) {
+        thread->non_2xx++;
+    }
+    if (thread->n_latencies == thread->latencies_cap) {
+        long cap = thread->latencies_cap > 0 ? thread->latencies_cap * 2 : 4096;
+        unsigned *latencies = realloc(thread->latencies_us, cap * sizeof(unsigned));
+        if (latencies == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        thread->latencies_us = latencies;
+        thread->latencies_cap = cap;
+    }
+    thread->latencies_us[thread->n_latencies++] = (now_ns() - conn->start_ns) / 1000;
+    return 0;
+}
+
+/*
+ * Forget any part of the request already sent and of its response already received
+ */
+static void restart_request(bench_connection_t *conn) {
+    conn->request_sent = 0;
+    conn->header_len = 0;
+    conn->header_done = 0;
+    conn->close_after = !keep_alive;
+    conn->body_left = 0;
+    conn->state = BENCH_SENDING;
+}
+
+/*
+ * Render the request for a randomly picked resource and start timing it
+ */
+static void prepare_request(bench_thread_t *thread, bench_connection_t *conn) {
+    const char *name = resources[pick_resource(thread)].name;
+    if (keep_alive) {
+        conn->request_len = snprintf(conn->request, REQUEST_BUFSIZE,
+                                     "GET /%s HTTP/1.1\r\nHost: %s\r\n\r\n", name, host);
+    } else {
+        conn->request_len =
+            snprintf(conn->request, REQUEST_BUFSIZE, "GET /%s HTTP/1.0\r\n\r\n", name);
+    }
+    restart_request(conn);
+    conn->start_ns = now_ns();
+}
+
+/*
+ * Start a new connection to the server and register it for writability
+ * Returns 0 on success or -1 on error
+ */
+static int open_connection(int epoll_fd, bench_connection_t *conn) {
+    conn->fd = socket(server->ai_family, server->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                      server->ai_protocol);
+    if (conn->fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    conn->requests_served = 0;
+    if (connect(conn->fd, server->ai_addr, server->ai_addrlen) == -1 && errno != EINPROGRESS) {
+        close(conn->fd);
+        conn->fd = -1;
+        return -1;
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLOUT;
+    event.data.ptr = conn;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->fd, &event) == -1) {
+        perror("epoll_ctl");
+        close(conn->fd);
+        conn->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static void close_connection(bench_connection_t *conn) {
+    if (conn->fd != -1) {
+        close(conn->fd);    // also removes it from the epoll set
+        conn->fd = -1;
+    }
+}
+
+/*
+ * Parse the status code, Content-Length and Connection header of a complete response header
+ * Returns the status code or -1 if the header is malformed
+ */
+static int parse_response_header(bench_connection_t *conn) {
+    int minor_version;
+    int status;
+    if (sscanf(conn->header, "HTTP/1.%d %d", &minor_version, &status) != 2) {
+        return -1;
+    }
+    conn->close_after = !keep_alive || minor_version == 0;
+    conn->body_left = -1;
+
+    char *line = strstr(conn->header, "\r\n");
+    while (line != NULL && strncmp(line, "\r\n\r\n", 4) != 0) {
+        line += 2;
+        if (strncasecmp(line, "Content-Length:", strlen("Content-Length:")) == 0) {
+            conn->body_left = atoll(line + strlen("Content-Length:"));
+        } else if (strncasecmp(line, "Connection:", strlen("Connection:")) == 0) {
+            const char *value = line + strlen("Connection:");
+            while (*value == ' ') {
+                value++;
+            }
+            if (strncasecmp(value, "close", strlen("close")) == 0) {
+                conn->close_after = 1;
+            } else if (strncasecmp(value, "keep-alive", strlen("keep-alive")) == 0) {
+                conn->close_after = !keep_alive;
+            }
+        }
+        line = strstr(line, "\r\n");
+    }
+    if (conn->body_left < 0) {
+        return -1;    // every response from http_server has a Content-Length
+    }
+    return status;
+}
+
+/*
+ * Change which readiness event epoll reports for a connection
+ * Returns 0 on success or -1 on error
+ */
+static int watch_connection(int epoll_fd, bench_connection_t *conn, unsigned events) {
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = conn;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &event) == -1) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Write as much of the request as the socket accepts
+ * Returns 0 once it is all sent, 1 if the socket is full, or -1 on error
+ */
+static int send_request(bench_connection_t *conn) {
+    while (conn->request_sent < conn->request_len) {
+        ssize_t num_written = send(conn->fd, conn->request + conn->request_sent,
+                                   conn->request_len - conn->request_sent, MSG_NOSIGNAL);
+        if (num_written == -1) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+            return -1;
+        }
+        conn->request_sent += num_written;
+    }
+    conn->state = BENCH_RECEIVING;
+    return 0;
+}
+
+/*
+ * Read whatever has arrived of the response
+ * Returns the status code once the response is complete, 0 if more is expected, RESPONSE_ERROR,
+ * or RESPONSE_CLOSED
+ */
+static int receive_response(bench_thread_t *thread, bench_connection_t *conn) {
+    char buffer[READ_BUFSIZE];
+    while (1) {
+        ssize_t num_read = read(conn->fd, buffer, sizeof(buffer));
+        if (num_read == -1) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            } else if (errno == ECONNRESET && conn->header_len == 0 &&
+                       conn->requests_served > 0) {
+                return RESPONSE_CLOSED;
+            }
+            return RESPONSE_ERROR;
+        } else if (num_read == 0) {
+            return conn->header_len == 0 && conn->requests_served > 0 ? RESPONSE_CLOSED
+                                                                      : RESPONSE_ERROR;
+        }
+        thread->bytes += num_read;
+
+        size_t body_bytes = num_read;
+        if (!conn->header_done) {
+            size_t room = RESPONSE_HEADER_BUFSIZE - 1 - conn->header_len;
+            size_t copied = (size_t) num_read < room ? (size_t) num_read : room;
+            memcpy(conn->header + conn->header_len, buffer, copied);
+            size_t searched_from = conn->header_len > 3 ? conn->header_len - 3 : 0;
+            conn->header_len += copied;
+            conn->header[conn->header_len] = '\0';
+
+            char *end = strstr(conn->header + searched_from, "\r\n\r\n");
+            if (end == NULL) {
+                if (conn->header_len == RESPONSE_HEADER_BUFSIZE - 1) {
+                    return RESPONSE_ERROR;    // header too large
+                }
+                continue;
+            }
+            size_t header_size = end + 4 - conn->header;
+            // Bytes of this read past the end of the header are the start of the body
+            body_bytes = num_read - (header_size - (conn->header_len - copied));
+            end[4] = '\0';
+            conn->header_done = 1;
+            conn->status = parse_response_header(conn);
+            if (conn->status == -1) {
+                return RESPONSE_ERROR;
+            }
+        }
+
+        conn->body_left -= body_bytes;
+        if (conn->body_left < 0) {
+            return RESPONSE_ERROR;    // more bytes than the response declared
+        } else if (conn->body_left == 0) {
+            return conn->status;
+        }
+    }
+}
+
+/*
+ * Send the connection's current request over a new connection, closing the old one
+ * A connection that fails is counted as an error and replaced on a later attempt.
+ */
+static void reconnect(bench_thread_t *thread, int epoll_fd, bench_connection_t *conn) {
+    close_connection(conn);
+    restart_request(conn);
+    if (open_connection(epoll_fd, conn)) {
+        thread->errors++;
+    }
+}
+
+/*
+ * Write the request on a connection and watch for whatever it needs next
+ * Returns 0 on success or -1 on error
+ */
+static int continue_sending(int epoll_fd, bench_connection_t *conn) {
+    int result = send_request(conn);
+    if (result == -1) {
+        return -1;
+    }
+    return watch_connection(epoll_fd, conn, result == 0 ? EPOLLIN : EPOLLOUT);
+}
+
+/*
+ * Advance a connection that epoll reported as ready
+ */
+static void service_connection(bench_thread_t *thread, int epoll_fd, bench_connection_t *conn) {
+    if (conn->state == BENCH_SENDING) {
+        if (continue_sending(epoll_fd, conn)) {
+            thread->errors++;
+            prepare_request(thread, conn);
+            reconnect(thread, epoll_fd, conn);
+        }
+        return;
+    }
+
+    int status = receive_response(thread, conn);
+    if (status == 0) {
+        return;
+    } else if (status == RESPONSE_CLOSED) {
+        // The server ended the keep-alive connection between requests; this is not an error, so
+        // resend the request, with the new connection's setup counted in its latency
+        reconnect(thread, epoll_fd, conn);
+        return;
+    } else if (status == RESPONSE_ERROR) {
+        thread->errors++;
+        prepare_request(thread, conn);
+        reconnect(thread, epoll_fd, conn);
+        return;
+    }
+
+    if (record_response(thread, conn, status)) {
+        deadline_ns = 0;    // out of memory, so stop every thread
+    }
+    conn->requests_served++;
+    if (now_ns() >= deadline_ns) {
+        close_connection(conn);
+        return;
+    }
+    prepare_request(thread, conn);
+    if (conn->close_after) {
+        reconnect(thread, epoll_fd, conn);
+    } else if (continue_sending(epoll_fd, conn)) {
+        thread->errors++;
+        reconnect(thread, epoll_fd, conn);
+    }
+}
+
+/**
+ * @brief Load generating thread: keep n_connections requests in flight until the deadline
+ *
+ * @param arg should be a bench_thread_t pointer owned by this thread
+ */
+static void *bench_thread(void *arg) {
+    bench_thread_t *thread = (bench_thread_t *) arg;
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        perror("epoll_create1");
+        return NULL;
+    }
+    bench_connection_t *conns = calloc(thread->n_connections, sizeof(bench_connection_t));
+    if (conns == NULL) {
+        perror("calloc");
+        close(epoll_fd);
+        return NULL;
+    }
+
+    for (int i = 0; i < thread->n_connections; i++) {
+        conns[i].fd = -1;
+        prepare_request(thread, &conns[i]);
+        reconnect(thread, epoll_fd, &conns[i]);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (now_ns() < deadline_ns) {
+        int n_events = epoll_wait(epoll_fd, events, MAX_EVENTS, POLL_INTERVAL_MS);
+        if (n_events == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n_events; i++) {
+            service_connection(thread, epoll_fd, events[i].data.ptr);
+        }
+    }
+
+    for (int i = 0; i < thread->n_connections; i++) {
+        close_connection(&conns[i]);
+    }
+    free(conns);
+    close(epoll_fd);
+    return NULL;
+}
+
+/*
+ * Add every regular file in a directory to the mix with weight 1
+ * Returns 0 on success or -1 on error
+ */
+static int add_directory(const char *dir_path) {
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL) {
+        perror("opendir");
+        return -1;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        char path[REQUEST_BUFSIZE];
+        struct stat stat_buf;
+        snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
+        if (stat(path, &stat_buf) == -1 || !S_ISREG(stat_buf.st_mode)) {
+            continue;
+        }
+        resource_t *grown = realloc(resources, (n_resources + 1) * sizeof(resource_t));
+        if (grown == NULL || (grown[n_resources].name = strdup(entry->d_name)) == NULL) {
+            perror("malloc");
+            resources = grown != NULL ? grown : resources;
+            closedir(dir);
+            return -1;
+        }
+        resources = grown;
+        resources[n_resources++].weight = 1;
+        total_weight++;
+    }
+    closedir(dir);
+    return 0;
+}
+
+/*
+ * Add one "name[=weight]" argument to the mix
+ * Returns 0 on success or -1 if the argument is invalid
+ */
+static int add_resource(const char *arg) {
+    resource_t *grown = realloc(resources, (n_resources + 1) * sizeof(resource_t));
+    if (grown == NULL) {
+        perror("realloc");
+        return -1;
+    }
+    resources = grown;
+    resource_t *resource = &resources[n_resources];
+    resource->name = strdup(arg);
+    if (resource->name == NULL) {
+        perror("strdup");
+        return -1;
+    }
+    resource->weight = 1;
+    char *equals = strrchr(resource->name, '=');
+    if (equals != NULL) {
+        *equals = '\0';
+        resource->weight = atoi(equals + 1);
+    }
+    if (resource->weight < 1 || strlen(resource->name) > REQUEST_BUFSIZE / 2) {
+        fprintf(stderr, "invalid resource %s\n", arg);
+        free(resource->name);
+        return -1;
+    }
+    n_resources++;
+    total_weight += resource->weight;
+    return 0;
+}
+
+static int compare_unsigned(const void *a, const void *b) {
+    unsigned x = *(const unsigned *) a;
+    unsigned y = *(const unsigned *) b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Get a percentile of sorted latencies
+ * Returns the latency at or below which the fraction q of all latencies fall, or 0 if none
+ */
+static unsigned percentile(const unsigned *sorted, long n, double q) {
+    if (n == 0) {
+        return 0;
+    }
+    long rank = (long) (q * n + 0.999999);
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static void print_usage(const char *program) {
+    printf("Usage: %s [-c connections] [-d seconds] [-t threads] [-k] [-j] [-l label] "
+           "[-D directory] <host> <port> [resource[=weight] ...]\n",
+           program);
+    printf("  Requests resources in proportion to their weights; without any, every file in the "
+           "directory (default %s) is requested equally\n",
+           DEFAULT_RESOURCE_DIR);
+    printf("  -k reuses connections with HTTP/1.1 keep-alive; -j prints one JSON object; defaults "
+           "are -c %d -d %d -t %d\n",
+           DEFAULT_CONNECTIONS, DEFAULT_DURATION_S, DEFAULT_THREADS);
+}
+
+int main(int argc, char **argv) {
+    int n_connections = DEFAULT_CONNECTIONS;
+    int duration_s = DEFAULT_DURATION_S;
+    int n_threads = DEFAULT_THREADS;
+    int json = 0;
+    const char *label = "";
+    const char *resource_dir = DEFAULT_RESOURCE_DIR;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:d:t:kjl:D:")) != -1) {
+        if (opt == 'c' && (n_connections = atoi(optarg)) > 0) {
+            continue;
+        } else if (opt == 'd' && (duration_s = atoi(optarg)) > 0) {
+            continue;
+        } else if (opt == 't' && (n_threads = atoi(optarg)) > 0) {
+            continue;
+        } else if (opt == 'k') {
+            keep_alive = 1;
+        } else if (opt == 'j') {
+            json = 1;
+        } else if (opt == 'l') {
+            label = optarg;
+        } else if (opt == 'D') {
+            resource_dir = optarg;
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind < 2) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (n_threads > n_connections) {
+        n_threads = n_connections;
+    }
+    host = argv[optind];
+    const char *port = argv[optind + 1];
+
+    for (int i = optind + 2; i < argc; i++) {
+        if (add_resource(argv[i])) {
+            return 1;
+        }
+    }
+    if (n_resources == 0 && add_directory(resource_dir)) {
+        return 1;
+    }
+    if (n_resources == 0) {
+        fprintf(stderr, "no resources to request\n");
+        return 1;
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int ret_val = getaddrinfo(host, port, &hints, &server);
+    if (ret_val) {
+        fprintf(stderr, "getaddrinfo failed: %s\n", gai_strerror(ret_val));
+        return 1;
+    }
+
+    bench_thread_t *threads = calloc(n_threads, sizeof(bench_thread_t));
+    if (threads == NULL) {
+        perror("calloc");
+        freeaddrinfo(server);
+        return 1;
+    }
+    long long start_ns = now_ns();
+    deadline_ns = start_ns + duration_s * 1000000000LL;
+    int n_started = 0;
+    for (; n_started < n_threads; n_started++) {
+        bench_thread_t *thread = &threads[n_started];
+        // Spread the connections as evenly as possible
+        thread->n_connections = n_connections / n_threads + (n_started < n_connections % n_threads);
+        thread->rng = 0x9E3779B97F4A7C15ULL * (n_started + 1) ^ start_ns;
+        ret_val = pthread_create(&thread->thread, NULL, bench_thread, thread);
+        if (ret_val != 0) {
+            fprintf(stderr, "error creating thread number %d: %s\n", n_started, strerror(ret_val));
+            deadline_ns = 0;
+            break;
+        }
+    }
+
+    long requests = 0;
+    long non_2xx = 0;
+    long errors = 0;
+    long long bytes = 0;
+    long n_latencies = 0;
+    for (int i = 0; i < n_started; i++) {
+        pthread_join(threads[i].thread, NULL);
+        requests += threads[i].requests;
+        non_2xx += threads[i].non_2xx;
+        errors += threads[i].errors;
+        bytes += threads[i].bytes;
+        n_latencies += threads[i].n_latencies;
+    }
+    double elapsed_s = (now_ns() - start_ns) / 1e9;
+
+    // Merge every thread's latencies to compute exact percentiles
+    unsigned *latencies = malloc((n_latencies > 0 ? n_latencies : 1) * sizeof(unsigned));
+    if (latencies == NULL) {
+        perror("malloc");
+        n_latencies = 0;
+    }
+    long merged = 0;
+    for (int i = 0; i < n_started; i++) {
+        if (latencies != NULL) {
+            memcpy(latencies + merged, threads[i].latencies_us,
+                   threads[i].n_latencies * sizeof(unsigned));
+            merged += threads[i].n_latencies;
+        }
+        free(threads[i].latencies_us);
+    }
+    qsort(latencies, n_latencies, sizeof(unsigned), compare_unsigned);
+    unsigned p50 = percentile(latencies, n_latencies, 0.50);
+    unsigned p99 = percentile(latencies, n_latencies, 0.99);
+    unsigned p999 = percentile(latencies, n_latencies, 0.999);
+    unsigned max = n_latencies > 0 ? latencies[n_latencies - 1] : 0;
+
+    if (json) {
+        printf("{\"label\": \"%s\", \"connections\": %d, \"threads\": %d, \"keep_alive\": %s, "
+               "\"duration_s\": %.3f, \"requests\": %ld, \"non_2xx\": %ld, \"errors\": %ld, "
+               "\"bytes\": %lld, \"requests_per_s\": %.1f, \"bytes_per_s\": %.1f, "
+               "\"latency_us\": {\"p50\": %u, \"p99\": %u, \"p999\": %u, \"max\": %u}}\n",
+               label, n_connections, n_started, keep_alive ? "true" : "false", elapsed_s,
+               requests, non_2xx, errors, bytes, requests / elapsed_s, bytes / elapsed_s, p50,
+               p99, p999, max);
+    } else {
+        printf("%s%s%d connections on %d threads for %.2f s, keep-alive %s\n", label,
+               *label != '\0' ? ": " : "", n_connections, n_started, elapsed_s,
+               keep_alive ? "on" : "off");
+        printf("  requests: %ld (%ld non-2xx, %ld errors)\n", requests, non_2xx, errors);
+        printf("  throughput: %.1f requests/s, %.2f MiB/s\n", requests / elapsed_s,
+               bytes / elapsed_s / (1024 * 1024));
+        printf("  latency (us): p50 %u, p99 %u, p999 %u, max %u\n", p50, p99, p999, max);
+    }
+
+    free(latencies);
+    for (int i = 0; i < n_resources; i++) {
+        free(resources[i].name);
+    }
+    free(resources);
+    free(threads);
+    freeaddrinfo(server);
+    return errors > 0 && requests == 0 ? 1 : 0;
+}
@@ -0,0 +1,329 @@
+#include "metrics.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define N_STATUS_CLASSES 6    // index status / 100, so 1xx to 5xx plus 0 for anything invalid
+#define RENDER_INITIAL_BUFSIZE 16384
+#define PROMETHEUS_MIN_EXPONENT 10    // exported bucket bounds are 2^10 ns (~1 us) up to 2^40 ns
+
+// Everything one thread has recorded; written only by that thread
+typedef struct metrics_thread {
+    unsigned long counters[N_COUNTERS];
+    unsigned long responses[N_STATUS_CLASSES];
+    unsigned long histograms[N_STAGES][HISTOGRAM_BUCKETS];
+    unsigned long long sums_ns[N_STAGES];
+    struct metrics_thread *next;
+} metrics_thread_t;
+
+// A growing text buffer for rendering
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+    int failed;
+} metrics_buffer_t;
+
+// Names and help text of each stage's metric families
+static const char *const stage_names[N_STAGES] = {
+    "queue_wait", "read_request", "lookup", "send_response", "request",
+};
+static const char *const stage_help[N_STAGES] = {
+    "Time accepted connections waited for a worker.",
+    "Time from the first byte of a request until it was parsed.",
+    "Time spent in stat()/open() or the file cache looking up the resource.",
+    "Time spent sending the response header and body.",
+    "Time from the first byte of a request until its response was sent.",
+};
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static metrics_thread_t *threads = NULL;    // every thread that recorded anything, newest first
+static __thread metrics_thread_t *local = NULL;
+static long (*queue_depth)(void *) = NULL;
+static void *queue_depth_arg = NULL;
+
+long long metrics_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Get the calling thread's metrics, registering them on first use
+ * Returns the thread's metrics, or NULL if they could not be allocated
+ */
+static metrics_thread_t *local_metrics(void) {
+    if (local != NULL) {
+        return local;
+    }
+    metrics_thread_t *metrics = calloc(1, sizeof(metrics_thread_t));
+    if (metrics == NULL) {
+        return NULL;    // metrics are best effort; serving continues without them
+    }
+    pthread_mutex_lock(&threads_lock);
+    metrics->next = threads;
+    threads = metrics;
+    pthread_mutex_unlock(&threads_lock);
+    local = metrics;
+    return local;
+}
+
+/*
+ * Increase a counter that only the calling thread writes
+ * A plain load and store is enough for a single writer; being atomic keeps readers from seeing
+ * a torn value.
+ */
+static void bump(unsigned long *counter, unsigned long n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+/*
+ * Map a duration to its histogram bucket
+ * Returns the bucket index
+ */
+static int bucket_index(unsigned long long value) {
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return value;
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    if (exponent >= HISTOGRAM_MAX_EXPONENT) {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+    int shift = exponent - HISTOGRAM_SUB_BITS;
+    int sub_bucket = (value >> shift) - HISTOGRAM_SUB_BUCKETS;
+    return (shift + 1) * HISTOGRAM_SUB_BUCKETS + sub_bucket;
+}
+
+/*
+ * Get the exclusive upper bound of the durations in a histogram bucket
+ * Returns the bound in nanoseconds
+ */
+static unsigned long long bucket_limit(int index) {
+    if (index < HISTOGRAM_SUB_BUCKETS) {
+        return index + 1;
+    }
+    int shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+    int sub_bucket = index % HISTOGRAM_SUB_BUCKETS;
+    return (unsigned long long) (HISTOGRAM_SUB_BUCKETS + sub_bucket + 1) << shift;
+}
+
+void metrics_record(metric_stage_t stage, long long duration_ns) {
+    metrics_thread_t *metrics = local_metrics();
+    if (metrics == NULL) {
+        return;
+    }
+    unsigned long long value = duration_ns > 0 ? duration_ns : 0;
+    bump(&metrics->histograms[stage][bucket_index(value)], 1);
+    __atomic_store_n(&metrics->sums_ns[stage],
+                     __atomic_load_n(&metrics->sums_ns[stage], __ATOMIC_RELAXED) + value,
+                     __ATOMIC_RELAXED);
+}
+
+void metrics_add(metric_counter_t counter, unsigned long n) {
+    metrics_thread_t *metrics = local_metrics();
+    if (metrics != NULL) {
+        bump(&metrics->counters[counter], n);
+    }
+}
+
+void metrics_count_response(int status, size_t bytes) {
+    metrics_thread_t *metrics = local_metrics();
+    if (metrics == NULL) {
+        return;
+    }
+    int status_class = status / 100;
+    bump(&metrics->responses[status_class > 0 && status_class < N_STATUS_CLASSES ? status_class
+                                                                                  : 0],
+         1);
+    bump(&metrics->counters[COUNTER_RESPONSE_BYTES], bytes);
+}
+
+void metrics_set_queue_depth(long (*depth)(void *), void *arg) {
+    __atomic_store_n(&queue_depth_arg, arg, __ATOMIC_RELAXED);
+    __atomic_store_n(&queue_depth, depth, __ATOMIC_RELAXED);
+}
+
+/*
+ * Append formatted text to a render buffer, growing it as needed
+ * On allocation failure the buffer is marked failed and later appends do nothing.
+ */
+static void append(metrics_buffer_t *buffer, const char *format, ...) {
+    while (!buffer->failed) {
+        va_list args;
+        va_start(args, format);
+        int len = vsnprintf(buffer->data + buffer->len, buffer->cap - buffer->len, format, args);
+        va_end(args);
+        if (len < 0) {
+            buffer->failed = 1;
+        } else if ((size_t) len < buffer->cap - buffer->len) {
+            buffer->len += len;
+            return;
+        } else {
+            char *grown = realloc(buffer->data, buffer->cap * 2 + len);
+            if (grown == NULL) {
+                perror("realloc");
+                buffer->failed = 1;
+            } else {
+                buffer->data = grown;
+                buffer->cap = buffer->cap * 2 + len;
+            }
+        }
+    }
+}
+
+/*
+ * Render one stage's histogram, plus gauges for its quantiles
+ * histogram: The stage's buckets summed over every thread
+ */
+static void render_stage(metrics_buffer_t *buffer, int stage, const unsigned long *histogram,
+                         unsigned long long sum_ns) {
+    const char *name = stage_names[stage];
+    unsigned long count = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        count += histogram[i];
+    }
+
+    // Prometheus buckets are cumulative; export only the power-of-two bounds to keep it short
+    append(buffer, "# HELP http_server_%s_seconds %s\n", name, stage_help[stage]);
+    append(buffer, "# TYPE http_server_%s_seconds histogram\n", name);
+    unsigned long cumulative = 0;
+    int index = 0;
+    for (int exponent = PROMETHEUS_MIN_EXPONENT; exponent <= HISTOGRAM_MAX_EXPONENT; exponent++) {
+        int first_of_next = bucket_index(1ULL << exponent);
+        if (exponent == HISTOGRAM_MAX_EXPONENT) {
+            first_of_next = HISTOGRAM_BUCKETS - 1;
+        }
+        for (; index < first_of_next; index++) {
+            cumulative += histogram[index];
+        }
+        append(buffer, "http_server_%s_seconds_bucket{le=\"%.9g\"} %lu\n", name,
+               (double) (1ULL << exponent) / 1e9, cumulative);
+    }
+    append(buffer, "http_server_%s_seconds_bucket{le=\"+Inf\"} %lu\n", name, count);
+    append(buffer, "http_server_%s_seconds_sum %.9f\n", name, sum_ns / 1e9);
+    append(buffer, "http_server_%s_seconds_count %lu\n", name, count);
+
+    // Quantiles come from the full-resolution buckets, so they are within the histogram's
+    // precision rather than the exported bounds
+    append(buffer, "# HELP http_server_%s_quantile_seconds Quantiles of %s_seconds.\n", name, name);
+    append(buffer, "# TYPE http_server_%s_quantile_seconds gauge\n", name);
+    for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+        unsigned long long limit = 0;
+        if (count > 0) {
+            unsigned long rank = quantiles[q] * count;
+            rank = rank < count ? rank + 1 : count;
+            unsigned long seen = 0;
+            for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+                seen += histogram[i];
+                if (seen >= rank) {
+                    limit = bucket_limit(i);
+                    break;
+                }
+            }
+        }
+        append(buffer, "http_server_%s_quantile_seconds{quantile=\"%g\"} %.9g\n", name,
+               quantiles[q], limit / 1e9);
+    }
+}
+
+char *metrics_render(size_t *len) {
+    metrics_buffer_t buffer;
+    buffer.data = malloc(RENDER_INITIAL_BUFSIZE);
+    buffer.len = 0;
+    buffer.cap = RENDER_INITIAL_BUFSIZE;
+    buffer.failed = 0;
+    // Sum every thread's metrics; the histogram sums are too large for the stack
+    unsigned long (*histograms)[HISTOGRAM_BUCKETS] =
+        calloc(N_STAGES, sizeof(unsigned long[HISTOGRAM_BUCKETS]));
+    if (buffer.data == NULL || histograms == NULL) {
+        perror("malloc");
+        free(buffer.data);
+        free(histograms);
+        return NULL;
+    }
+    unsigned long counters[N_COUNTERS] = {0};
+    unsigned long responses[N_STATUS_CLASSES] = {0};
+    unsigned long long sums_ns[N_STAGES] = {0};
+
+    pthread_mutex_lock(&threads_lock);
+    for (metrics_thread_t *metrics = threads; metrics != NULL; metrics = metrics->next) {
+        for (int i = 0; i < N_COUNTERS; i++) {
+            counters[i] += __atomic_load_n(&metrics->counters[i], __ATOMIC_RELAXED);
+        }
+        for (int i = 0; i < N_STATUS_CLASSES; i++) {
+            responses[i] += __atomic_load_n(&metrics->responses[i], __ATOMIC_RELAXED);
+        }
+        for (int stage = 0; stage < N_STAGES; stage++) {
+            for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+                histograms[stage][i] +=
+                    __atomic_load_n(&metrics->histograms[stage][i], __ATOMIC_RELAXED);
+            }
+            sums_ns[stage] += __atomic_load_n(&metrics->sums_ns[stage], __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&threads_lock);
+
+    append(&buffer, "# HELP http_server_connections_accepted_total Connections accepted.\n");
+    append(&buffer, "# TYPE http_server_connections_accepted_total counter\n");
+    append(&buffer, "http_server_connections_accepted_total %lu\n", counters[COUNTER_ACCEPTED]);
+    append(&buffer, "# HELP http_server_connections_shed_total Accepted connections answered "
+                    "with 503 instead of being queued, by reason.\n");
+    append(&buffer, "# TYPE http_server_connections_shed_total counter\n");
+    append(&buffer, "http_server_connections_shed_total{reason=\"queue_depth\"} %lu\n",
+           counters[COUNTER_SHED_QUEUE_DEPTH]);
+    append(&buffer, "http_server_connections_shed_total{reason=\"queue_wait\"} %lu\n",
+           counters[COUNTER_SHED_QUEUE_WAIT]);
+    append(&buffer, "# HELP http_server_connections_timed_out_total Connections closed because "
+                    "their deadline passed, by what they were waiting for.\n");
+    append(&buffer, "# TYPE http_server_connections_timed_out_total counter\n");
+    append(&buffer, "http_server_connections_timed_out_total{phase=\"idle\"} %lu\n",
+           counters[COUNTER_TIMEOUT_IDLE]);
+    append(&buffer, "http_server_connections_timed_out_total{phase=\"header\"} %lu\n",
+           counters[COUNTER_TIMEOUT_HEADER]);
+    append(&buffer, "http_server_connections_timed_out_total{phase=\"send\"} %lu\n",
+           counters[COUNTER_TIMEOUT_SEND]);
+    append(&buffer, "# HELP http_server_responses_total Responses sent, by status class.\n");
+    append(&buffer, "# TYPE http_server_responses_total counter\n");
+    for (int i = 1; i < N_STATUS_CLASSES; i++) {
+        append(&buffer, "http_server_responses_total{code=\"%dxx\"} %lu\n", i, responses[i]);
+    }
+    append(&buffer, "# HELP http_server_response_bytes_total Bytes of responses sent.\n");
+    append(&buffer, "# TYPE http_server_response_bytes_total counter\n");
+    append(&buffer, "http_server_response_bytes_total %lu\n", counters[COUNTER_RESPONSE_BYTES]);
+    // Loaded once, as a reload may replace the gauge while this renders
+    long (*depth)(void *) = __atomic_load_n(&queue_depth, __ATOMIC_RELAXED);
+    if (depth != NULL) {
+        append(&buffer, "# HELP http_server_queue_depth Accepted connections waiting for a "
+                        "worker.\n");
+        append(&buffer, "# TYPE http_server_queue_depth gauge\n");
+        append(&buffer, "http_server_queue_depth %ld\n",
+               depth(__atomic_load_n(&queue_depth_arg, __ATOMIC_RELAXED)));
+    }
+    for (int stage = 0; stage < N_STAGES; stage++) {
+        render_stage(&buffer, stage, histograms[stage], sums_ns[stage]);
+    }
+    free(histograms);
+
+    if (buffer.failed) {
+        free(buffer.data);
+        return NULL;
+    }
+    *len = buffer.len;
+    return buffer.data;
+}
+
+void metrics_free(void) {
+    pthread_mutex_lock(&threads_lock);
+    while (threads != NULL) {
+        metrics_thread_t *next = threads->next;
+        free(threads);
+        threads = next;
+    }
+    pthread_mutex_unlock(&threads_lock);
+    local = NULL;
+    queue_depth = NULL;
+}
@@ -0,0 +1,88 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+
+#define METRICS_PATH "/__metrics"    // reserved resource name the metrics are served on
+
+// Histograms are log-linear like HDR histograms: each power of two is split into
+// 2^HISTOGRAM_SUB_BITS equal buckets, so any recorded value is off by at most ~6%
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_EXPONENT 40    // values from 2^40 ns (about 18 minutes) up share a bucket
+#define HISTOGRAM_BUCKETS \
+    ((HISTOGRAM_MAX_EXPONENT - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+// Stages of serving a connection whose durations are recorded in histograms
+typedef enum {
+    STAGE_QUEUE_WAIT,       // accepted connection waiting for a worker
+    STAGE_READ_REQUEST,     // first byte of a request until it is fully parsed
+    STAGE_LOOKUP,           // stat()/open() or cache lookup of the resource
+    STAGE_SEND_RESPONSE,    // header and body transfer
+    STAGE_REQUEST,          // first byte of a request until its response is sent
+    N_STAGES,
+} metric_stage_t;
+
+// Monotonic event counters
+typedef enum {
+    COUNTER_ACCEPTED,          // connections accepted
+    COUNTER_RESPONSE_BYTES,    // header and body bytes of completed responses
+    COUNTER_SHED_QUEUE_DEPTH,    // connections turned away because the queue was too long
+    COUNTER_SHED_QUEUE_WAIT,     // connections turned away because queue waits stayed too long
+    COUNTER_TIMEOUT_IDLE,        // persistent connections closed waiting for another request
+    COUNTER_TIMEOUT_HEADER,      // connections closed because a request took too long to arrive
+    COUNTER_TIMEOUT_SEND,        // connections closed because a response stopped draining
+    N_COUNTERS,
+} metric_counter_t;
+
+/*
+ * Read the monotonic clock used for every recorded duration
+ * Returns the current time in nanoseconds
+ */
+long long metrics_now_ns(void);
+
+/*
+ * Record how long a stage took in the calling thread's histogram
+ * Lock-free: each thread only ever writes to its own histograms.
+ * stage: The stage that took duration_ns
+ * duration_ns: The duration in nanoseconds; negative values are recorded as 0
+ */
+void metrics_record(metric_stage_t stage, long long duration_ns);
+
+/*
+ * Add to one of the calling thread's counters
+ * counter: The counter to increase
+ * n: The amount to add
+ */
+void metrics_add(metric_counter_t counter, unsigned long n);
+
+/*
+ * Count a completed response by its status class
+ * status: The HTTP status code sent
+ * bytes: The number of header and body bytes sent
+ */
+void metrics_count_response(int status, size_t bytes);
+
+/*
+ * Report the queue depth gauge from a callback, evaluated whenever the metrics are rendered
+ * The two are replaced separately, so a render racing with a change may pass the new callback
+ * the old argument or the other way round; depth must cope with either.
+ * depth: Returns the number of connections waiting for a worker, or NULL for no gauge
+ * arg: Passed to depth
+ */
+void metrics_set_queue_depth(long (*depth)(void *), void *arg);
+
+/*
+ * Render every thread's metrics combined, in the Prometheus text exposition format
+ * len: Set to the length of the text on success
+ * Returns a malloc'd buffer that the caller must free, or NULL on error
+ */
+char *metrics_render(size_t *len);
+
+/*
+ * Free the metrics of every thread
+ * Must only be called once no other thread records metrics anymore.
+ */
+void metrics_free(void);
+
+#endif    // METRICS_H
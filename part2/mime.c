@@ -0,0 +1,218 @@
+#define _GNU_SOURCE
+
+#include "mime.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+// Types served without any mime.types file: the original six plus the rest of a typical site
+static const struct {
+    const char *extension;
+    const char *type;
+} builtin_types[] = {
+    {"avif", "image/avif"},
+    {"css", "text/css"},
+    {"csv", "text/csv"},
+    {"gif", "image/gif"},
+    {"gz", "application/gzip"},
+    {"htm", "text/html"},
+    {"html", "text/html"},
+    {"ico", "image/vnd.microsoft.icon"},
+    {"jpeg", "image/jpeg"},
+    {"jpg", "image/jpeg"},
+    {"js", "text/javascript"},
+    {"json", "application/json"},
+    {"md", "text/markdown"},
+    {"mjs", "text/javascript"},
+    {"mp3", "audio/mpeg"},
+    {"mp4", "video/mp4"},
+    {"ogg", "audio/ogg"},
+    {"otf", "font/otf"},
+    {"pdf", "application/pdf"},
+    {"png", "image/png"},
+    {"svg", "image/svg+xml"},
+    {"ttf", "font/ttf"},
+    {"txt", "text/plain"},
+    {"wasm", "application/wasm"},
+    {"wav", "audio/wav"},
+    {"webm", "video/webm"},
+    {"webp", "image/webp"},
+    {"woff", "font/woff"},
+    {"woff2", "font/woff2"},
+    {"xml", "application/xml"},
+    {"zip", "application/zip"},
+};
+
+/*
+ * Hash an extension with 32-bit FNV-1a, ignoring case
+ * extension: The NUL-terminated extension to hash
+ * Returns the hash value
+ */
+static unsigned hash_extension(const char *extension) {
+    unsigned hash = 2166136261u;
+    for (const unsigned char *c = (const unsigned char *) extension; *c != '\0'; c++) {
+        hash ^= tolower(*c);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Find the slot holding an extension, or the free slot where it belongs
+ * Returns a pointer into table->slots
+ */
+static mime_entry_t *find_slot(const mime_table_t *table, const char *extension) {
+    size_t mask = table->n_slots - 1;
+    size_t i = hash_extension(extension) & mask;
+    while (table->slots[i].extension != NULL &&
+           strcasecmp(table->slots[i].extension, extension) != 0) {
+        i = (i + 1) & mask;    // linear probing; the table is never more than half full
+    }
+    return &table->slots[i];
+}
+
+/*
+ * Double the number of slots in a table and rehash every entry into them
+ * Returns 0 on success or -1 on error
+ */
+static int grow(mime_table_t *table) {
+    mime_entry_t *old_slots = table->slots;
+    size_t old_n_slots = table->n_slots;
+    table->slots = calloc(old_n_slots * 2, sizeof(mime_entry_t));
+    if (table->slots == NULL) {
+        perror("calloc");
+        table->slots = old_slots;
+        return -1;
+    }
+    table->n_slots = old_n_slots * 2;
+    for (size_t i = 0; i < old_n_slots; i++) {
+        if (old_slots[i].extension != NULL) {
+            *find_slot(table, old_slots[i].extension) = old_slots[i];
+        }
+    }
+    free(old_slots);
+    return 0;
+}
+
+/*
+ * Map an extension to a type, replacing any earlier mapping of it
+ * table: The table to add to
+ * extension: The extension without its leading '.'
+ * extension_len: The length of extension, which need not be NUL-terminated
+ * type: The MIME type, which is copied
+ * Returns 0 on success or -1 on error
+ */
+static int add_type(mime_table_t *table, const char *extension, size_t extension_len,
+                    const char *type) {
+    if ((table->n_entries + 1) * 2 > table->n_slots && grow(table)) {
+        // error message printed in grow()
+        return -1;
+    }
+
+    size_t type_len = strlen(type);
+    char *mapping = malloc(extension_len + 1 + type_len + 1);
+    if (mapping == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    for (size_t i = 0; i < extension_len; i++) {
+        mapping[i] = tolower((unsigned char) extension[i]);
+    }
+    mapping[extension_len] = '\0';
+    memcpy(mapping + extension_len + 1, type, type_len + 1);
+
+    mime_entry_t *slot = find_slot(table, mapping);
+    if (slot->extension != NULL) {
+        free(slot->extension);
+    } else {
+        table->n_entries++;
+    }
+    slot->extension = mapping;
+    slot->type = mapping + extension_len + 1;
+    return 0;
+}
+
+int mime_table_init(mime_table_t *table) {
+    table->slots = calloc(MIME_TABLE_MIN_SLOTS, sizeof(mime_entry_t));
+    if (table->slots == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    table->n_slots = MIME_TABLE_MIN_SLOTS;
+    table->n_entries = 0;
+
+    for (size_t i = 0; i < sizeof(builtin_types) / sizeof(builtin_types[0]); i++) {
+        if (add_type(table, builtin_types[i].extension, strlen(builtin_types[i].extension),
+                     builtin_types[i].type)) {
+            // error message printed in add_type()
+            mime_table_free(table);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int mime_table_load(mime_table_t *table, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror("fopen");
+        return -1;
+    }
+
+    char *line = NULL;
+    size_t line_size = 0;
+    int line_number = 0;
+    int result = 0;
+    while (result == 0 && getline(&line, &line_size, file) != -1) {
+        line_number++;
+        const char *delimiters = " \t\r\n";
+        char *save_ptr;
+        char *type = strtok_r(line, delimiters, &save_ptr);
+        if (type == NULL || *type == '#') {
+            continue;
+        }
+        if (strchr(type, '/') == NULL) {
+            fprintf(stderr, "%s:%d: expected type/subtype\n", path, line_number);
+            result = -1;
+            break;
+        }
+
+        char *extension;
+        while ((extension = strtok_r(NULL, delimiters, &save_ptr)) != NULL) {
+            if (add_type(table, extension, strlen(extension), type)) {
+                // error message printed in add_type()
+                result = -1;
+                break;
+            }
+        }
+    }
+    if (result == 0 && ferror(file)) {
+        perror("getline");
+        result = -1;
+    }
+
+    free(line);
+    if (fclose(file)) {
+        perror("fclose");
+        result = -1;
+    }
+    return result;
+}
+
+const char *mime_table_lookup(const mime_table_t *table, const char *extension) {
+    const mime_entry_t *slot = find_slot(table, extension);
+    return slot->extension != NULL ? slot->type : NULL;
+}
+
+void mime_table_free(mime_table_t *table) {
+    for (size_t i = 0; i < table->n_slots; i++) {
+        free(table->slots[i].extension);
+    }
+    free(table->slots);
+    table->slots = NULL;
+    table->n_slots = 0;
+    table->n_entries = 0;
+}
@@ -0,0 +1,55 @@
+#ifndef MIME_H
+#define MIME_H
+
+#include <stddef.h>
+
+#define DEFAULT_MIME_TYPE "application/octet-stream"
+#define MIME_TABLE_MIN_SLOTS 64
+
+// One file extension and the MIME type it maps to, sharing a single allocation
+typedef struct {
+    char *extension;     // lowercase, without the leading '.', or NULL if the slot is free
+    const char *type;    // points just past extension's terminator
+} mime_entry_t;
+
+// Struct representing an open-addressed hash table from file extensions to MIME types
+// Extensions are matched ignoring case. The table is filled in at startup and only read after
+// that, so lookups take no locks.
+typedef struct {
+    mime_entry_t *slots;
+    size_t n_slots;    // a power of two, kept at least twice n_entries
+    size_t n_entries;
+} mime_table_t;
+
+/*
+ * Initialize a new MIME table holding the built-in types of common web content
+ * table: Pointer to mime_table_t to be initialized
+ * Returns 0 on success or -1 on error
+ */
+int mime_table_init(mime_table_t *table);
+
+/*
+ * Add every type in a mime.types file, replacing earlier mappings of the same extensions
+ * Each line is a type followed by zero or more extensions separated by whitespace; blank lines and
+ * lines starting with '#' are ignored.
+ * table: The table to add to
+ * path: The path of the mime.types file
+ * Returns 0 on success or -1 on error, after which table may be partially updated
+ */
+int mime_table_load(mime_table_t *table, const char *path);
+
+/*
+ * Look up the MIME type of a file extension
+ * table: A pointer to the mime_table_t to search
+ * extension: The extension without its leading '.', in any case
+ * Returns the MIME type, a string that lives as long as the table, or NULL if it is unknown
+ */
+const char *mime_table_lookup(const mime_table_t *table, const char *extension);
+
+/*
+ * Free every mapping in a MIME table
+ * table: The table to free
+ */
+void mime_table_free(mime_table_t *table);
+
+#endif    // MIME_H
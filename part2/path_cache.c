@@ -0,0 +1,205 @@
+#define _GNU_SOURCE
+
+#include "path_cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/openat2.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int has_openat2 = 1;    // cleared once the kernel turns out not to have it
+
+/*
+ * Hash a request path with 32-bit FNV-1a
+ * url: The path to hash
+ * url_len: The length of url
+ * Returns the hash value
+ */
+static unsigned hash_url(const char *url, size_t url_len) {
+    unsigned hash = 2166136261u;
+    for (size_t i = 0; i < url_len; i++) {
+        hash ^= (unsigned char) url[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Get the number of bytes an entry for a request path takes, strings included
+ * Normalizing never lengthens a path, except that an empty one becomes ".".
+ */
+static size_t entry_size(const path_cache_t *cache, size_t url_len) {
+    return sizeof(resolved_path_t) + (url_len + 1) + (url_len + 2) +
+           (cache->serve_dir_len + 1 + url_len + 2);
+}
+
+/*
+ * Reduce a request path to the path below the served directory it names
+ * url: The request path
+ * url_len: The length of url
+ * relative: Set to the normalized path; must have room for url_len + 2 bytes
+ * Returns 0 on success or -1 if ".." climbs above the served directory
+ */
+static int normalize(const char *url, size_t url_len, char *relative) {
+    const char *end = url + url_len;
+    size_t len = 0;
+    for (const char *segment = url; segment < end;) {
+        const char *next = memchr(segment, '/', end - segment);
+        if (next == NULL) {
+            next = end;
+        }
+        size_t segment_len = next - segment;
+        if (segment_len == 2 && segment[0] == '.' && segment[1] == '.') {
+            if (len == 0) {
+                return -1;
+            }
+            while (len > 0 && relative[len - 1] != '/') {
+                len--;
+            }
+            if (len > 0) {    // drop the separator too
+                len--;
+            }
+        } else if (segment_len > 0 && !(segment_len == 1 && segment[0] == '.')) {
+            if (len > 0) {
+                relative[len++] = '/';
+            }
+            memcpy(relative + len, segment, segment_len);
+            len += segment_len;
+        }
+        segment = next + 1;
+    }
+    if (len == 0) {
+        relative[len++] = '.';
+    }
+    relative[len] = '\0';
+    return 0;
+}
+
+/*
+ * Resolve a request path into an entry, laying its strings out right after it
+ * entry: Memory of at least entry_size() bytes
+ */
+static void resolve_into(const path_cache_t *cache, const char *url, size_t url_len,
+                         unsigned hash, resolved_path_t *entry) {
+    entry->url = (char *) (entry + 1);
+    memcpy(entry->url, url, url_len);
+    entry->url[url_len] = '\0';
+    entry->url_len = url_len;
+    entry->hash = hash;
+
+    entry->relative = entry->url + url_len + 1;
+    entry->path = entry->relative + url_len + 2;
+    entry->escapes = normalize(url, url_len, entry->relative) == -1;
+    if (entry->escapes) {
+        entry->relative[0] = '\0';
+        entry->path[0] = '\0';
+        return;
+    }
+    memcpy(entry->path, cache->serve_dir, cache->serve_dir_len);
+    entry->path[cache->serve_dir_len] = '/';
+    strcpy(entry->path + cache->serve_dir_len + 1, entry->relative);
+}
+
+static int matches(const resolved_path_t *entry, unsigned hash, const char *url, size_t url_len) {
+    return entry->hash == hash && entry->url_len == url_len &&
+           memcmp(entry->url, url, url_len) == 0;
+}
+
+int path_cache_init(path_cache_t *cache, const char *serve_dir, size_t capacity) {
+    size_t n_slots = 1;
+    while (n_slots < capacity) {
+        n_slots *= 2;
+    }
+    cache->slots = calloc(n_slots, sizeof(*cache->slots));
+    if (cache->slots == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    cache->mask = n_slots - 1;
+
+    // Only the descriptor is needed to open files beneath the directory, not read access to it
+    cache->dir_fd = open(serve_dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (cache->dir_fd == -1) {
+        perror("open");
+        free(cache->slots);
+        return -1;
+    }
+    cache->serve_dir = serve_dir;
+    cache->serve_dir_len = strlen(serve_dir);
+    while (cache->serve_dir_len > 1 && serve_dir[cache->serve_dir_len - 1] == '/') {
+        cache->serve_dir_len--;
+    }
+    return 0;
+}
+
+const resolved_path_t *path_cache_resolve(path_cache_t *cache, const char *url, size_t url_len,
+                                          arena_t *arena) {
+    unsigned hash = hash_url(url, url_len);
+    size_t size = entry_size(cache, url_len);
+    resolved_path_t *entry = NULL;    // resolved, but not published yet
+    for (size_t probe = 0; probe < PATH_CACHE_PROBES; probe++) {
+        resolved_path_t **slot = &cache->slots[(hash + probe) & cache->mask];
+        resolved_path_t *found = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+        if (found == NULL) {
+            if (entry == NULL) {
+                entry = malloc(size);
+                if (entry == NULL) {
+                    perror("malloc");
+                    return NULL;
+                }
+                resolve_into(cache, url, url_len, hash, entry);
+            }
+            if (__atomic_compare_exchange_n(slot, &found, entry, 0, __ATOMIC_RELEASE,
+                                            __ATOMIC_ACQUIRE)) {
+                return entry;
+            }
+            // Another thread filled the slot first, perhaps with this very path
+        }
+        if (matches(found, hash, url, url_len)) {
+            free(entry);
+            return found;
+        }
+    }
+
+    // Every slot the path may use holds another one, so this resolution lasts only one request
+    free(entry);
+    entry = arena_alloc(arena, size);
+    if (entry == NULL) {
+        // error message printed in arena_alloc()
+        return NULL;
+    }
+    resolve_into(cache, url, url_len, hash, entry);
+    return entry;
+}
+
+int path_cache_open(const path_cache_t *cache, const char *relative) {
+    if (__atomic_load_n(&has_openat2, __ATOMIC_RELAXED)) {
+        struct open_how how = {
+            .flags = O_RDONLY | O_CLOEXEC,
+            .resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS,
+        };
+        int fd = syscall(SYS_openat2, cache->dir_fd, relative, &how, sizeof(how));
+        if (fd != -1 || errno != ENOSYS) {
+            return fd;
+        }
+        __atomic_store_n(&has_openat2, 0, __ATOMIC_RELAXED);
+    }
+    // Normalized paths cannot climb out with "..", but a symbolic link further up still could
+    return openat(cache->dir_fd, relative, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+}
+
+int path_cache_free(path_cache_t *cache) {
+    for (size_t i = 0; i <= cache->mask; i++) {
+        free(cache->slots[i]);
+    }
+    free(cache->slots);
+    if (close(cache->dir_fd) == -1) {
+        perror("close");
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,71 @@
+#ifndef PATH_CACHE_H
+#define PATH_CACHE_H
+
+#include <stddef.h>
+
+#include "arena.h"
+
+#define PATH_CACHE_PROBES 8    // slots searched for a path before giving up
+#define DEFAULT_PATH_CACHE_ENTRIES 4096
+
+// A request path reduced to the file it names below the served directory
+// Resolution is purely lexical: "." and empty segments are dropped and ".." removes the segment
+// before it, so the result only depends on the path and never goes stale.
+typedef struct {
+    char *url;    // the request path as received, which the entry is looked up by
+    size_t url_len;
+    unsigned hash;
+    int escapes;       // nonzero if ".." climbs above the served directory; nothing else is set
+    char *relative;    // normalized path below the served directory, "." for the directory itself
+    char *path;        // the served directory joined with relative, keying the file caches
+} resolved_path_t;
+
+// Struct representing the served directory, open once, plus a lock-free cache of resolved paths
+// Slots are filled once with compare-and-swap and never replaced, so lookups take no lock; once
+// every slot a path probes is taken, the path is resolved again on each request.
+typedef struct {
+    int dir_fd;    // the served directory, opened with O_PATH
+    const char *serve_dir;
+    size_t serve_dir_len;    // without any trailing '/'
+    size_t mask;             // number of slots minus one
+    resolved_path_t **slots;
+} path_cache_t;
+
+/*
+ * Open the served directory and initialize an empty cache of paths resolved below it
+ * cache: Pointer to path_cache_t to be initialized
+ * serve_dir: The directory resources are served from, which must outlive the cache
+ * capacity: Number of paths the cache may hold, rounded up to a power of two
+ * Returns 0 on success or -1 on error
+ */
+int path_cache_init(path_cache_t *cache, const char *serve_dir, size_t capacity);
+
+/*
+ * Resolve a request path, from the cache if it was resolved before
+ * cache: A pointer to the path_cache_t to search
+ * url: The request path, without any query
+ * url_len: The length of url
+ * arena: Holds the resolution if the cache has no room for it
+ * Returns the resolved path, valid until the arena is reset or the cache freed, or NULL on error
+ */
+const resolved_path_t *path_cache_resolve(path_cache_t *cache, const char *url, size_t url_len,
+                                          arena_t *arena);
+
+/*
+ * Open a file for reading relative to the served directory, with one path lookup that refuses to
+ * leave the directory or follow symbolic links
+ * Kernels without openat2() only refuse a symbolic link as the last component.
+ * cache: A pointer to the path_cache_t of the served directory
+ * relative: A normalized path from path_cache_resolve, optionally with a suffix appended
+ * Returns the open file, or -1 with errno set and nothing printed; EXDEV or ELOOP means the path
+ * was refused
+ */
+int path_cache_open(const path_cache_t *cache, const char *relative);
+
+/*
+ * Deallocates the cached paths and closes the served directory
+ * Returns 0 on success or -1 on error
+ */
+int path_cache_free(path_cache_t *cache);
+
+#endif    // PATH_CACHE_H
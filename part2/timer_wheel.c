@@ -0,0 +1,133 @@
+#include "timer_wheel.h"
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+#define MAX_DELTA ((1LL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+/*
+ * Link a timer into the slot its expiry falls in, given how far away it is
+ * wheel: The wheel to link it into
+ * timer: A timer that is not linked into any slot, with expires_tick set
+ */
+static void link_timer(timer_wheel_t *wheel, wheel_timer_t *timer) {
+    long long delta = timer->expires_tick - wheel->now_tick;
+    if (delta < 1) {    // already due: fire on the next tick
+        delta = 1;
+    } else if (delta > MAX_DELTA) {
+        delta = MAX_DELTA;
+    }
+    timer->expires_tick = wheel->now_tick + delta;
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= 1LL << (TIMER_WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+
+    wheel_timer_t **slot =
+        &wheel->slots[level][(timer->expires_tick >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK];
+    timer->next = *slot;
+    if (*slot != NULL) {
+        (*slot)->pprev = &timer->next;
+    }
+    *slot = timer;
+    timer->pprev = slot;
+}
+
+/*
+ * Unlink a pending timer from the slot that holds it
+ * timer: The timer to unlink
+ */
+static void unlink_timer(wheel_timer_t *timer) {
+    *timer->pprev = timer->next;
+    if (timer->next != NULL) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->pprev = NULL;
+}
+
+void timer_wheel_init(timer_wheel_t *wheel, long long now_ms) {
+    wheel->now_tick = now_ms / TIMER_WHEEL_TICK_MS;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (int i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+            wheel->slots[level][i] = NULL;
+        }
+    }
+    wheel->n_timers = 0;
+}
+
+void wheel_timer_init(wheel_timer_t *timer) {
+    timer->pprev = NULL;
+    timer->next = NULL;
+}
+
+void timer_wheel_schedule(timer_wheel_t *wheel, wheel_timer_t *timer, long long expires_ms) {
+    long long expires_tick = (expires_ms + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS;
+    if (timer->pprev != NULL) {
+        if (timer->expires_tick == expires_tick) {
+            return;
+        }
+        unlink_timer(timer);
+    } else {
+        wheel->n_timers++;
+    }
+    timer->expires_tick = expires_tick;
+    link_timer(wheel, timer);
+}
+
+void timer_wheel_cancel(timer_wheel_t *wheel, wheel_timer_t *timer) {
+    if (timer->pprev != NULL) {
+        unlink_timer(timer);
+        wheel->n_timers--;
+    }
+}
+
+wheel_timer_t *timer_wheel_advance(timer_wheel_t *wheel, long long now_ms) {
+    long long target_tick = now_ms / TIMER_WHEEL_TICK_MS;
+    if (wheel->n_timers == 0) {    // nothing to expire or cascade on the way
+        if (target_tick > wheel->now_tick) {
+            wheel->now_tick = target_tick;
+        }
+        return NULL;
+    }
+
+    wheel_timer_t *expired = NULL;
+    while (wheel->now_tick < target_tick) {
+        wheel->now_tick++;
+        // At the start of each turn of a level, spread the next slot of the level above over it
+        for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            if ((wheel->now_tick & ((1LL << (TIMER_WHEEL_BITS * level)) - 1)) != 0) {
+                break;
+            }
+            wheel_timer_t **slot =
+                &wheel->slots[level][(wheel->now_tick >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK];
+            wheel_timer_t *timer = *slot;
+            *slot = NULL;
+            while (timer != NULL) {
+                wheel_timer_t *next = timer->next;
+                link_timer(wheel, timer);
+                timer = next;
+            }
+        }
+
+        wheel_timer_t **slot = &wheel->slots[0][wheel->now_tick & SLOT_MASK];
+        while (*slot != NULL) {
+            wheel_timer_t *timer = *slot;
+            unlink_timer(timer);
+            wheel->n_timers--;
+            timer->next = expired;
+            expired = timer;
+        }
+    }
+    return expired;
+}
+
+int timer_wheel_timeout(const timer_wheel_t *wheel) {
+    if (wheel->n_timers == 0) {
+        return -1;
+    }
+    // Sleep until the next busy slot of level 0, or else until the next cascade may fill one
+    int ticks = 1;
+    while (ticks < TIMER_WHEEL_SLOTS - (wheel->now_tick & SLOT_MASK) &&
+           wheel->slots[0][(wheel->now_tick + ticks) & SLOT_MASK] == NULL) {
+        ticks++;
+    }
+    return ticks * TIMER_WHEEL_TICK_MS;
+}
@@ -0,0 +1,73 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stddef.h>
+
+#define TIMER_WHEEL_TICK_MS 10
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4    // 64^4 ticks of 10 ms, about 46 hours; later timers are clamped
+
+// A deadline embedded in the structure it belongs to
+typedef struct wheel_timer {
+    long long expires_tick;
+    struct wheel_timer **pprev;    // the link pointing at this timer, or NULL if not pending
+    struct wheel_timer *next;      // also links the list timer_wheel_advance returns
+} wheel_timer_t;
+
+// Struct representing a hierarchical timing wheel owned by a single thread
+// Level 0 has one slot per tick; each slot of level n spans a whole turn of level n - 1 and is
+// cascaded down into it when that turn begins. Scheduling and cancelling are O(1), and expiring
+// touches only timers that are due or being cascaded, however many are pending.
+typedef struct {
+    long long now_tick;    // the last tick that has been processed
+    wheel_timer_t *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    size_t n_timers;
+} timer_wheel_t;
+
+/*
+ * Initialize a new, empty timer wheel
+ * wheel: Pointer to timer_wheel_t to be initialized
+ * now_ms: The current time in milliseconds
+ */
+void timer_wheel_init(timer_wheel_t *wheel, long long now_ms);
+
+/*
+ * Initialize a timer that is not scheduled
+ * timer: Pointer to wheel_timer_t to be initialized
+ */
+void wheel_timer_init(wheel_timer_t *timer);
+
+/*
+ * Schedule a timer, moving it if it is already pending
+ * The timer fires on the first tick at or after the deadline.
+ * wheel: The wheel to schedule it on
+ * timer: The timer to schedule
+ * expires_ms: The deadline in milliseconds, on the clock passed to the wheel
+ */
+void timer_wheel_schedule(timer_wheel_t *wheel, wheel_timer_t *timer, long long expires_ms);
+
+/*
+ * Unschedule a timer if it is pending
+ * wheel: The wheel the timer was scheduled on
+ * timer: The timer to cancel
+ */
+void timer_wheel_cancel(timer_wheel_t *wheel, wheel_timer_t *timer);
+
+/*
+ * Process every tick up to the current time
+ * wheel: The wheel to advance
+ * now_ms: The current time in milliseconds
+ * Returns the timers that expired, linked through their next fields and no longer pending, or
+ * NULL if none did
+ */
+wheel_timer_t *timer_wheel_advance(timer_wheel_t *wheel, long long now_ms);
+
+/*
+ * Get how long a thread can sleep before the wheel next needs advancing
+ * wheel: The wheel, freshly advanced
+ * Returns a timeout in milliseconds for poll()-like calls, or -1 if no timer is pending
+ */
+int timer_wheel_timeout(const timer_wheel_t *wheel);
+
+#endif    // TIMER_WHEEL_H
@@ -0,0 +1,204 @@
+#define _GNU_SOURCE
+
+#include "uring.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define RETRY_WAIT_MS 100    // longest wait for a completion that frees room to submit
+
+int uring_supports(const int *ops, int n_ops) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(SYS_io_uring_setup, 1, &params);
+    if (fd == -1) {    // ENOSYS on old kernels, EPERM where io_uring is disabled
+        return 0;
+    }
+
+    size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probe_size);
+    int supported =
+        probe != NULL && syscall(SYS_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (int i = 0; supported && i < n_ops; i++) {
+        supported = ops[i] <= probe->last_op &&
+                    (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED) != 0;
+    }
+    free(probe);
+    close(fd);
+    return supported;
+}
+
+int uring_init(uring_t *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CLAMP;
+    ring->fd = syscall(SYS_io_uring_setup, entries, &params);
+    if (ring->fd == -1) {
+        perror("io_uring_setup");
+        return -1;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        perror("mmap");
+        close(ring->fd);
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            perror("mmap");
+            munmap(ring->sq_ring, ring->sq_ring_size);
+            close(ring->fd);
+            return -1;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        perror("mmap");
+        if (ring->cq_ring != ring->sq_ring) {
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+        return -1;
+    }
+
+    char *sq = ring->sq_ring;
+    ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+    char *cq = ring->cq_ring;
+    ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    ring->to_submit = 0;
+    return 0;
+}
+
+void uring_free(uring_t *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    if (close(ring->fd) == -1) {
+        perror("close");
+    }
+}
+
+/*
+ * Pass every pending submission queue entry to the kernel
+ * ring: The ring to submit to
+ * wait: The number of completions to wait for
+ * timeout_ms: How long to wait for them in milliseconds, or -1 to wait indefinitely
+ * Returns 0 on success or -1 on error
+ */
+static int uring_enter(uring_t *ring, unsigned wait, int timeout_ms) {
+    struct __kernel_timespec timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000LL};
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uintptr_t) &timeout;
+    unsigned flags = wait > 0 ? IORING_ENTER_GETEVENTS : 0;
+    if (wait > 0 && timeout_ms >= 0) {
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+
+    while (1) {
+        int submitted = flags & IORING_ENTER_EXT_ARG
+                            ? syscall(SYS_io_uring_enter, ring->fd, ring->to_submit, wait, flags,
+                                      &arg, sizeof(arg))
+                            : syscall(SYS_io_uring_enter, ring->fd, ring->to_submit, wait, flags,
+                                      NULL, 0);
+        if (submitted >= 0) {
+            ring->to_submit -= submitted;
+            return 0;
+        } else if (errno == EINTR || errno == ETIME) {
+            // Entries are consumed before the wait, so a cut short wait is not an error
+            return 0;
+        } else if (errno != EAGAIN && errno != EBUSY) {
+            perror("io_uring_enter");
+            return -1;
+        }
+        // Out of kernel resources or the completion queue is overflowing: only reaping
+        // completions helps, so let the caller reap those already posted, or else wait a bounded
+        // time for one instead of retrying at once
+        if (wait > 0 || uring_peek_cqe(ring) != NULL) {
+            return 0;
+        }
+        wait = 1;
+        timeout.tv_sec = RETRY_WAIT_MS / 1000;
+        timeout.tv_nsec = (RETRY_WAIT_MS % 1000) * 1000000LL;
+        flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    }
+}
+
+struct io_uring_sqe *uring_get_sqe(uring_t *ring) {
+    unsigned tail = *ring->sq_tail;
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries) {
+        if (uring_enter(ring, 0, -1)) {
+            return NULL;
+        }
+        if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries) {
+            fprintf(stderr, "io_uring submission queue full\n");
+            return NULL;
+        }
+    }
+
+    unsigned index = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    // Without SQPOLL the kernel only reads entries inside io_uring_enter(), so the tail can move
+    // before the caller has filled the entry in
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+    return sqe;
+}
+
+int uring_submit_and_wait(uring_t *ring, int timeout_ms) {
+    return uring_enter(ring, 1, timeout_ms);
+}
+
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int uring_register(uring_t *ring, unsigned opcode, const void *arg, unsigned n_args) {
+    if (syscall(SYS_io_uring_register, ring->fd, opcode, arg, n_args) == -1) {
+        perror("io_uring_register");
+        return -1;
+    }
+    return 0;
+}
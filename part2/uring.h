@@ -0,0 +1,91 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+// An io_uring instance with its submission and completion rings mapped into this process
+// Not thread-safe: a ring belongs to the one thread that submits to and reaps from it.
+typedef struct {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned to_submit;    // SQEs filled in since the last io_uring_enter()
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;    // same mapping as sq_ring when the kernel supports a single mmap
+    size_t cq_ring_size;
+    size_t sqes_size;
+} uring_t;
+
+/*
+ * Check whether the kernel supports every io_uring operation in a list
+ * ops: The IORING_OP_* opcodes needed
+ * n_ops: The number of opcodes
+ * Returns 1 if all are supported, or 0 if io_uring or any operation is unavailable
+ */
+int uring_supports(const int *ops, int n_ops);
+
+/*
+ * Create a ring and map its queues
+ * ring: Pointer to uring_t to be initialized
+ * entries: The number of submission queue entries, rounded up to a power of two by the kernel
+ * Returns 0 on success or -1 on error
+ */
+int uring_init(uring_t *ring, unsigned entries);
+
+/*
+ * Unmap a ring's queues and close it, cancelling any operations still in flight
+ * ring: A pointer to the uring_t to free
+ */
+void uring_free(uring_t *ring);
+
+/*
+ * Get a zeroed submission queue entry to fill in
+ * If the submission queue is full, the pending entries are submitted first to make room.
+ * ring: The ring to submit to
+ * Returns the entry, or NULL on error
+ */
+struct io_uring_sqe *uring_get_sqe(uring_t *ring);
+
+/*
+ * Submit every pending entry in one system call and wait for at least one completion
+ * ring: The ring to submit to
+ * timeout_ms: How long to wait in milliseconds, or -1 to wait indefinitely
+ * Returns 0 on success or -1 on error; an interrupted or timed out wait counts as success
+ */
+int uring_submit_and_wait(uring_t *ring, int timeout_ms);
+
+/*
+ * Get the oldest completion that has not been consumed yet, without waiting
+ * ring: The ring to reap from
+ * Returns the completion, or NULL if the completion queue is empty
+ */
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring);
+
+/*
+ * Hand the completion returned by uring_peek_cqe back to the kernel
+ * ring: The ring the completion came from
+ */
+void uring_cqe_seen(uring_t *ring);
+
+/*
+ * Register resources with a ring, such as fixed files or buffers
+ * ring: The ring to register with
+ * opcode: The IORING_REGISTER_* operation
+ * arg: The operation's argument
+ * n_args: The number of entries in arg
+ * Returns 0 on success or -1 on error
+ */
+int uring_register(uring_t *ring, unsigned opcode, const void *arg, unsigned n_args);
+
+#endif    // URING_H
@@ -0,0 +1,731 @@
+#define _GNU_SOURCE
+
+#include "uring_engine.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "affinity.h"
+#include "http_connection.h"
+#include "metrics.h"
+#include "timer_wheel.h"
+#include "uring.h"
+
+// Operations a completion can belong to, kept in the low bits of its user_data
+typedef enum {
+    OP_ACCEPT,
+    OP_WAKE,
+    OP_READ,
+    OP_SHUTDOWN,
+    OP_SEND,
+    OP_SPLICE_IN,
+    OP_SPLICE_OUT,
+    OP_CLOSE,
+} uring_op_t;
+
+#define OP_MASK 7    // user_data pointers are at least 8-byte aligned
+
+struct uring_loop;
+
+// A connection owned by one loop, linked into that loop's list of live connections
+// The requests and responses are handled by http, which the loop feeds with completions.
+typedef struct uring_connection {
+    http_connection_t http;    // its request buffer lies in the ring's registered buffer
+    struct uring_loop *loop;
+    int slot;    // index of the client socket in the ring's fixed file table
+    wheel_timer_t timer;    // fires at http.deadline
+    struct msghdr msg;
+    int pipe_fds[2];     // pipe file bodies are spliced through, or -1 until the first one
+    size_t pipe_len;     // bytes of the body after http.body_offset that are in the pipe
+    int splicing;        // splices of the current chunk that have not completed yet
+
+    int in_flight;    // submitted operations that have not completed yet
+    int closing;      // no new operations except the final close
+    struct uring_connection *prev;
+    struct uring_connection *next;
+} uring_connection_t;
+
+// State private to a single loop thread
+typedef struct uring_loop {
+    uring_engine_t *engine;
+    int listen_fd;    // this loop's listening socket
+    uring_t ring;
+    uring_connection_t *slots;    // one per fixed file slot, registered with the ring as a buffer
+    uring_connection_t *connections;
+    timer_wheel_t wheel;    // deadlines of the connections
+    int in_flight;    // submitted operations of the whole ring that have not completed yet
+    int accepting;    // whether the multishot accept is armed
+    int stopping;
+    int draining;     // accepting has stopped to let the connections finish
+    int failed;       // the ring can no longer be submitted to
+} uring_loop_t;
+
+static void advance_connection(uring_connection_t *conn);
+
+int uring_engine_supported(void) {
+    // Multishot accept and IORING_ASYNC_CANCEL_ANY cannot be probed for directly, but arrived in
+    // the same release as IORING_OP_SOCKET
+    static const int ops[] = {
+        IORING_OP_ACCEPT,   IORING_OP_READ_FIXED, IORING_OP_SENDMSG,      IORING_OP_SPLICE,
+        IORING_OP_CLOSE,    IORING_OP_SHUTDOWN,   IORING_OP_ASYNC_CANCEL, IORING_OP_POLL_ADD,
+        IORING_OP_SOCKET,
+    };
+    return uring_supports(ops, sizeof(ops) / sizeof(ops[0]));
+}
+
+/*
+ * Get a submission queue entry tagged with the operation and object it completes for
+ * loop: The loop submitting the operation
+ * owner: The loop or connection the completion is dispatched to
+ * op: The operation
+ * Returns the entry, or NULL after marking the loop failed
+ */
+static struct io_uring_sqe *loop_sqe(uring_loop_t *loop, void *owner, uring_op_t op) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+    if (sqe == NULL) {
+        loop->failed = 1;
+        return NULL;
+    }
+    sqe->user_data = (uintptr_t) owner | op;
+    loop->in_flight++;
+    return sqe;
+}
+
+static struct io_uring_sqe *conn_sqe(uring_connection_t *conn, uring_op_t op) {
+    struct io_uring_sqe *sqe = loop_sqe(conn->loop, conn, op);
+    if (sqe != NULL) {
+        conn->in_flight++;
+    }
+    return sqe;
+}
+
+/*
+ * Arm a multishot accept that installs each new client directly into a free fixed file slot
+ * The listening socket is non-blocking, as other engines may accept from it during a reload, so
+ * kernels that fail such accepts with EAGAIN instead of waiting get a poll linked in front.
+ * loop: The loop to accept clients for
+ * poll_first: Whether to wait for a client with a poll before accepting
+ */
+static void arm_accept(uring_loop_t *loop, int poll_first) {
+    if (poll_first) {
+        struct io_uring_sqe *sqe = loop_sqe(loop, NULL, 0);
+        if (sqe == NULL) {
+            return;
+        }
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = loop->listen_fd;
+        sqe->poll32_events = POLLIN;
+        sqe->flags = IOSQE_IO_LINK;
+    }
+    struct io_uring_sqe *sqe = loop_sqe(loop, loop, OP_ACCEPT);
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->file_index = IORING_FILE_INDEX_ALLOC;
+    loop->accepting = 1;
+}
+
+/*
+ * Unlink a connection from its loop and release what it holds, once its socket has been closed
+ * conn: The connection to destroy, whose slot may then be reused
+ */
+static void destroy_connection(uring_connection_t *conn) {
+    uring_loop_t *loop = conn->loop;
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    } else {
+        loop->connections = conn->next;
+    }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    }
+    timer_wheel_cancel(&loop->wheel, &conn->timer);
+    http_connection_close(&conn->http);
+    if (conn->pipe_fds[0] != -1) {
+        close(conn->pipe_fds[0]);
+        close(conn->pipe_fds[1]);
+    }
+
+    // A full fixed file table stops the multishot accept; a free slot lets it resume
+    if (!loop->accepting && !loop->stopping && !loop->draining && !loop->failed) {
+        arm_accept(loop, 0);
+    }
+}
+
+/*
+ * Close a connection once none of its operations are in flight anymore
+ * conn: The connection to close
+ */
+static void close_connection(uring_connection_t *conn) {
+    conn->closing = 1;
+    timer_wheel_cancel(&conn->loop->wheel, &conn->timer);
+    if (conn->in_flight > 0) {
+        return;
+    }
+    struct io_uring_sqe *sqe = conn_sqe(conn, OP_CLOSE);
+    if (sqe == NULL) {    // the loop is failing and destroys every connection on its way out
+        return;
+    }
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = conn->slot + 1;
+}
+
+/*
+ * Move a connection's timer to its current deadline
+ * conn: The connection, which is not closing
+ */
+static void schedule_deadline(uring_connection_t *conn) {
+    if (conn->http.deadline.phase == TIMEOUT_NONE) {
+        timer_wheel_cancel(&conn->loop->wheel, &conn->timer);
+    } else {
+        // Rounded up to whole milliseconds, so the timer never fires before the deadline
+        timer_wheel_schedule(&conn->loop->wheel, &conn->timer,
+                             (conn->http.deadline.deadline_ns + 999999) / 1000000);
+    }
+}
+
+/*
+ * Close a connection that may have operations pending
+ * They are not canceled but failed, by shutting the socket down: a splice blocked in a kernel
+ * worker cannot be canceled.
+ * conn: The connection, which is not closing
+ */
+static void shutdown_connection(uring_connection_t *conn) {
+    if (conn->in_flight > 0) {
+        struct io_uring_sqe *sqe = conn_sqe(conn, OP_SHUTDOWN);
+        if (sqe != NULL) {
+            sqe->opcode = IORING_OP_SHUTDOWN;
+            sqe->flags = IOSQE_FIXED_FILE;
+            sqe->fd = conn->slot;
+            sqe->len = SHUT_RDWR;
+        }
+    }
+    close_connection(conn);
+}
+
+/*
+ * Close a connection whose deadline has passed, counting it
+ * conn: The connection, which is not closing
+ */
+static void expire_connection(uring_connection_t *conn) {
+    http_connection_count_timeout(&conn->http.deadline);
+    shutdown_connection(conn);
+}
+
+/*
+ * Stop accepting and close the connections waiting for another request, leaving the loop to
+ * exit once the rest have finished
+ * loop: The loop to drain
+ */
+static void start_drain(uring_loop_t *loop) {
+    loop->draining = 1;
+    if (loop->accepting) {
+        // By descriptor, so that a poll the accept is linked behind goes too
+        struct io_uring_sqe *sqe = loop_sqe(loop, NULL, 0);
+        if (sqe != NULL) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = loop->listen_fd;
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        }
+    }
+    for (uring_connection_t *conn = loop->connections; conn != NULL; conn = conn->next) {
+        if (!conn->closing && conn->http.deadline.phase == TIMEOUT_IDLE) {
+            shutdown_connection(conn);
+        }
+    }
+}
+
+/*
+ * Start serving a client that was accepted into a fixed file slot
+ * loop: The loop that will own the connection
+ * slot: The fixed file slot holding the client's socket
+ */
+static void add_connection(uring_loop_t *loop, int slot) {
+    metrics_add(COUNTER_ACCEPTED, 1);
+
+    uring_connection_t *conn = &loop->slots[slot];
+    // The socket is only known to the ring, so every read and send goes through the loop
+    http_connection_init(&conn->http, -1, loop->engine->paths, &loop->engine->draining);
+    conn->loop = loop;
+    conn->slot = slot;
+    wheel_timer_init(&conn->timer);
+    conn->pipe_fds[0] = conn->pipe_fds[1] = -1;
+    conn->pipe_len = 0;
+    conn->splicing = 0;
+    conn->in_flight = 0;
+    conn->closing = 0;
+    conn->prev = NULL;
+    conn->next = loop->connections;
+    if (loop->connections != NULL) {
+        loop->connections->prev = conn;
+    }
+    loop->connections = conn;
+
+    advance_connection(conn);
+    if (!conn->closing) {
+        schedule_deadline(conn);
+    }
+}
+
+/*
+ * Receive more of a request into the free part of the connection's request buffer
+ * conn: The connection waiting for a request
+ */
+static void start_read(uring_connection_t *conn) {
+    if (conn->loop->stopping) {
+        close_connection(conn);
+        return;
+    }
+
+    struct io_uring_sqe *sqe = conn_sqe(conn, OP_READ);
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = conn->slot;
+    sqe->addr = (uintptr_t) (conn->http.request + conn->http.request_len);
+    sqe->len = REQUEST_BUFSIZE - conn->http.request_len;
+    sqe->buf_index = 0;
+}
+
+/*
+ * Send the unsent in-memory part of the response: the header, plus the body if it is cached
+ * conn: The connection being answered
+ */
+static void send_header(uring_connection_t *conn) {
+    struct io_uring_sqe *sqe = conn_sqe(conn, OP_SEND);
+    if (sqe == NULL) {
+        return;
+    }
+    memset(&conn->msg, 0, sizeof(conn->msg));
+    conn->msg.msg_iov = conn->http.iov_next;
+    conn->msg.msg_iovlen = conn->http.iov_left;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = conn->slot;
+    sqe->addr = (uintptr_t) &conn->msg;
+    sqe->len = 1;
+    sqe->msg_flags = http_response_msg_flags(&conn->http.response);
+}
+
+/*
+ * Stream the next chunk of a file body as a linked pair of splices: file to pipe, then pipe to
+ * socket
+ * If the socket took only part of the previous chunk, the rest is drained from the pipe first.
+ * conn: The connection whose header has been sent
+ */
+static void send_body(uring_connection_t *conn) {
+    if (conn->pipe_fds[0] == -1 && pipe2(conn->pipe_fds, O_CLOEXEC) == -1) {
+        perror("pipe2");
+        close_connection(conn);
+        return;
+    }
+
+    const http_response_t *response = &conn->http.response;
+    size_t len = conn->pipe_len;
+    if (len == 0) {
+        off_t remaining = response->body_start + response->body_len - conn->http.body_offset;
+        len = remaining < URING_SPLICE_CHUNK ? remaining : URING_SPLICE_CHUNK;
+
+        struct io_uring_sqe *sqe = conn_sqe(conn, OP_SPLICE_IN);
+        if (sqe == NULL) {
+            return;
+        }
+        sqe->opcode = IORING_OP_SPLICE;
+        sqe->flags = IOSQE_IO_LINK;    // a short read cancels the send of the whole chunk
+        sqe->splice_fd_in = response->resource;
+        sqe->splice_off_in = conn->http.body_offset;
+        sqe->fd = conn->pipe_fds[1];
+        sqe->off = -1;
+        sqe->len = len;
+        conn->splicing++;
+    }
+
+    struct io_uring_sqe *sqe = conn_sqe(conn, OP_SPLICE_OUT);
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->splice_fd_in = conn->pipe_fds[0];
+    sqe->splice_off_in = -1;
+    sqe->fd = conn->slot;
+    sqe->off = -1;
+    sqe->len = len;
+    conn->splicing++;
+}
+
+/*
+ * Let a connection answer whatever it has received, then submit the read or send it waits for
+ * conn: The connection, which has no read or send in flight
+ */
+static void advance_connection(uring_connection_t *conn) {
+    switch (http_connection_process(&conn->http)) {
+        case CONN_WANT_READ:
+            start_read(conn);
+            break;
+        case CONN_WANT_WRITE:
+            if (conn->http.state == CONN_SENDING_HEADER) {
+                send_header(conn);
+            } else {
+                send_body(conn);
+            }
+            break;
+        default:    // CONN_DONE or CONN_ERROR
+            close_connection(conn);
+            break;
+    }
+}
+
+/*
+ * Handle the completion of an operation submitted for a connection
+ * conn: The connection the operation belonged to
+ * op: The operation
+ * res: The operation's result: a byte count, or a negated errno value
+ */
+static void complete_connection_op(uring_connection_t *conn, uring_op_t op, int res) {
+    switch (op) {
+        case OP_READ:
+            if (res <= 0) {
+                if (res < 0 && res != -ECONNRESET) {
+                    fprintf(stderr, "read: %s\n", strerror(-res));
+                }
+                close_connection(conn);
+                return;
+            }
+            http_connection_received(&conn->http, res);
+            advance_connection(conn);
+            break;
+        case OP_SEND:
+            if (res < 0) {
+                if (res != -EPIPE && res != -ECONNRESET) {
+                    fprintf(stderr, "sendmsg: %s\n", strerror(-res));
+                }
+                close_connection(conn);
+                return;
+            }
+            http_connection_sent(&conn->http, res);
+            advance_connection(conn);
+            break;
+        case OP_SPLICE_IN:
+            conn->splicing--;
+            if (res <= 0) {
+                fprintf(stderr, "splice: %s\n", res == 0 ? "file truncated" : strerror(-res));
+                close_connection(conn);
+                return;
+            }
+            conn->pipe_len += res;
+            break;
+        case OP_SPLICE_OUT:
+            conn->splicing--;
+            if (res == -ECANCELED) {    // the file half of the pair came up short
+                break;
+            } else if (res < 0) {
+                if (res != -EPIPE && res != -ECONNRESET) {
+                    fprintf(stderr, "splice: %s\n", strerror(-res));
+                }
+                close_connection(conn);
+                return;
+            }
+            conn->pipe_len -= res;
+            http_connection_sent(&conn->http, res);
+            break;
+        default:    // OP_SHUTDOWN: the operations it fails report the outcome
+            break;
+    }
+
+    // Both halves of a splice pair have to complete before the next chunk starts
+    if ((op == OP_SPLICE_IN || op == OP_SPLICE_OUT) && conn->splicing == 0) {
+        advance_connection(conn);
+    }
+}
+
+/*
+ * Dispatch a completion to the loop or connection it belongs to
+ * loop: The loop that reaped the completion
+ * cqe: The completion
+ */
+static void handle_completion(uring_loop_t *loop, const struct io_uring_cqe *cqe) {
+    if (cqe->user_data == 0) {    // an operation nothing waits on, such as the final cancel
+        loop->in_flight--;
+        return;
+    }
+    uring_op_t op = cqe->user_data & OP_MASK;
+    void *owner = (void *) (uintptr_t) (cqe->user_data & ~(uint64_t) OP_MASK);
+
+    if (op == OP_ACCEPT) {
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            loop->in_flight--;
+            loop->accepting = 0;
+        }
+        if (cqe->res >= 0) {
+            add_connection(loop, cqe->res);
+        } else if (cqe->res != -ECANCELED && cqe->res != -ENFILE && cqe->res != -EAGAIN) {
+            fprintf(stderr, "accept: %s\n", strerror(-cqe->res));
+        }
+        // With every fixed file slot taken, accepting resumes when a connection closes
+        if (!loop->accepting && !loop->stopping && !loop->draining && cqe->res != -ENFILE) {
+            arm_accept(loop, cqe->res == -EAGAIN);
+        }
+        return;
+    } else if (op == OP_WAKE) {
+        loop->in_flight--;
+        if (__atomic_load_n(&loop->engine->draining, __ATOMIC_RELAXED)) {
+            start_drain(loop);
+        } else if (!loop->stopping) {
+            // Stop accepting and cut every pending operation short so connections close
+            loop->stopping = 1;
+            struct io_uring_sqe *sqe = loop_sqe(loop, NULL, 0);
+            if (sqe != NULL) {
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+            }
+        }
+        return;
+    }
+
+    uring_connection_t *conn = owner;
+    loop->in_flight--;
+    conn->in_flight--;
+    if (op == OP_CLOSE) {
+        destroy_connection(conn);
+        return;
+    }
+    if (loop->stopping) {
+        conn->closing = 1;
+    }
+    if (!conn->closing) {
+        complete_connection_op(conn, op, cqe->res);
+    }
+    if (conn->closing) {
+        close_connection(conn);
+    } else {
+        schedule_deadline(conn);
+    }
+}
+
+/*
+ * Close every connection whose deadline has passed
+ * loop: The loop whose timers should be advanced
+ */
+static void expire_connections(uring_loop_t *loop) {
+    wheel_timer_t *timer = timer_wheel_advance(&loop->wheel, metrics_now_ns() / 1000000);
+    while (timer != NULL) {
+        wheel_timer_t *next = timer->next;
+        expire_connection(
+            (uring_connection_t *) ((char *) timer - offsetof(uring_connection_t, timer)));
+        timer = next;
+    }
+}
+
+/*
+ * @brief io_uring loop thread function
+ *
+ * @details Submits everything queued while handling the previous batch of completions in one
+ * system call, then handles the next batch, until the engine is stopped (or drained) and every
+ * operation has completed. Waits no longer than the timer wheel allows, so connections are
+ * closed when their deadline passes.
+ *
+ * @param arg should be a uring_loop_t pointer owned by this thread
+ */
+static void *uring_loop_thread(void *arg) {
+    uring_loop_t *loop = (uring_loop_t *) arg;
+
+    arm_accept(loop, 0);
+    struct io_uring_sqe *sqe = loop_sqe(loop, loop, OP_WAKE);
+    if (sqe != NULL) {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = loop->engine->wake_fd;
+        sqe->poll32_events = POLLIN;
+    }
+
+    timer_wheel_init(&loop->wheel, metrics_now_ns() / 1000000);
+    while (!loop->failed && !((loop->stopping || loop->draining) && loop->in_flight == 0)) {
+        if (uring_submit_and_wait(&loop->ring, timer_wheel_timeout(&loop->wheel))) {
+            break;
+        }
+        // Without timers the wheel may have slept for ages; catch it up (which is O(1) while it
+        // is empty) before scheduling anything on it
+        if (loop->wheel.n_timers == 0) {
+            timer_wheel_advance(&loop->wheel, metrics_now_ns() / 1000000);
+        }
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(&loop->ring)) != NULL) {
+            struct io_uring_cqe completion = *cqe;
+            uring_cqe_seen(&loop->ring);
+            handle_completion(loop, &completion);
+        }
+        expire_connections(loop);
+    }
+
+    // Freeing the ring cancels anything still in flight and closes every fixed file
+    uring_free(&loop->ring);
+    loop->stopping = 1;
+    while (loop->connections != NULL) {
+        destroy_connection(loop->connections);
+    }
+    free(loop->slots);
+    free(loop);
+    return NULL;
+}
+
+/*
+ * Create the ring for one loop and register its connection slots and fixed file table
+ * engine: The engine the loop belongs to
+ * listen_fd: The listening socket the loop accepts from
+ * loop: Set to the new uring_loop_t on success
+ * Returns 0 on success, URING_UNAVAILABLE if the kernel refuses the ring or its registrations
+ * (such as a RLIMIT_MEMLOCK too low for the buffer), or -1 on error
+ */
+static int create_uring_loop(uring_engine_t *engine, int listen_fd, uring_loop_t **loop) {
+    uring_loop_t *new_loop = malloc(sizeof(uring_loop_t));
+    if (new_loop == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    new_loop->engine = engine;
+    new_loop->listen_fd = listen_fd;
+    new_loop->connections = NULL;
+    new_loop->in_flight = 0;
+    new_loop->accepting = 0;
+    new_loop->stopping = 0;
+    new_loop->draining = 0;
+    new_loop->failed = 0;
+    size_t slots_size = (size_t) URING_MAX_CONNECTIONS * sizeof(uring_connection_t);
+    new_loop->slots = malloc(slots_size);
+    if (new_loop->slots == NULL) {
+        perror("malloc");
+        free(new_loop);
+        return -1;
+    }
+    if (uring_init(&new_loop->ring, URING_ENTRIES)) {
+        // error message printed in uring_init()
+        free(new_loop->slots);
+        free(new_loop);
+        return URING_UNAVAILABLE;
+    }
+
+    // One registered buffer spans every slot's connection, so requests are read with READ_FIXED
+    // straight into the request buffers of their http_connection_t
+    struct iovec buffers = {new_loop->slots, slots_size};
+    int fds[URING_MAX_CONNECTIONS];
+    for (int i = 0; i < URING_MAX_CONNECTIONS; i++) {
+        fds[i] = -1;    // sparse: slots are filled in by accept
+    }
+    if (uring_register(&new_loop->ring, IORING_REGISTER_BUFFERS, &buffers, 1) ||
+        uring_register(&new_loop->ring, IORING_REGISTER_FILES, fds, URING_MAX_CONNECTIONS)) {
+        // error message printed in uring_register()
+        uring_free(&new_loop->ring);
+        free(new_loop->slots);
+        free(new_loop);
+        return URING_UNAVAILABLE;
+    }
+    *loop = new_loop;
+    return 0;
+}
+
+/*
+ * Wake every loop thread and join the first n of them
+ * engine: The engine whose threads should exit
+ * n: The number of threads that were successfully created
+ * Returns 0 on success or -1 on error
+ */
+static int join_uring_loops(uring_engine_t *engine, int n) {
+    int result = 0;
+    uint64_t one = 1;
+    if (write(engine->wake_fd, &one, sizeof(one)) == -1) {
+        perror("write");
+        result = -1;
+    }
+    for (int i = 0; i < n; i++) {
+        int ret_val = pthread_join(engine->threads[i], NULL);
+        if (ret_val != 0) {
+            fprintf(stderr, "pthread_join failed: %s\n", strerror(ret_val));
+            result = -1;
+        }
+    }
+    return result;
+}
+
+int uring_engine_start(uring_engine_t *engine, const int *listen_fds, int n_listeners,
+                       path_cache_t *paths, int n_loops) {
+    if (n_listeners < 1 || n_listeners > n_loops) {
+        fprintf(stderr, "invalid number of listening sockets %d\n", n_listeners);
+        return -1;
+    }
+    engine->listen_fds = listen_fds;
+    engine->n_listeners = n_listeners;
+    engine->paths = paths;
+    engine->n_loops = n_loops;
+    engine->draining = 0;
+
+    engine->wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (engine->wake_fd == -1) {
+        perror("eventfd");
+        return -1;
+    }
+    engine->threads = malloc(n_loops * sizeof(pthread_t));
+    if (engine->threads == NULL) {
+        perror("malloc");
+        close(engine->wake_fd);
+        return -1;
+    }
+
+    for (int i = 0; i < n_loops; i++) {
+        // Built on the loop's CPU, so its ring and registered buffers are allocated on that CPU's
+        // NUMA node
+        if (affinity_pin(i)) {
+            join_uring_loops(engine, i);
+            free(engine->threads);
+            close(engine->wake_fd);
+            return -1;
+        }
+        uring_loop_t *loop;
+        int result = create_uring_loop(engine, listen_fds[i % n_listeners], &loop);
+        affinity_unpin();
+        if (result != 0) {
+            join_uring_loops(engine, i);
+            free(engine->threads);
+            close(engine->wake_fd);
+            return result;
+        }
+        int ret_val = affinity_thread_create(&engine->threads[i], i, uring_loop_thread, loop);
+        if (ret_val != 0) {
+            fprintf(stderr, "error creating io_uring loop number %d: %s\n", i, strerror(ret_val));
+            uring_free(&loop->ring);
+            free(loop->slots);
+            free(loop);
+            join_uring_loops(engine, i);
+            free(engine->threads);
+            close(engine->wake_fd);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int uring_engine_stop(uring_engine_t *engine, int drain) {
+    // Connections read the flag as they finish requests, so it is set before the loops wake
+    __atomic_store_n(&engine->draining, drain, __ATOMIC_RELAXED);
+    int result = join_uring_loops(engine, engine->n_loops);
+    free(engine->threads);
+    if (close(engine->wake_fd) == -1) {
+        perror("close");
+        result = -1;
+    }
+    return result;
+}
@@ -0,0 +1,61 @@
+#ifndef URING_ENGINE_H
+#define URING_ENGINE_H
+
+#include <pthread.h>
+
+#include "path_cache.h"
+
+#define URING_ENTRIES 256             // submission queue entries per ring
+#define URING_MAX_CONNECTIONS 1024    // fixed file slots, and so open connections, per ring
+#define URING_SPLICE_CHUNK 65536      // bytes moved per splice, the default pipe capacity
+#define URING_UNAVAILABLE 1           // uring_engine_start() result: use another engine instead
+
+// Struct representing a set of threads that each drive many connections through an io_uring
+// Like the epoll engine, loop i accepts from listening socket i % n_listeners. Each loop keeps
+// a multishot accept armed that installs clients straight into its fixed file table, and feeds
+// each client's http_connection_t with completions: requests are received into connections
+// registered with the ring as one buffer, and file bodies stream through linked
+// file->pipe->socket splices. All submissions made while handling a batch of completions go to
+// the kernel in a single io_uring_enter().
+typedef struct {
+    const int *listen_fds;
+    int n_listeners;
+    int wake_fd;     // eventfd that becomes readable when the engine is stopping
+    int draining;    // whether stopping loops let their connections finish first
+    path_cache_t *paths;
+    int n_loops;
+    pthread_t *threads;
+} uring_engine_t;
+
+/*
+ * Check whether the kernel supports everything the io_uring engine uses
+ * Returns 1 if it does, or 0 if the server should fall back to another engine
+ */
+int uring_engine_supported(void);
+
+/*
+ * Start the io_uring loop threads of an engine
+ * The listening sockets are left non-blocking, as they are shared with any engine serving
+ * alongside this one.
+ * engine: Pointer to uring_engine_t to be started
+ * listen_fds: The listening TCP sockets to accept clients from; must outlive the engine
+ * n_listeners: The number of listening sockets, at most n_loops
+ * paths: The cache of paths resolved beneath the served directory
+ * n_loops: The number of loop threads to run
+ * Returns 0 on success, URING_UNAVAILABLE if the kernel refuses the rings or the memory they
+ * register (RLIMIT_MEMLOCK), or -1 on error
+ */
+int uring_engine_start(uring_engine_t *engine, const int *listen_fds, int n_listeners,
+                       path_cache_t *paths, int n_loops);
+
+/*
+ * Stop all loop threads and free the engine
+ * Does not close the listening sockets.
+ * engine: A pointer to the uring_engine_t to stop
+ * drain: 0 to close every connection at once, or 1 to stop accepting, close idle connections
+ *        and wait for the others to finish their requests (see http_connection_draining)
+ * Returns 0 on success or -1 on error
+ */
+int uring_engine_stop(uring_engine_t *engine, int drain);
+
+#endif    // URING_ENGINE_H
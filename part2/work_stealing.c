@@ -0,0 +1,290 @@
+#include "work_stealing.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "admission.h"
+#include "futex.h"
+#include "metrics.h"
+
+/*
+ * Push a file descriptor onto the bottom of a deque
+ * Must only be called by the acceptor that owns the deque.
+ * Returns 0 on success or -1 if the deque is full
+ */
+static int deque_push(work_deque_t *deque, int connection_fd) {
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    if (bottom - top > deque->mask) {
+        return -1;
+    }
+    __atomic_store_n(&deque->client_fds[bottom & deque->mask], connection_fd, __ATOMIC_RELAXED);
+    __atomic_store_n(&deque->enqueued_ns[bottom & deque->mask], metrics_now_ns(),
+                     __ATOMIC_RELAXED);
+    // Sequentially consistent so a worker deciding whether to park cannot miss this fd
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+/*
+ * Take the file descriptor at the top of a deque, racing the owner and other thieves for it
+ * Returns the file descriptor or -1 if the deque is empty
+ */
+static int deque_steal(work_deque_t *deque) {
+    while (1) {
+        long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+        if (top >= bottom) {
+            return -1;
+        }
+        // The slot cannot be reused by a push until top moves past it, so reading first is safe
+        int connection_fd =
+            __atomic_load_n(&deque->client_fds[top & deque->mask], __ATOMIC_RELAXED);
+        long long enqueued_ns =
+            __atomic_load_n(&deque->enqueued_ns[top & deque->mask], __ATOMIC_RELAXED);
+        if (__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0, __ATOMIC_SEQ_CST,
+                                        __ATOMIC_RELAXED)) {
+            long long wait_ns = metrics_now_ns() - enqueued_ns;
+            metrics_record(STAGE_QUEUE_WAIT, wait_ns);
+            admission_observe_wait(wait_ns);
+            return connection_fd;
+        }
+    }
+}
+
+static int deque_is_empty(work_deque_t *deque) {
+    return __atomic_load_n(&deque->top, __ATOMIC_SEQ_CST) >=
+           __atomic_load_n(&deque->bottom, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Bump a worker's futex word and wake it
+ * deque: The deque of the worker to wake
+ */
+static void wake_worker(work_deque_t *deque) {
+    __atomic_add_fetch(&deque->wakeup, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&deque->wakeup, 1);
+}
+
+/*
+ * Wake the worker a connection was given to if it is parked; otherwise, since it is busy, wake
+ * some other parked worker so it can steal the connection
+ * scheduler: The scheduler the connection was submitted to
+ * worker: The index of the worker whose deque received the connection
+ */
+static void notify_workers(work_scheduler_t *scheduler, int worker) {
+    for (int i = 0; i < scheduler->n_workers; i++) {
+        work_deque_t *deque = &scheduler->deques[(worker + i) % scheduler->n_workers];
+        if (__atomic_load_n(&deque->parked, __ATOMIC_SEQ_CST)) {
+            wake_worker(deque);
+            return;
+        }
+    }
+}
+
+int work_scheduler_init(work_scheduler_t *scheduler, int n_workers, int n_acceptors,
+                        int capacity) {
+    if (n_workers < 1 || n_acceptors < 1 || n_acceptors > n_workers || capacity < 1 ||
+        capacity > (1 << 30)) {
+        fprintf(stderr, "invalid work scheduler size\n");
+        return -1;
+    }
+    long size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    scheduler->next_worker = calloc(n_acceptors, sizeof(int));
+    if (scheduler->next_worker == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    scheduler->deques = calloc(n_workers, sizeof(work_deque_t));
+    if (scheduler->deques == NULL) {
+        perror("calloc");
+        free(scheduler->next_worker);
+        return -1;
+    }
+    for (int i = 0; i < n_workers; i++) {
+        scheduler->deques[i].client_fds = malloc(size * sizeof(int));
+        scheduler->deques[i].enqueued_ns = malloc(size * sizeof(long long));
+        if (scheduler->deques[i].client_fds == NULL || scheduler->deques[i].enqueued_ns == NULL) {
+            perror("malloc");
+            for (int j = 0; j <= i; j++) {
+                free(scheduler->deques[j].client_fds);
+                free(scheduler->deques[j].enqueued_ns);
+            }
+            free(scheduler->deques);
+            free(scheduler->next_worker);
+            return -1;
+        }
+        scheduler->deques[i].mask = size - 1;
+    }
+    for (int i = 0; i < n_acceptors; i++) {
+        scheduler->next_worker[i] = i;
+    }
+    scheduler->n_workers = n_workers;
+    scheduler->n_acceptors = n_acceptors;
+    scheduler->not_full = 0;
+    scheduler->full_waiters = 0;
+    scheduler->shutdown = 0;
+
+    return 0;
+}
+
+/*
+ * Push a connection onto the first of an acceptor's deques with room, round-robin
+ * Must only be called by that acceptor.
+ * Returns 0 on success or -1 if all of the acceptor's deques are full
+ */
+static int push_round_robin(work_scheduler_t *scheduler, int acceptor, int connection_fd) {
+    int *next_worker = &scheduler->next_worker[acceptor];
+    // Walk only this acceptor's deques, starting from where it left off
+    int worker = *next_worker;
+    do {
+        if (deque_push(&scheduler->deques[worker], connection_fd) == 0) {
+            *next_worker = worker + scheduler->n_acceptors;
+            if (*next_worker >= scheduler->n_workers) {
+                *next_worker = acceptor;
+            }
+            notify_workers(scheduler, worker);
+            return 0;
+        }
+        worker += scheduler->n_acceptors;
+        if (worker >= scheduler->n_workers) {
+            worker = acceptor;
+        }
+    } while (worker != *next_worker);
+    return -1;
+}
+
+int work_scheduler_submit(work_scheduler_t *scheduler, int acceptor, int connection_fd) {
+    while (1) {
+        if (__atomic_load_n(&scheduler->shutdown, __ATOMIC_ACQUIRE)) {
+            return -1;
+        }
+
+        unsigned seen = __atomic_load_n(&scheduler->not_full, __ATOMIC_SEQ_CST);
+        if (push_round_robin(scheduler, acceptor, connection_fd) == 0) {
+            return 0;
+        }
+
+        // All of this acceptor's deques are full; any take after 'seen' was read makes the futex
+        // wait return at once
+        __atomic_add_fetch(&scheduler->full_waiters, 1, __ATOMIC_SEQ_CST);
+        int result = 0;
+        if (!__atomic_load_n(&scheduler->shutdown, __ATOMIC_SEQ_CST)) {
+            result = futex_wait(&scheduler->not_full, seen);
+        }
+        __atomic_sub_fetch(&scheduler->full_waiters, 1, __ATOMIC_SEQ_CST);
+        if (result) {
+            return -1;
+        }
+    }
+}
+
+int work_scheduler_try_submit(work_scheduler_t *scheduler, int acceptor, int worker,
+                              int connection_fd) {
+    if (__atomic_load_n(&scheduler->shutdown, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+    // Only the acceptor may push to a deque, so other workers' deques fall back to round-robin
+    if (worker >= 0 && worker < scheduler->n_workers &&
+        worker % scheduler->n_acceptors == acceptor &&
+        deque_push(&scheduler->deques[worker], connection_fd) == 0) {
+        notify_workers(scheduler, worker);
+        return 0;
+    }
+    return push_round_robin(scheduler, acceptor, connection_fd) == 0 ? 0 : 1;
+}
+
+/*
+ * Take a connection from a worker's own deque, or else steal one from the other deques
+ * Returns the file descriptor or -1 if every deque is empty
+ */
+static int find_work(work_scheduler_t *scheduler, int worker) {
+    for (int i = 0; i < scheduler->n_workers; i++) {
+        int connection_fd = deque_steal(&scheduler->deques[(worker + i) % scheduler->n_workers]);
+        if (connection_fd != -1) {
+            // Room was made in a deque; only its owner can use it, so let every blocked acceptor
+            // retry rather than guess which one that is
+            __atomic_add_fetch(&scheduler->not_full, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&scheduler->full_waiters, __ATOMIC_SEQ_CST) > 0) {
+                futex_wake(&scheduler->not_full, INT_MAX);
+            }
+            return connection_fd;
+        }
+    }
+    return -1;
+}
+
+int work_scheduler_take(work_scheduler_t *scheduler, int worker) {
+    work_deque_t *own = &scheduler->deques[worker];
+
+    while (1) {
+        if (__atomic_load_n(&scheduler->shutdown, __ATOMIC_ACQUIRE)) {
+            return -1;
+        }
+        int connection_fd = find_work(scheduler, worker);
+        if (connection_fd != -1) {
+            return connection_fd;
+        }
+
+        // Nothing anywhere: advertise that this worker is parked, then re-check every deque so a
+        // push that raced with the announcement is not missed
+        unsigned seen = __atomic_load_n(&own->wakeup, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&own->parked, 1, __ATOMIC_SEQ_CST);
+        int found_work = __atomic_load_n(&scheduler->shutdown, __ATOMIC_SEQ_CST);
+        for (int i = 0; i < scheduler->n_workers && !found_work; i++) {
+            found_work = !deque_is_empty(&scheduler->deques[i]);
+        }
+        int result = 0;
+        if (!found_work) {
+            result = futex_wait(&own->wakeup, seen);
+        }
+        __atomic_store_n(&own->parked, 0, __ATOMIC_SEQ_CST);
+        if (result) {
+            return -1;
+        }
+    }
+}
+
+long work_scheduler_depth(work_scheduler_t *scheduler) {
+    long depth = 0;
+    for (int i = 0; i < scheduler->n_workers; i++) {
+        long top = __atomic_load_n(&scheduler->deques[i].top, __ATOMIC_RELAXED);
+        long bottom = __atomic_load_n(&scheduler->deques[i].bottom, __ATOMIC_RELAXED);
+        depth += bottom > top ? bottom - top : 0;
+    }
+    return depth;
+}
+
+int work_scheduler_shutdown(work_scheduler_t *scheduler) {
+    int result = 0;
+    __atomic_store_n(&scheduler->shutdown, 1, __ATOMIC_SEQ_CST);
+    // wake the acceptors and every worker so all blocked threads see the shutdown
+    __atomic_add_fetch(&scheduler->not_full, 1, __ATOMIC_SEQ_CST);
+    if (futex_wake(&scheduler->not_full, INT_MAX)) {
+        result = -1;
+    }
+    for (int i = 0; i < scheduler->n_workers; i++) {
+        wake_worker(&scheduler->deques[i]);
+    }
+
+    return result;
+}
+
+int work_scheduler_free(work_scheduler_t *scheduler) {
+    for (int i = 0; i < scheduler->n_workers; i++) {
+        free(scheduler->deques[i].client_fds);
+        free(scheduler->deques[i].enqueued_ns);
+    }
+    free(scheduler->deques);
+    scheduler->deques = NULL;
+    free(scheduler->next_worker);
+    scheduler->next_worker = NULL;
+
+    return 0;
+}
@@ -0,0 +1,102 @@
+#ifndef WORK_STEALING_H
+#define WORK_STEALING_H
+
+#include "connection_queue.h"
+
+// A Chase-Lev style deque of client fds owned by one worker
+// Only one acceptor pushes, at the bottom; the owning worker and thieves all take from the top
+// with compare-and-swap, so connections are served in arrival order
+typedef struct {
+    long top __attribute__((aligned(CACHE_LINE_SIZE)));       // next fd to take
+    long bottom __attribute__((aligned(CACHE_LINE_SIZE)));    // next free slot
+    int *client_fds;
+    long long *enqueued_ns;    // when each fd was pushed, to measure its wait for a worker
+    long mask;                 // capacity - 1
+
+    // Futex word the owning worker parks on, and whether it is parked
+    unsigned wakeup __attribute__((aligned(CACHE_LINE_SIZE)));
+    int parked;
+} work_deque_t;
+
+// Struct representing a set of per-worker deques that the acceptors fill round-robin
+// Acceptor a owns the deques of workers a, a + n_acceptors, ... so every deque keeps a single
+// producer. Idle workers steal from the deques of busy ones before parking
+typedef struct {
+    work_deque_t *deques;
+    int n_workers;
+    int n_acceptors;
+    int *next_worker;    // round-robin position of each acceptor, only touched by that acceptor
+
+    // Futex word the acceptors park on when all of their deques are full
+    unsigned not_full __attribute__((aligned(CACHE_LINE_SIZE)));
+    int full_waiters;
+    int shutdown;
+} work_scheduler_t;
+
+/*
+ * Initialize a work-stealing scheduler.
+ * scheduler: Pointer to work_scheduler_t to be initialized
+ * n_workers: The number of workers, each of which gets its own deque
+ * n_acceptors: The number of threads that will submit connections, at most n_workers
+ * capacity: The number of fds each deque can hold, rounded up to a power of two
+ * Returns 0 on success or -1 on error
+ */
+int work_scheduler_init(work_scheduler_t *scheduler, int n_workers, int n_acceptors,
+                        int capacity);
+
+/*
+ * Hand a new connection to the next of an acceptor's workers in round-robin order, skipping
+ * workers whose deques are full. If all of them are full, then this function blocks until space
+ * becomes available.
+ * Each acceptor index must only be used from one thread at a time.
+ * scheduler: A pointer to the work_scheduler_t to add to
+ * acceptor: The index of the calling acceptor
+ * connection_fd: The socket file descriptor to add
+ * Returns 0 on success or -1 on error or shutdown
+ */
+int work_scheduler_submit(work_scheduler_t *scheduler, int acceptor, int connection_fd);
+
+/*
+ * Hand a new connection to a worker without blocking
+ * scheduler: A pointer to the work_scheduler_t to submit to
+ * acceptor: The index of the calling acceptor
+ * worker: The worker to hand it to if that worker's deque is one of the acceptor's and has room,
+ *         or -1 for the next of the acceptor's workers in round-robin order
+ * connection_fd: The socket file descriptor to hand over
+ * Returns 0 on success, 1 if all of the acceptor's deques are full, or -1 if shut down
+ */
+int work_scheduler_try_submit(work_scheduler_t *scheduler, int acceptor, int worker,
+                              int connection_fd);
+
+/*
+ * Take the next connection for a worker: first from its own deque, then stolen from another's.
+ * If there is no work anywhere, then this function blocks until some arrives.
+ * scheduler: A pointer to the work_scheduler_t to take from
+ * worker: The index of the calling worker
+ * Returns the removed socket file descriptor on success or -1 on error or shutdown
+ */
+int work_scheduler_take(work_scheduler_t *scheduler, int worker);
+
+/*
+ * Get the number of connections waiting in all of the deques
+ * The value is a snapshot that may already be out of date when it is returned.
+ * scheduler: A pointer to the work_scheduler_t to inspect
+ * Returns the number of queued connections
+ */
+long work_scheduler_depth(work_scheduler_t *scheduler);
+
+/*
+ * Cleanly shuts down the scheduler. All threads currently blocked in submit or take are
+ * unblocked and an error is returned to them.
+ * scheduler: A pointer to the work_scheduler_t to shut down
+ * Returns 0 on success or -1 on error
+ */
+int work_scheduler_shutdown(work_scheduler_t *scheduler);
+
+/*
+ * Deallocates and cleans up any resources associated with a scheduler.
+ * Returns 0 on success or -1 on error
+ */
+int work_scheduler_free(work_scheduler_t *scheduler);
+
+#endif    // WORK_STEALING_H